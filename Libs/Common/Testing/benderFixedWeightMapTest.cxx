@@ -0,0 +1,202 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Check that a FixedWeightMap keeps the K largest weights of each voxel of
+// a weight map, renormalized to sum to one, for every value type. Weights
+// that round to zero in the value type, between larger ones, must not hide
+// the weights after them.
+//
+// Usage: benderFixedWeightMapTest
+
+// Bender includes
+#include "benderFixedWeightMap.h"
+#include "benderWeightMap.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace
+{
+typedef bender::VoxelIndex::Voxel Voxel;
+typedef bender::VoxelIndex::Region Region;
+typedef bender::WeightMap<unsigned char, float> WeightMapType;
+typedef std::pair<float, unsigned char> Influence;
+
+const int NumberOfSites = 10;
+
+//-------------------------------------------------------------------------------
+bool LessSiteIndex(const Influence& a, const Influence& b)
+{
+  return a.second<b.second;
+}
+
+//-------------------------------------------------------------------------------
+// Weights of a box of voxels, from 1 to 10 sites per voxel, with tiny
+// weights between larger ones
+void CreateWeightMap(WeightMapType& weightMap)
+{
+  Region::IndexType start;
+  start[0] = 0;
+  start[1] = 2;
+  start[2] = 1;
+  Region::SizeType size;
+  size[0] = 5;
+  size[1] = 4;
+  size[2] = 3;
+  Region region(start, size);
+
+  std::vector<Voxel> voxels;
+  for(itk::IndexValueType z=start[2]; z<start[2]+static_cast<itk::IndexValueType>(size[2]); ++z)
+    {
+    for(itk::IndexValueType y=start[1]; y<start[1]+static_cast<itk::IndexValueType>(size[1]); ++y)
+      {
+      for(itk::IndexValueType x=start[0]; x<start[0]+static_cast<itk::IndexValueType>(size[0]); ++x)
+        {
+        Voxel v;
+        v[0] = x;
+        v[1] = y;
+        v[2] = z;
+        voxels.push_back(v);
+        }
+      }
+    }
+
+  weightMap.Init(voxels, region);
+  for(size_t j=0; j<voxels.size(); ++j)
+    {
+    const size_t numWeights = 1+j%NumberOfSites;
+    for(size_t k=0; k<numWeights; ++k)
+      {
+      const int site = static_cast<int>((3*j+7*k)%NumberOfSites);
+      const float value = (j+k)%3==0 ? 1.0e-7f : 0.05f*(1+(5*j+k)%7);
+      weightMap.Insert(voxels[j], static_cast<unsigned char>(site), value);
+      }
+    }
+  weightMap.Finalize();
+}
+
+//-------------------------------------------------------------------------------
+// The K largest weights of the j-th voxel, renormalized, converted to the
+// value type, without the zeros and sorted by site index. Return whether a
+// zero is followed by a larger weight.
+template<unsigned int K, class TValue>
+bool GetExpectedWeights(const WeightMapType& weightMap, size_t j, std::vector<Influence>& expected)
+{
+  std::vector<Influence> influences;
+  for(size_t k=0; k<weightMap.GetRowSize(j); ++k)
+    {
+    influences.push_back(Influence(weightMap.GetRowValues(j)[k], weightMap.GetRowIndices(j)[k]));
+    }
+  std::sort(influences.begin(), influences.end(), std::greater<Influence>());
+  influences.resize(std::min(influences.size(), static_cast<size_t>(K)));
+  std::sort(influences.begin(), influences.end(), LessSiteIndex);
+  float sum(0);
+  for(size_t k=0; k<influences.size(); ++k)
+    {
+    sum+= influences[k].first;
+    }
+
+  expected.clear();
+  bool hasZero(false);
+  bool hidden(false);
+  for(size_t k=0; k<influences.size(); ++k)
+    {
+    const float value = TValue(influences[k].first/sum);
+    if(value>0)
+      {
+      expected.push_back(Influence(value, influences[k].second));
+      hidden = hidden || hasZero;
+      }
+    hasZero = hasZero || value==0;
+    }
+  return hidden;
+}
+
+//-------------------------------------------------------------------------------
+template<unsigned int K, class TValue>
+bool TestFixedWeightMap(const WeightMapType& weightMap)
+{
+  typedef bender::FixedWeightMap<K, unsigned char, TValue> FixedWeightMapType;
+  FixedWeightMapType fixedMap;
+  fixedMap.Init(weightMap);
+
+  std::vector<Influence> expected;
+  bender::SparseWeightVector values;
+  typename FixedWeightMapType::WeightVector denseValues(NumberOfSites);
+  size_t numHidden(0);
+  for(size_t j=0; j<weightMap.GetNumberOfVoxels(); ++j)
+    {
+    const Voxel v = weightMap.GetVoxel(j);
+    numHidden+= GetExpectedWeights<K, TValue>(weightMap, j, expected) ? 1 : 0;
+    fixedMap.Get(v, values);
+    fixedMap.Get(v, denseValues);
+
+    bool same = values.GetSize()==expected.size();
+    float denseSum(0);
+    for(int i=0; i<NumberOfSites; ++i)
+      {
+      denseSum+= denseValues[i];
+      }
+    float sum(0);
+    for(size_t k=0; k<values.GetSize() && same; ++k)
+      {
+      same = values.GetIndex(k)==expected[k].second && values.GetValue(k)==expected[k].first
+        && denseValues[values.GetIndex(k)]==values.GetValue(k);
+      sum+= values.GetValue(k);
+      }
+    same = same && sum==denseSum && std::fabs(sum-1.0f)<=1.0e-3f;
+    if(!same)
+      {
+      std::cerr << "FixedWeightMap<" << K << "," << bender::WeightValueTraits<TValue>::GetName()
+                << "> has other weights at " << v << ": " << values.GetSize() << " weights, "
+                << expected.size() << " expected" << std::endl;
+      return false;
+      }
+    }
+  if(bender::WeightValueTraits<TValue>::GetType()==bender::Fixed16Weight && numHidden==0)
+    {
+    std::cerr << "No fixed16 weight that rounds to zero is followed by a larger one" << std::endl;
+    return false;
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderFixedWeightMapTest(int, char*[])
+{
+  WeightMapType weightMap;
+  CreateWeightMap(weightMap);
+  if(!TestFixedWeightMap<4, float>(weightMap)
+     || !TestFixedWeightMap<4, bender::HalfFloat>(weightMap)
+     || !TestFixedWeightMap<4, bender::Fixed16>(weightMap)
+     || !TestFixedWeightMap<8, float>(weightMap)
+     || !TestFixedWeightMap<8, bender::Fixed16>(weightMap))
+    {
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
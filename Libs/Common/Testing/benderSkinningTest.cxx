@@ -0,0 +1,424 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Check that the float kernels of LinearBlendSkinning and
+// DualQuaternionSkinning pose the vertices like the double precision math
+// of PoseBody: the blend of the rigid transforms applied to the vertex
+// (RigidTransform::Apply), and the blend of the unit dual quaternions
+// normalized and converted back to a rotation and a translation
+// (QuatTrans2UDQ, DQ2QuatTrans and ApplyQT). The vertex ranges do not start or end on a
+// block, some vertices have no weight and some blend a bone with its
+// antipodal copy (-q), which is the same rigid transform.
+//
+// Usage: benderSkinningTest
+
+// Bender includes
+#include "benderSkinning.h"
+#include "benderWeightMapMath.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+const int NumberOfBones = 6;
+const size_t NumberOfVertices = 37;
+
+//-------------------------------------------------------------------------------
+// A bone maps x to R*(x-center)+center+translation, R is the rotation of the
+// unit quaternion (w,x,y,z), like RigidTransform in PoseBody
+struct Bone
+{
+  double Rotation[4];
+  double Center[3];
+  double Translation[3];
+
+  void GetMatrix(double matrix[3][3]) const
+  {
+    const double* q = this->Rotation;
+    const double ww = q[0]*q[0];
+    const double xx = q[1]*q[1];
+    const double yy = q[2]*q[2];
+    const double zz = q[3]*q[3];
+    matrix[0][0] = ww+xx-yy-zz;
+    matrix[0][1] = 2.0*(q[1]*q[2]-q[0]*q[3]);
+    matrix[0][2] = 2.0*(q[1]*q[3]+q[0]*q[2]);
+    matrix[1][0] = 2.0*(q[1]*q[2]+q[0]*q[3]);
+    matrix[1][1] = ww-xx+yy-zz;
+    matrix[1][2] = 2.0*(q[2]*q[3]-q[0]*q[1]);
+    matrix[2][0] = 2.0*(q[1]*q[3]-q[0]*q[2]);
+    matrix[2][1] = 2.0*(q[2]*q[3]+q[0]*q[1]);
+    matrix[2][2] = ww-xx-yy+zz;
+  }
+  // The translation of x -> R*x+t
+  void GetTranslation(double t[3]) const
+  {
+    double matrix[3][3];
+    this->GetMatrix(matrix);
+    for(int r=0; r<3; ++r)
+      {
+      t[r] = this->Center[r]+this->Translation[r];
+      for(int c=0; c<3; ++c)
+        {
+        t[r]-= matrix[r][c]*this->Center[c];
+        }
+      }
+  }
+  void Apply(const double in[3], double out[3]) const
+  {
+    double matrix[3][3];
+    this->GetMatrix(matrix);
+    for(int r=0; r<3; ++r)
+      {
+      out[r] = this->Center[r]+this->Translation[r];
+      for(int c=0; c<3; ++c)
+        {
+        out[r]+= matrix[r][c]*(in[c]-this->Center[c]);
+        }
+      }
+  }
+};
+
+//-------------------------------------------------------------------------------
+// Unit dual quaternion of a unit quaternion and a translation (QuatTrans2UDQ)
+void QuatTrans2UDQ(const double q0[4], const double t[3], double dq[2][4])
+{
+  for(int i=0; i<4; ++i)
+    {
+    dq[0][i] = q0[i];
+    }
+  dq[1][0] = -0.5*(t[0]*q0[1] + t[1]*q0[2] + t[2]*q0[3]);
+  dq[1][1] = 0.5*(t[0]*q0[0] + t[1]*q0[3] - t[2]*q0[2]);
+  dq[1][2] = 0.5*(-t[0]*q0[3] + t[1]*q0[0] + t[2]*q0[1]);
+  dq[1][3] = 0.5*(t[0]*q0[2] - t[1]*q0[1] + t[2]*q0[0]);
+}
+
+//-------------------------------------------------------------------------------
+// Unit quaternion and translation of a dual quaternion (DQ2QuatTrans). The
+// translation is only divided by the norm of the real part, it is the one of
+// the normalized dual quaternion only if the norm is 1.
+void DQ2QuatTrans(const double dq[2][4], double q0[4], double t[3])
+{
+  double len(0);
+  for(int i=0; i<4; ++i)
+    {
+    len+= dq[0][i]*dq[0][i];
+    }
+  len = std::sqrt(len);
+  for(int i=0; i<4; ++i)
+    {
+    q0[i] = dq[0][i]/len;
+    }
+  t[0] = 2.0*(-dq[1][0]*dq[0][1] + dq[1][1]*dq[0][0] - dq[1][2]*dq[0][3] + dq[1][3]*dq[0][2])/len;
+  t[1] = 2.0*(-dq[1][0]*dq[0][2] + dq[1][1]*dq[0][3] + dq[1][2]*dq[0][0] - dq[1][3]*dq[0][1])/len;
+  t[2] = 2.0*(-dq[1][0]*dq[0][3] - dq[1][1]*dq[0][2] + dq[1][2]*dq[0][1] + dq[1][3]*dq[0][0])/len;
+}
+
+//-------------------------------------------------------------------------------
+// Rotate by q and translate by t (ApplyQT)
+void ApplyQT(const double q[4], const double t[3], const double in[3], double out[3])
+{
+  Bone bone;
+  for(int i=0; i<4; ++i)
+    {
+    bone.Rotation[i] = q[i];
+    }
+  for(int i=0; i<3; ++i)
+    {
+    bone.Center[i] = 0.0;
+    bone.Translation[i] = t[i];
+    }
+  bone.Apply(in, out);
+}
+
+//-------------------------------------------------------------------------------
+// Bones rotated about different axes and centers, the last bone is the
+// antipodal copy of the one before it
+void CreateBones(std::vector<Bone>& bones)
+{
+  bones.resize(NumberOfBones);
+  for(int i=0; i<NumberOfBones-1; ++i)
+    {
+    double axis[3] = {1.0+i, 2.0-i, 0.5*i-1.0};
+    const double norm = std::sqrt(axis[0]*axis[0]+axis[1]*axis[1]+axis[2]*axis[2]);
+    const double halfAngle = 0.4*i-0.7;
+    Bone& bone = bones[i];
+    bone.Rotation[0] = std::cos(halfAngle);
+    for(int dim=0; dim<3; ++dim)
+      {
+      bone.Rotation[dim+1] = std::sin(halfAngle)*axis[dim]/norm;
+      bone.Center[dim] = 0.5*i+dim;
+      bone.Translation[dim] = 1.5*dim-0.3*i;
+      }
+    }
+  Bone& antipode = bones[NumberOfBones-1];
+  antipode = bones[NumberOfBones-2];
+  for(int i=0; i<4; ++i)
+    {
+    antipode.Rotation[i] = -antipode.Rotation[i];
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Every 5th vertex has no weight and the vertex after it blends the
+// antipodal bones equally, the others have 1 to 4 weights that do not sum
+// to one
+void CreateVertices(std::vector<double>& vertices, bender::WeightBatch& weights)
+{
+  weights.Offsets.assign(1, 0);
+  weights.Indices.clear();
+  weights.Values.clear();
+  weights.Valid.assign(NumberOfVertices, 1);
+  vertices.clear();
+  for(size_t i=0; i<NumberOfVertices; ++i)
+    {
+    for(int dim=0; dim<3; ++dim)
+      {
+      vertices.push_back(0.25*((7*i+3*dim)%23)-2.0);
+      }
+    if(i%5==1)
+      {
+      for(int k=NumberOfBones-2; k<NumberOfBones; ++k)
+        {
+        weights.Indices.push_back(static_cast<bender::SparseWeightVector::SiteIndex>(k));
+        weights.Values.push_back(0.5f);
+        }
+      }
+    else if(i%5!=0)
+      {
+      const size_t numWeights = 1+i%4;
+      for(size_t k=0; k<numWeights; ++k)
+        {
+        weights.Indices.push_back(static_cast<bender::SparseWeightVector::SiteIndex>((i+2*k)%NumberOfBones));
+        weights.Values.push_back(0.1f*(1+(3*i+k)%7));
+        }
+      }
+    weights.Offsets.push_back(weights.Indices.size());
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Blend of the posed positions of the bones
+void LinearBlend(const std::vector<Bone>& bones, const double* x,
+                 const bender::WeightBatch& weights, size_t i, double y[3])
+{
+  double wSum(0);
+  for(size_t k=weights.Offsets[i]; k<weights.Offsets[i+1]; ++k)
+    {
+    wSum+= weights.Values[k];
+    }
+  for(int dim=0; dim<3; ++dim)
+    {
+    y[dim] = wSum>0 ? 0.0 : x[dim];
+    }
+  for(size_t k=weights.Offsets[i]; k<weights.Offsets[i+1]; ++k)
+    {
+    double yk[3];
+    bones[weights.Indices[k]].Apply(x, yk);
+    for(int dim=0; dim<3; ++dim)
+      {
+      y[dim]+= weights.Values[k]/wSum*yk[dim];
+      }
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Blend of the dual quaternions of the bones, each flipped to the hemisphere
+// of the bone of the largest weight. The blend is normalized before
+// DQ2QuatTrans: PoseBody used to convert it as is, which scaled the
+// translation by the norm of the blend.
+void DualQuaternionBlend(const std::vector<Bone>& bones, const double* x,
+                         const bender::WeightBatch& weights, size_t i, double y[3])
+{
+  const size_t begin = weights.Offsets[i];
+  const size_t end = weights.Offsets[i+1];
+  if(begin==end)
+    {
+    std::copy(x, x+3, y);
+    return;
+    }
+  double wSum(0);
+  size_t largest = begin;
+  for(size_t k=begin; k<end; ++k)
+    {
+    wSum+= weights.Values[k];
+    if(weights.Values[k]>weights.Values[largest])
+      {
+      largest = k;
+      }
+    }
+  const double* pivot = bones[weights.Indices[largest]].Rotation;
+
+  double dq[2][4] = {{0,0,0,0},{0,0,0,0}};
+  for(size_t k=begin; k<end; ++k)
+    {
+    const Bone& bone = bones[weights.Indices[k]];
+    double t[3];
+    bone.GetTranslation(t);
+    double dqk[2][4];
+    QuatTrans2UDQ(bone.Rotation, t, dqk);
+    double dot(0);
+    for(int c=0; c<4; ++c)
+      {
+      dot+= bone.Rotation[c]*pivot[c];
+      }
+    const double w = (dot<0 ? -1.0 : 1.0)*weights.Values[k]/wSum;
+    for(int c=0; c<8; ++c)
+      {
+      dq[c/4][c%4]+= w*dqk[c/4][c%4];
+      }
+    }
+  double norm(0);
+  for(int c=0; c<4; ++c)
+    {
+    norm+= dq[0][c]*dq[0][c];
+    }
+  norm = std::sqrt(norm);
+  for(int c=0; c<8; ++c)
+    {
+    dq[c/4][c%4]/= norm;
+    }
+  double q[4];
+  double t[3];
+  DQ2QuatTrans(dq, q, t);
+  ApplyQT(q, t, x, y);
+}
+
+//-------------------------------------------------------------------------------
+bool IsClose(double value, double expected)
+{
+  return std::fabs(value-expected)<=1.0e-4*(1.0+std::fabs(expected));
+}
+
+//-------------------------------------------------------------------------------
+// Pose the vertices [begin,end) with a kernel and compare them to the
+// reference, the other vertices must not be written
+template<class Skinning, class T>
+bool TestRange(const char* name, const Skinning& skinning, const std::vector<Bone>& bones,
+               const std::vector<double>& vertices, const bender::WeightBatch& weights,
+               size_t begin, size_t end, bool linearBlend)
+{
+  const T unset(-1000);
+  std::vector<T> posed(vertices.size(), unset);
+  skinning.Apply(&vertices[0], weights, begin, end, &posed[0]);
+  for(size_t i=0; i<NumberOfVertices; ++i)
+    {
+    const double* x = &vertices[3*i];
+    double expected[3];
+    if(linearBlend)
+      {
+      LinearBlend(bones, x, weights, i, expected);
+      }
+    else
+      {
+      DualQuaternionBlend(bones, x, weights, i, expected);
+      }
+    //the antipodal bones blend to the transform of either of them
+    double antipodal[3];
+    bones[NumberOfBones-1].Apply(x, antipodal);
+    const bool isAntipodal = i%5==1;
+
+    bool same(true);
+    for(int dim=0; dim<3; ++dim)
+      {
+      const T value = posed[3*i+dim];
+      if(i<begin || i>=end)
+        {
+        same = same && value==unset;
+        }
+      else
+        {
+        same = same && IsClose(value, expected[dim])
+          && (!isAntipodal || IsClose(value, antipodal[dim]));
+        }
+      }
+    if(!same)
+      {
+      std::cerr << name << " poses vertex " << i << " of [" << begin << "," << end << ") at ("
+                << posed[3*i] << "," << posed[3*i+1] << "," << posed[3*i+2] << "), expected ("
+                << expected[0] << "," << expected[1] << "," << expected[2] << ")" << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class Skinning, class T>
+bool TestRanges(const char* name, const Skinning& skinning, const std::vector<Bone>& bones,
+                const std::vector<double>& vertices, const bender::WeightBatch& weights,
+                bool linearBlend)
+{
+  //whole blocks and a partial one, partial blocks at both ends, a single
+  //vertex and the last ones
+  const size_t ranges[][2] = {{0, NumberOfVertices}, {3, 16}, {5, 6}, {NumberOfVertices-2, NumberOfVertices}};
+  for(size_t r=0; r<sizeof(ranges)/sizeof(ranges[0]); ++r)
+    {
+    if(!TestRange<Skinning, T>(name, skinning, bones, vertices, weights,
+                               ranges[r][0], ranges[r][1], linearBlend))
+      {
+      return false;
+      }
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderSkinningTest(int, char*[])
+{
+  std::vector<Bone> bones;
+  CreateBones(bones);
+  std::vector<double> vertices;
+  bender::WeightBatch weights;
+  CreateVertices(vertices, weights);
+
+  //the bones as PoseBody sets them: x -> R*x+t
+  bender::LinearBlendSkinning skinning;
+  skinning.SetNumberOfBones(bones.size());
+  bender::DualQuaternionSkinning dqSkinning;
+  dqSkinning.SetNumberOfBones(bones.size());
+  for(size_t i=0; i<bones.size(); ++i)
+    {
+    double rotation[3][3];
+    bones[i].GetMatrix(rotation);
+    double translation[3];
+    bones[i].GetTranslation(translation);
+    skinning.SetBone(i, rotation, translation);
+    dqSkinning.SetBone(i, bones[i].Rotation, translation);
+    }
+
+  if(!TestRanges<bender::LinearBlendSkinning, float>("LinearBlendSkinning", skinning,
+                                                     bones, vertices, weights, true)
+     || !TestRanges<bender::LinearBlendSkinning, double>("LinearBlendSkinning", skinning,
+                                                         bones, vertices, weights, true)
+     || !TestRanges<bender::DualQuaternionSkinning, float>("DualQuaternionSkinning", dqSkinning,
+                                                           bones, vertices, weights, false)
+     || !TestRanges<bender::DualQuaternionSkinning, double>("DualQuaternionSkinning", dqSkinning,
+                                                            bones, vertices, weights, false))
+    {
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,656 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Time the weight map operations on a synthetic weight field: a ball shaped
+// body of a size^3 volume, with sites spread inside it, where each voxel
+// has weights for its closest sites only. The map holds the corners of the
+// cells of random points near the surface of the body, as PoseBody does for
+// the vertices of a skin.
+//
+// Usage: benderWeightMapBenchmark [--size n] [--voxels n] [--sites n]
+//          [--influences n] [--repeat n] [--directory dir] [--output file]
+//
+// One CSV line is written per operation and per value type of the map.
+// The operations are timed over --repeat runs, ns_per_op is the mean time
+// of one call, bytes_per_voxel is the memory of the packed map divided by
+// its number of voxels and peak_rss_kb the peak resident memory of the
+// process so far. The weight files read by ReadWeights are written to
+// --directory.
+
+// Bender includes
+#include "benderDomainMask.h"
+#include "benderWeightMap.h"
+#include "benderWeightMapIO.h"
+#include "benderWeightMapMath.h"
+
+// ITK includes
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkTimeProbe.h>
+#include <itkVector.h>
+#include <itksys/SystemTools.hxx>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+typedef itk::Image<float,3> WeightImage;
+typedef bender::VoxelIndex::Voxel Voxel;
+typedef bender::VoxelIndex::Region Region;
+
+struct BenchmarkParameters
+{
+  int Size;
+  int NumberOfSurfaceVoxels;
+  int NumberOfSites;
+  int NumberOfInfluences;
+  int NumberOfRepeats;
+  std::string Directory;
+};
+
+//-------------------------------------------------------------------------------
+// Peak resident memory of the process in KB
+long GetPeakMemory()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+    return 0;
+    }
+  return static_cast<long>(counters.PeakWorkingSetSize/1024);
+#else
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage)!=0)
+    {
+    return 0;
+    }
+#ifdef __APPLE__
+  return usage.ru_maxrss/1024; //in bytes
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+//-------------------------------------------------------------------------------
+// Discard what the library writes to std::cout while it is alive
+class QuietOutput
+{
+public:
+  QuietOutput(): Buffer(std::cout.rdbuf(Discarded.rdbuf()))
+  {
+  }
+  ~QuietOutput()
+  {
+    std::cout.rdbuf(this->Buffer);
+  }
+
+private:
+  std::ostringstream Discarded;
+  std::streambuf* Buffer;
+};
+
+//-------------------------------------------------------------------------------
+// The synthetic weight field and the points to interpolate it at
+class WeightField
+{
+public:
+  typedef std::pair<float, int> Influence; //weight, site
+
+  void Init(const BenchmarkParameters& parameters)
+  {
+    const int size = parameters.Size;
+    Region::SizeType regionSize;
+    regionSize.Fill(size);
+    Region::IndexType start;
+    start.Fill(0);
+    this->WeightRegion = Region(start, regionSize);
+
+    const double center = 0.5*(size-1);
+    this->Radius = 0.45*size;
+
+    //the sites are spread inside the body
+    srand(0);
+    this->Sites.resize(parameters.NumberOfSites);
+    for(size_t i=0; i<this->Sites.size(); ++i)
+      {
+      double x[3];
+      do
+        {
+        for(int d=0; d<3; ++d)
+          {
+          x[d] = (2.0*rand()/RAND_MAX-1.0)*this->Radius;
+          }
+        }
+      while(x[0]*x[0]+x[1]*x[1]+x[2]*x[2]>this->Radius*this->Radius);
+      for(int d=0; d<3; ++d)
+        {
+        this->Sites[i][d] = center+x[d];
+        }
+      }
+
+    //each body voxel has a weight for its closest sites
+    this->Domain = WeightImage::New();
+    this->Domain->SetRegions(this->WeightRegion);
+    this->Domain->Allocate();
+    this->Domain->FillBuffer(-1);
+    this->Influences.clear();
+    this->Offsets.assign(1, 0);
+    size_t numInfluences = std::min(parameters.NumberOfInfluences, parameters.NumberOfSites);
+    std::vector<std::pair<double, int> > distances(this->Sites.size());
+    for(itk::ImageRegionIteratorWithIndex<WeightImage> it(this->Domain, this->WeightRegion); !it.IsAtEnd(); ++it)
+      {
+      Voxel v = it.GetIndex();
+      if(!this->IsInside(v))
+        {
+        continue;
+        }
+      it.Set(0);
+      for(size_t i=0; i<this->Sites.size(); ++i)
+        {
+        double d2(0);
+        for(int d=0; d<3; ++d)
+          {
+          d2+= (v[d]-this->Sites[i][d])*(v[d]-this->Sites[i][d]);
+          }
+        distances[i] = std::make_pair(d2, static_cast<int>(i));
+        }
+      std::partial_sort(distances.begin(), distances.begin()+numInfluences, distances.end());
+      double sum(0);
+      for(size_t k=0; k<numInfluences; ++k)
+        {
+        sum+= 1.0/(1.0+std::sqrt(distances[k].first));
+        }
+      for(size_t k=0; k<numInfluences; ++k)
+        {
+        float w = static_cast<float>(1.0/(1.0+std::sqrt(distances[k].first))/sum);
+        this->Influences.push_back(Influence(w, distances[k].second));
+        }
+      this->Offsets.push_back(this->Influences.size());
+      this->Rows.push_back(this->Domain->ComputeOffset(v));
+      }
+
+    //points just inside the surface of the body, the map holds the
+    //corners of their cells
+    this->Points.clear();
+    this->Voxels.clear();
+    BodyMaskImage::Pointer inMap = BodyMaskImage::New();
+    inMap->SetRegions(this->WeightRegion);
+    inMap->Allocate();
+    inMap->FillBuffer(false);
+    for(int n=0; n<parameters.NumberOfSurfaceVoxels; ++n)
+      {
+      double u[3], norm(0);
+      do
+        {
+        norm = 0;
+        for(int d=0; d<3; ++d)
+          {
+          u[d] = 2.0*rand()/RAND_MAX-1.0;
+          norm+= u[d]*u[d];
+          }
+        }
+      while(norm>1 || norm<1e-6);
+      const double r = this->Radius-1.0-static_cast<double>(rand())/RAND_MAX;
+      Voxel p;
+      for(int d=0; d<3; ++d)
+        {
+        double x = center+u[d]/std::sqrt(norm)*r;
+        this->Points.push_back(x);
+        p[d] = static_cast<Voxel::IndexValueType>(std::floor(x));
+        }
+      for(int corner=0; corner<8; ++corner)
+        {
+        Voxel q = p;
+        for(int d=0; d<3; ++d)
+          {
+          q[d]+= (corner>>d)&1;
+          }
+        if(!inMap->GetPixel(q))
+          {
+          inMap->SetPixel(q, true);
+          this->Voxels.push_back(q);
+          }
+        }
+      }
+  }
+
+  // Write the weights of each site to its own file
+  bool WriteWeights(const std::string& directory) const
+  {
+    itksys::SystemTools::MakeDirectory(directory.c_str());
+    WeightImage::Pointer weight = WeightImage::New();
+    weight->SetRegions(this->WeightRegion);
+    weight->Allocate();
+    for(size_t i=0; i<this->Sites.size(); ++i)
+      {
+      weight->FillBuffer(0);
+      float* pixels = weight->GetBufferPointer();
+      const float* domain = this->Domain->GetBufferPointer();
+      for(size_t k=0; k<this->WeightRegion.GetNumberOfPixels(); ++k)
+        {
+        pixels[k] = domain[k];
+        }
+      for(size_t j=0; j<this->Rows.size(); ++j)
+        {
+        for(size_t k=this->Offsets[j]; k<this->Offsets[j+1]; ++k)
+          {
+          if(this->Influences[k].second==static_cast<int>(i))
+            {
+            pixels[this->Rows[j]] = this->Influences[k].first;
+            }
+          }
+        }
+
+      char name[32];
+      sprintf(name, "/weight_%05d.mha", static_cast<int>(i));
+      typedef itk::ImageFileWriter<WeightImage> WriterType;
+      WriterType::Pointer writer = WriterType::New();
+      writer->SetInput(weight);
+      writer->SetFileName((directory+name).c_str());
+      try
+        {
+        writer->Update();
+        }
+      catch(itk::ExceptionObject& e)
+        {
+        std::cerr << e << std::endl;
+        return false;
+        }
+      }
+    return true;
+  }
+
+  // Weight of a site at a voxel of the body
+  float GetWeight(const Voxel& v, int site) const
+  {
+    const size_t offset = this->Domain->ComputeOffset(v);
+    const size_t j = std::lower_bound(this->Rows.begin(), this->Rows.end(), offset)-this->Rows.begin();
+    if(j==this->Rows.size() || this->Rows[j]!=offset)
+      {
+      return 0;
+      }
+    for(size_t k=this->Offsets[j]; k<this->Offsets[j+1]; ++k)
+      {
+      if(this->Influences[k].second==site)
+        {
+        return this->Influences[k].first;
+        }
+      }
+    return 0;
+  }
+
+  const Region& GetRegion() const
+  {
+    return this->WeightRegion;
+  }
+  const WeightImage* GetDomain() const
+  {
+    return this->Domain;
+  }
+  const std::vector<Voxel>& GetVoxels() const
+  {
+    return this->Voxels;
+  }
+  const std::vector<double>& GetPoints() const
+  {
+    return this->Points;
+  }
+  int GetNumberOfSites() const
+  {
+    return static_cast<int>(this->Sites.size());
+  }
+
+private:
+  typedef itk::Image<bool,3> BodyMaskImage;
+
+  bool IsInside(const Voxel& v) const
+  {
+    const double center = 0.5*(this->WeightRegion.GetSize()[0]-1);
+    double d2(0);
+    for(int d=0; d<3; ++d)
+      {
+      d2+= (v[d]-center)*(v[d]-center);
+      }
+    return d2<=this->Radius*this->Radius;
+  }
+
+  Region WeightRegion;
+  double Radius;
+  std::vector<itk::Vector<double,3> > Sites;
+  WeightImage::Pointer Domain; //-1 outside of the body, 0 inside
+
+  // Influences of the body voxels, sorted by offset in the region
+  std::vector<size_t> Rows;
+  std::vector<size_t> Offsets;
+  std::vector<Influence> Influences;
+
+  std::vector<double> Points; //x,y,z of each point
+  std::vector<Voxel> Voxels; //corners of the cells of the points
+};
+
+//-------------------------------------------------------------------------------
+// Time the operations on one weight map type and write their CSV lines
+class WeightMapBenchmark
+{
+public:
+  WeightMapBenchmark(const BenchmarkParameters& parameters, const WeightField& field, std::ostream& output)
+    :Parameters(parameters), Field(field), Output(output), Succeeded(true)
+  {
+  }
+
+  template<class WeightMapType>
+  bool operator()(WeightMapType& weightMap)
+  {
+    typedef typename WeightMapType::SiteIndex SiteIndex;
+    typedef typename WeightMapType::ValueType ValueType;
+
+    const std::vector<Voxel>& voxels = this->Field.GetVoxels();
+    const std::vector<double>& points = this->Field.GetPoints();
+    const size_t numPoints = points.size()/3;
+    const int numSites = this->Field.GetNumberOfSites();
+    const int numRepeats = this->Parameters.NumberOfRepeats;
+    this->TypeName = bender::WeightValueTraits<ValueType>::GetName();
+    this->IndexSize = sizeof(SiteIndex);
+    this->BytesPerVoxel = 0;
+
+    //Init
+    itk::TimeProbe initProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      weightMap = WeightMapType();
+      initProbe.Start();
+      weightMap.Init(voxels, this->Field.GetRegion());
+      initProbe.Stop();
+      }
+
+    //Insert every weight of every voxel, as when reading the weight files
+    std::vector<float> weights(voxels.size()*numSites);
+    for(size_t j=0; j<voxels.size(); ++j)
+      {
+      for(int i=0; i<numSites; ++i)
+        {
+        weights[i*voxels.size()+j] = this->Field.GetWeight(voxels[j], i);
+        }
+      }
+    itk::TimeProbe insertProbe;
+    itk::TimeProbe finalizeProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      weightMap.Init(voxels, this->Field.GetRegion());
+      insertProbe.Start();
+      for(int i=0; i<numSites; ++i)
+        {
+        for(size_t j=0; j<voxels.size(); ++j)
+          {
+          weightMap.Insert(voxels[j], static_cast<SiteIndex>(i), weights[i*voxels.size()+j]);
+          }
+        }
+      insertProbe.Stop();
+      finalizeProbe.Start();
+      weightMap.Finalize();
+      finalizeProbe.Stop();
+      }
+    std::vector<float>().swap(weights);
+    const size_t numEntries = weightMap.GetValues().size();
+    this->BytesPerVoxel = voxels.empty() ? 0 :
+      static_cast<double>(weightMap.GetVoxels().GetKeys().size()*sizeof(bender::VoxelIndex::VoxelKey)
+                          + weightMap.GetRowOffsets().size()*sizeof(typename WeightMapType::RowOffset)
+                          + numEntries*(sizeof(SiteIndex)+sizeof(ValueType)))/voxels.size();
+    this->Report("Init", voxels.size(), initProbe.GetMean(), voxels.size());
+    this->Report("Insert", voxels.size(), insertProbe.GetMean(), voxels.size()*numSites);
+    this->Report("Finalize", voxels.size(), finalizeProbe.GetMean(), numEntries);
+
+    //Get
+    bender::SparseWeightVector values;
+    size_t numGot(0);
+    itk::TimeProbe getProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      getProbe.Start();
+      for(size_t j=0; j<voxels.size(); ++j)
+        {
+        weightMap.Get(voxels[j], values);
+        numGot+= values.GetSize();
+        }
+      getProbe.Stop();
+      }
+    this->Report("Get", voxels.size(), getProbe.GetMean(), voxels.size());
+
+    //Lerp, one point at a time and in one batch
+    bender::DomainMask::Pointer domain = bender::DomainMask::New();
+    domain->Init(this->Field.GetDomain(), 0);
+    bender::SparseWeightVector corners[8];
+    size_t numInvalid(0);
+    itk::TimeProbe lerpProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      lerpProbe.Start();
+      for(size_t pi=0; pi<numPoints; ++pi)
+        {
+        itk::ContinuousIndex<double,3> coord;
+        for(int d=0; d<3; ++d)
+          {
+          coord[d] = points[3*pi+d]; //unit spacing and zero origin
+          }
+        numInvalid+= bender::Lerp<bender::DomainMask>(weightMap, coord, domain, true, corners, values) ? 0 : 1;
+        }
+      lerpProbe.Stop();
+      }
+    this->Report("Lerp", voxels.size(), lerpProbe.GetMean(), numPoints);
+
+    bender::WeightBatch batch;
+    itk::TimeProbe batchProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      batchProbe.Start();
+      bender::LerpBatch<bender::DomainMask>(weightMap, domain, true,
+                                            points.empty() ? 0 : &points[0], numPoints, batch);
+      batchProbe.Stop();
+      }
+    this->Report("LerpBatch", voxels.size(), batchProbe.GetMean(), numPoints);
+
+    //ReadWeights, from the files to the packed map
+    std::vector<std::string> fnames;
+    bender::GetWeightFileNames(this->Parameters.Directory, fnames);
+    itk::TimeProbe readProbe;
+    for(int r=0; r<numRepeats; ++r)
+      {
+      WeightMapType readMap;
+      QuietOutput quiet;
+      readProbe.Start();
+      bender::ReadWeights(fnames, voxels, readMap);
+      readProbe.Stop();
+      if(readMap.GetValues().size()!=numEntries)
+        {
+        std::cerr << "ReadWeights read " << readMap.GetValues().size() << " weights, "
+                  << numEntries << " were inserted" << std::endl;
+        this->Succeeded = false;
+        }
+      }
+    this->Report("ReadWeights", voxels.size(), readProbe.GetMean(), voxels.size()*numSites);
+
+    if(numInvalid>0 || numGot==0)
+      {
+      std::cerr << numInvalid << " points could not be interpolated, "
+                << numGot << " weights were found" << std::endl;
+      this->Succeeded = false;
+      }
+    return this->Succeeded;
+  }
+
+  void WriteHeader()
+  {
+    this->Output << "benchmark,index_bytes,value_type,size,voxels,sites,influences,"
+                 << "operations,ns_per_op,bytes_per_voxel,peak_rss_kb" << std::endl;
+  }
+
+private:
+  void Report(const char* name, size_t numVoxels, double seconds, size_t numOperations)
+  {
+    const double nsPerOperation = numOperations>0 ? seconds*1e9/numOperations : 0;
+    this->Output << name << "," << this->IndexSize << "," << this->TypeName << ","
+                 << this->Parameters.Size << "," << numVoxels << "," << this->Field.GetNumberOfSites() << ","
+                 << this->Parameters.NumberOfInfluences << "," << numOperations << ","
+                 << nsPerOperation << "," << this->BytesPerVoxel << "," << GetPeakMemory() << std::endl;
+  }
+
+  const BenchmarkParameters& Parameters;
+  const WeightField& Field;
+  std::ostream& Output;
+  bool Succeeded;
+  std::string TypeName;
+  size_t IndexSize;
+  double BytesPerVoxel;
+};
+
+//-------------------------------------------------------------------------------
+bool ParseArguments(int argc, char* argv[], BenchmarkParameters& parameters, std::string& outputFile)
+{
+  for(int i=1; i<argc; ++i)
+    {
+    std::string option = argv[i];
+    if(i+1==argc)
+      {
+      std::cerr << "Missing value of " << option << std::endl;
+      return false;
+      }
+    std::string value = argv[++i];
+    int* parameter = 0;
+    if(option=="--size")
+      {
+      parameter = &parameters.Size;
+      }
+    else if(option=="--voxels")
+      {
+      parameter = &parameters.NumberOfSurfaceVoxels;
+      }
+    else if(option=="--sites")
+      {
+      parameter = &parameters.NumberOfSites;
+      }
+    else if(option=="--influences")
+      {
+      parameter = &parameters.NumberOfInfluences;
+      }
+    else if(option=="--repeat")
+      {
+      parameter = &parameters.NumberOfRepeats;
+      }
+    else if(option=="--directory")
+      {
+      parameters.Directory = value;
+      }
+    else if(option=="--output")
+      {
+      outputFile = value;
+      }
+    else
+      {
+      std::cerr << "Unknown option " << option << std::endl;
+      return false;
+      }
+    if(parameter)
+      {
+      *parameter = atoi(value.c_str());
+      if(*parameter<1)
+        {
+        std::cerr << option << " must be positive" << std::endl;
+        return false;
+        }
+      }
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderWeightMapBenchmark(int argc, char* argv[])
+{
+  BenchmarkParameters parameters;
+  parameters.Size = 64;
+  parameters.NumberOfSurfaceVoxels = 10000;
+  parameters.NumberOfSites = 32;
+  parameters.NumberOfInfluences = 4;
+  parameters.NumberOfRepeats = 3;
+  parameters.Directory = itksys::SystemTools::GetCurrentWorkingDirectory()+"/benderWeightMapBenchmark";
+  std::string outputFile;
+  if(!ParseArguments(argc, argv, parameters, outputFile))
+    {
+    return EXIT_FAILURE;
+    }
+  size_t siteIndexSize = bender::GetSiteIndexSize(parameters.NumberOfSites);
+  if(siteIndexSize==0)
+    {
+    std::cerr << "Too many sites: " << parameters.NumberOfSites << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  WeightField field;
+  field.Init(parameters);
+  if(!field.WriteWeights(parameters.Directory))
+    {
+    return EXIT_FAILURE;
+    }
+
+  std::ofstream file;
+  if(!outputFile.empty())
+    {
+    file.open(outputFile.c_str());
+    if(!file)
+      {
+      std::cerr << "Cannot write " << outputFile << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  WeightMapBenchmark benchmark(parameters, field, outputFile.empty() ? std::cout : file);
+  benchmark.WriteHeader();
+
+  const bender::WeightValueType valueTypes[] =
+    {bender::FloatWeight, bender::HalfWeight, bender::Fixed16Weight};
+  for(size_t k=0; k<sizeof(valueTypes)/sizeof(valueTypes[0]); ++k)
+    {
+    if(!bender::DispatchWeightMap(siteIndexSize, valueTypes[k], benchmark))
+      {
+      return EXIT_FAILURE;
+      }
+    }
+  return EXIT_SUCCESS;
+}
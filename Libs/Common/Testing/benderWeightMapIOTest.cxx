@@ -0,0 +1,604 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Check that a weight map saved by WriteWeightMap is read back unchanged by
+// ReadWeightMap, and a skin binding saved by WriteSkinBinding by
+// ReadSkinBinding with normalized weights. Truncated or corrupted files are
+// rejected. Weight images cropped to a box around their site, like the ones
+// of ArmatureWeight --crop, are read as the whole weight images.
+//
+// Usage: benderWeightMapIOTest directory
+//
+// The files are written to directory.
+
+// Bender includes
+#include "benderDomainMask.h"
+#include "benderWeightMap.h"
+#include "benderWeightMapIO.h"
+#include "benderWeightMapMath.h"
+
+// ITK includes
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itksys/SystemTools.hxx>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace
+{
+typedef itk::Image<float,3> WeightImage;
+typedef bender::VoxelIndex::Voxel Voxel;
+typedef bender::VoxelIndex::Region Region;
+typedef bender::WeightMap<unsigned char, float> WeightMapType;
+
+const int NumberOfSites = 5;
+
+//-------------------------------------------------------------------------------
+// A box shaped body in a region that does not start at 0, where each voxel
+// has weights for some of the sites
+void CreateWeightMap(WeightImage::Pointer geometry, WeightMapType& weightMap)
+{
+  Region::IndexType start;
+  start[0] = 2;
+  start[1] = -1;
+  start[2] = 3;
+  Region::SizeType size;
+  size[0] = 6;
+  size[1] = 5;
+  size[2] = 4;
+  Region region(start, size);
+  geometry->SetRegions(region);
+  geometry->Allocate();
+  geometry->FillBuffer(-1);
+
+  std::vector<Voxel> voxels;
+  for(itk::ImageRegionIteratorWithIndex<WeightImage> it(geometry, region); !it.IsAtEnd(); ++it)
+    {
+    Voxel v = it.GetIndex();
+    if(v[0]>start[0] && v[1]>start[1])
+      {
+      it.Set(0);
+      voxels.push_back(v);
+      }
+    }
+
+  weightMap.Init(voxels, region);
+  for(size_t j=0; j<voxels.size(); ++j)
+    {
+    const Voxel& v = voxels[j];
+    for(int i=0; i<NumberOfSites; ++i)
+      {
+      if((v[0]+v[1]+v[2]+i)%3!=0)
+        {
+        weightMap.Insert(v, static_cast<unsigned char>(i), 0.1f*(i+1)+0.01f*v[0]);
+        }
+      }
+    }
+  weightMap.Finalize();
+}
+
+//-------------------------------------------------------------------------------
+bool ReadFile(const std::string& fname, std::string& content)
+{
+  std::ifstream in(fname.c_str(), std::ios::in | std::ios::binary);
+  content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return !content.empty();
+}
+
+//-------------------------------------------------------------------------------
+bool WriteFile(const std::string& fname, const std::string& content)
+{
+  std::ofstream out(fname.c_str(), std::ios::out | std::ios::binary);
+  out.write(content.data(), content.size());
+  out.close();
+  return !out.fail();
+}
+
+//-------------------------------------------------------------------------------
+// Position of the bytes of an array in the content of a file
+template<class T>
+size_t FindArray(const std::string& content, const T* data, size_t size)
+{
+  return content.find(std::string(reinterpret_cast<const char*>(data), size*sizeof(T)));
+}
+
+//-------------------------------------------------------------------------------
+template<class T>
+void SetElement(std::string& content, size_t arrayPosition, size_t i, T value)
+{
+  memcpy(&content[arrayPosition+i*sizeof(T)], &value, sizeof(T));
+}
+
+//-------------------------------------------------------------------------------
+// Write content to fname and check that ReadWeightMap rejects it
+bool ExpectRejected(const std::string& fname, const std::string& content, const char* description)
+{
+  if(!WriteFile(fname, content))
+    {
+    std::cerr << "Cannot write " << fname << std::endl;
+    return false;
+    }
+  WeightMapType weightMap;
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  if(bender::ReadWeightMap(fname, weightMap, domain.GetPointer())!=0)
+    {
+    std::cerr << "A weight map file with " << description << " was read" << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+// Weights of the vertices of a skin, not normalized, some vertices have
+// none and one is not valid
+void CreateWeightBatch(bender::WeightBatch& weights)
+{
+  const size_t numVertices = 37;
+  weights.Offsets.assign(1, 0);
+  for(size_t i=0; i<numVertices; ++i)
+    {
+    for(int site=0; site<NumberOfSites; ++site)
+      {
+      if((i+site)%3!=0)
+        {
+        weights.Indices.push_back(static_cast<bender::SparseWeightVector::SiteIndex>(site));
+        weights.Values.push_back(0.1f*(site+1));
+        }
+      }
+    weights.Offsets.push_back(i%5==0 ? weights.Offsets.back() : weights.Indices.size());
+    weights.Indices.resize(weights.Offsets.back());
+    weights.Values.resize(weights.Offsets.back());
+    weights.Valid.push_back(i!=7);
+    }
+}
+
+//-------------------------------------------------------------------------------
+bool TestSkinBinding(const std::string& directory)
+{
+  const std::string fname = directory+"/skin.bsb";
+  bender::WeightBatch weights;
+  CreateWeightBatch(weights);
+  if(!bender::WriteSkinBinding(fname, weights, NumberOfSites))
+    {
+    return false;
+    }
+
+  bender::WeightBatch readWeights;
+  int numSites = bender::ReadSkinBinding(fname, readWeights);
+  bender::WeightBatch normalized(weights);
+  bender::NormalizeWeights(normalized);
+  bool same = numSites==NumberOfSites && readWeights.Offsets==weights.Offsets
+    && readWeights.Indices==weights.Indices && readWeights.Valid==weights.Valid;
+  for(size_t k=0; k<normalized.Values.size() && same; ++k)
+    {
+    same = std::fabs(readWeights.Values[k]-normalized.Values[k])<=1e-6f;
+    }
+  if(!same)
+    {
+    std::cerr << "The read skin binding differs from the normalized weights" << std::endl;
+    return false;
+    }
+
+  std::string content;
+  if(!ReadFile(fname, content))
+    {
+    std::cerr << "Cannot read " << fname << std::endl;
+    return false;
+    }
+  const std::string corruptedName = directory+"/corrupted.bsb";
+  const size_t lengths[3] = {10, content.size()/2, content.size()-1};
+  for(int i=0; i<3; ++i)
+    {
+    if(!WriteFile(corruptedName, content.substr(0, lengths[i]))
+       || bender::ReadSkinBinding(corruptedName, readWeights)!=0)
+      {
+      std::cerr << "A skin binding with missing bytes was read" << std::endl;
+      return false;
+      }
+    }
+
+  //a number of vertices that does not fit in memory, in the header
+  const itk::uint64_t numVertices = weights.Valid.size();
+  const size_t position = FindArray(content, &numVertices, 1);
+  if(position==std::string::npos || position>=64)
+    {
+    std::cerr << "Cannot find the number of vertices in " << fname << std::endl;
+    return false;
+    }
+  std::string corrupted = content;
+  SetElement(corrupted, position, 0, static_cast<itk::uint64_t>(1)<<62);
+  if(!WriteFile(corruptedName, corrupted)
+     || bender::ReadSkinBinding(corruptedName, readWeights)!=0)
+    {
+    std::cerr << "A skin binding with too many vertices was read" << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool WriteWeightImage(WeightImage::Pointer image, const std::string& fname)
+{
+  typedef itk::ImageFileWriter<WeightImage> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(image);
+  writer->SetFileName(fname.c_str());
+  try
+    {
+    writer->Update();
+    }
+  catch(itk::ExceptionObject& e)
+    {
+    std::cerr << e << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+// Write the weights of each site of a box shaped body to a whole image in
+// wholeDirectory, and to an image of the box of the site only, starting at
+// index 0 with the origin moved to the box, in croppedDirectory. The box
+// of the first site does not start at the origin, the union of the boxes
+// covers the whole region.
+bool WriteCroppedWeights(WeightImage::Pointer geometry, const std::string& wholeDirectory,
+                         const std::string& croppedDirectory)
+{
+  const itk::IndexValueType boxes[4][6] =
+    {
+    {3,6, 0,5, 0,4},
+    {0,3, 0,5, 0,4},
+    {1,5, 1,4, 0,3},
+    {5,6, 0,2, 2,4}
+    };
+  const Region& region = geometry->GetLargestPossibleRegion();
+  for(int i=0; i<4; ++i)
+    {
+    Region::IndexType start;
+    Region::SizeType size;
+    for(int dim=0; dim<3; ++dim)
+      {
+      start[dim] = boxes[i][2*dim];
+      size[dim] = boxes[i][2*dim+1]-boxes[i][2*dim]+1;
+      }
+    Region box(start, size);
+
+    WeightImage::Pointer whole = WeightImage::New();
+    whole->CopyInformation(geometry);
+    whole->SetRegions(region);
+    whole->Allocate();
+    for(itk::ImageRegionIteratorWithIndex<WeightImage> it(whole, region); !it.IsAtEnd(); ++it)
+      {
+      Voxel v = it.GetIndex();
+      float value = geometry->GetPixel(v);
+      if(value>=0 && box.IsInside(v))
+        {
+        value = 0.25f*((v[0]+2*v[1]+v[2]+i)%4);
+        }
+      it.Set(value);
+      }
+
+    WeightImage::Pointer cropped = WeightImage::New();
+    cropped->CopyInformation(geometry);
+    WeightImage::PointType origin;
+    geometry->TransformIndexToPhysicalPoint(start, origin);
+    cropped->SetOrigin(origin);
+    Region::IndexType zero;
+    zero.Fill(0);
+    cropped->SetRegions(Region(zero, size));
+    cropped->Allocate();
+    for(itk::ImageRegionIteratorWithIndex<WeightImage> it(cropped, cropped->GetLargestPossibleRegion());
+        !it.IsAtEnd(); ++it)
+      {
+      Voxel v = it.GetIndex();
+      for(int dim=0; dim<3; ++dim)
+        {
+        v[dim]+= start[dim];
+        }
+      it.Set(whole->GetPixel(v));
+      }
+
+    char name[32];
+    sprintf(name, "/weight_%d.mha", i);
+    if(!WriteWeightImage(whole, wholeDirectory+name) || !WriteWeightImage(cropped, croppedDirectory+name))
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool CompareWeightMaps(const WeightMapType& expected, const WeightMapType& weightMap)
+{
+  if(weightMap.GetNumberOfVoxels()!=expected.GetNumberOfVoxels()
+     || weightMap.GetVoxels().GetRegion()!=expected.GetVoxels().GetRegion())
+    {
+    std::cerr << "The read weight map has " << weightMap.GetNumberOfVoxels()
+              << " voxels, expected " << expected.GetNumberOfVoxels() << std::endl;
+    return false;
+    }
+  bender::SparseWeightVector expectedValues, values;
+  for(size_t j=0; j<expected.GetNumberOfVoxels(); ++j)
+    {
+    Voxel v = expected.GetVoxel(j);
+    expected.Get(v, expectedValues);
+    weightMap.Get(v, values);
+    bool same = values.GetSize()==expectedValues.GetSize();
+    for(size_t k=0; k<values.GetSize() && same; ++k)
+      {
+      same = values.GetIndex(k)==expectedValues.GetIndex(k)
+        && values.GetValue(k)==expectedValues.GetValue(k);
+      }
+    if(!same)
+      {
+      std::cerr << "The weights of voxel " << v << " differ" << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool TestCroppedWeights(const std::string& directory)
+{
+  //a body in a region at index 0, as read from .mha files
+  Region::IndexType start;
+  start.Fill(0);
+  Region::SizeType size;
+  size[0] = 7;
+  size[1] = 6;
+  size[2] = 5;
+  Region region(start, size);
+  WeightImage::Pointer geometry = WeightImage::New();
+  WeightImage::PointType origin;
+  origin[0] = 1.5;
+  origin[1] = -2.0;
+  origin[2] = 0.25;
+  geometry->SetOrigin(origin);
+  geometry->SetRegions(region);
+  geometry->Allocate();
+  std::vector<Voxel> voxels;
+  for(itk::ImageRegionIteratorWithIndex<WeightImage> it(geometry, region); !it.IsAtEnd(); ++it)
+    {
+    Voxel v = it.GetIndex();
+    const bool inside = v[0]>0 && v[1]>0 && v[2]<4;
+    it.Set(inside ? 0 : -1);
+    if(inside)
+      {
+      voxels.push_back(v);
+      }
+    }
+
+  const std::string wholeDirectory = directory+"/whole";
+  const std::string croppedDirectory = directory+"/cropped";
+  itksys::SystemTools::MakeDirectory(wholeDirectory.c_str());
+  itksys::SystemTools::MakeDirectory(croppedDirectory.c_str());
+  if(!WriteCroppedWeights(geometry, wholeDirectory, croppedDirectory))
+    {
+    return false;
+    }
+
+  WeightMapType maps[2];
+  bender::DomainMask::Pointer domains[2];
+  const std::string directories[2] = {wholeDirectory, croppedDirectory};
+  for(int d=0; d<2; ++d)
+    {
+    std::vector<std::string> fnames;
+    bender::GetWeightFileNames(directories[d], fnames);
+    bender::DomainMask::GeometryImage::Pointer readGeometry = bender::ReadWeightGeometry(fnames);
+    if(!readGeometry || readGeometry->GetLargestPossibleRegion()!=region)
+      {
+      std::cerr << "The weights in " << directories[d] << " do not have the region of the body" << std::endl;
+      return false;
+      }
+    for(int dim=0; dim<3; ++dim)
+      {
+      if(std::fabs(readGeometry->GetOrigin()[dim]-origin[dim])>1e-6)
+        {
+        std::cerr << "The weights in " << directories[d] << " do not have the origin of the body" << std::endl;
+        return false;
+        }
+      }
+    domains[d] = bender::DomainMask::New();
+    if(!bender::ReadWeightDomain(fnames, readGeometry, domains[d])
+       || bender::ReadWeights(fnames, voxels, maps[d], 2)!=static_cast<int>(fnames.size()))
+      {
+      std::cerr << "Cannot read the weights in " << directories[d] << std::endl;
+      return false;
+      }
+    }
+
+  for(itk::ImageRegionIteratorWithIndex<WeightImage> it(geometry, region); !it.IsAtEnd(); ++it)
+    {
+    if(domains[0]->GetPixel(it.GetIndex())!=(it.Get()>=0)
+       || domains[1]->GetPixel(it.GetIndex())!=(it.Get()>=0))
+      {
+      std::cerr << "The domain of the weights differs at " << it.GetIndex() << std::endl;
+      return false;
+      }
+    }
+  if(maps[0].GetValues().empty() || !CompareWeightMaps(maps[0], maps[1]))
+    {
+    std::cerr << "The cropped weights differ from the whole ones" << std::endl;
+    return false;
+    }
+
+  //a cropped image that is not on the voxels of the others
+  WeightImage::Pointer shifted = WeightImage::New();
+  shifted->CopyInformation(geometry);
+  WeightImage::PointType shiftedOrigin;
+  for(int dim=0; dim<3; ++dim)
+    {
+    shiftedOrigin[dim] = origin[dim]+0.5;
+    }
+  shifted->SetOrigin(shiftedOrigin);
+  shifted->SetRegions(region);
+  shifted->Allocate();
+  shifted->FillBuffer(0);
+  if(!WriteWeightImage(shifted, croppedDirectory+"/weight_4.mha"))
+    {
+    return false;
+    }
+  std::vector<std::string> fnames;
+  bender::GetWeightFileNames(croppedDirectory, fnames);
+  if(bender::ReadWeightGeometry(fnames))
+    {
+    std::cerr << "Weights that are not on the same voxels were read" << std::endl;
+    return false;
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderWeightMapIOTest(int argc, char* argv[])
+{
+  if(argc<2)
+    {
+    std::cerr << "Usage: " << argv[0] << " directory" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string directory = argv[1];
+  itksys::SystemTools::MakeDirectory(directory.c_str());
+  const std::string fname = directory+"/weightmap.bwm";
+  const std::string corruptedName = directory+"/corrupted.bwm";
+
+  WeightImage::Pointer geometry = WeightImage::New();
+  WeightMapType weightMap;
+  CreateWeightMap(geometry, weightMap);
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  domain->Init(geometry, 0);
+
+  //round trip
+  if(!bender::WriteWeightMap(fname, weightMap, domain.GetPointer(), NumberOfSites))
+    {
+    return EXIT_FAILURE;
+    }
+    {
+    WeightMapType readMap;
+    bender::DomainMask::Pointer readDomain = bender::DomainMask::New();
+    int numSites = bender::ReadWeightMap(fname, readMap, readDomain.GetPointer());
+    if(numSites!=NumberOfSites)
+      {
+      std::cerr << "ReadWeightMap returned " << numSites << " sites, expected "
+                << NumberOfSites << std::endl;
+      return EXIT_FAILURE;
+      }
+    if(!CompareWeightMaps(weightMap, readMap))
+      {
+      return EXIT_FAILURE;
+      }
+    const Region& region = domain->GetLargestPossibleRegion();
+    if(readDomain->GetLargestPossibleRegion()!=region)
+      {
+      std::cerr << "The read domain has another region" << std::endl;
+      return EXIT_FAILURE;
+      }
+    for(itk::ImageRegionIteratorWithIndex<WeightImage> it(geometry, region); !it.IsAtEnd(); ++it)
+      {
+      if(readDomain->GetPixel(it.GetIndex())!=(it.Get()>=0))
+        {
+        std::cerr << "The read domain differs at " << it.GetIndex() << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  std::string content;
+  if(!ReadFile(fname, content))
+    {
+    std::cerr << "Cannot read " << fname << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //truncated files
+  const size_t lengths[3] = {10, content.size()/2, content.size()-1};
+  for(int i=0; i<3; ++i)
+    {
+    if(!ExpectRejected(corruptedName, content.substr(0, lengths[i]), "missing bytes"))
+      {
+      return EXIT_FAILURE;
+      }
+    }
+
+  //corrupted arrays
+  const bender::VoxelIndex::VoxelKeys& keys = weightMap.GetVoxels().GetKeys();
+  const WeightMapType::RowOffsets& offsets = weightMap.GetRowOffsets();
+  const size_t keysPosition = FindArray(content, keys.begin(), keys.size());
+  const size_t offsetsPosition = FindArray(content, offsets.begin(), offsets.size());
+  if(keys.size()<3 || keysPosition==std::string::npos || offsetsPosition==std::string::npos)
+    {
+    std::cerr << "Cannot find the arrays of the map in " << fname << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::string corrupted = content;
+  SetElement(corrupted, keysPosition, 0, keys[1]);
+  SetElement(corrupted, keysPosition, 1, keys[0]);
+  if(!ExpectRejected(corruptedName, corrupted, "unsorted keys"))
+    {
+    return EXIT_FAILURE;
+    }
+
+  corrupted = content;
+  SetElement(corrupted, keysPosition, keys.size()-1,
+             static_cast<bender::VoxelIndex::VoxelKey>(keys[keys.size()-1]+(1u<<30)));
+  if(!ExpectRejected(corruptedName, corrupted, "a key outside of the region"))
+    {
+    return EXIT_FAILURE;
+    }
+
+  corrupted = content;
+  SetElement(corrupted, offsetsPosition, 1, static_cast<WeightMapType::RowOffset>(offsets[2]+1));
+  if(!ExpectRejected(corruptedName, corrupted, "decreasing row offsets"))
+    {
+    return EXIT_FAILURE;
+    }
+
+  //site indices past the number of sites
+  if(!bender::WriteWeightMap(corruptedName, weightMap, domain.GetPointer(), NumberOfSites-1))
+    {
+    return EXIT_FAILURE;
+    }
+  if(!ReadFile(corruptedName, corrupted)
+     || !ExpectRejected(corruptedName, corrupted, "site indices past the number of sites"))
+    {
+    return EXIT_FAILURE;
+    }
+
+  if(!TestSkinBinding(directory) || !TestCroppedWeights(directory))
+    {
+    return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,208 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Check that LerpBatch gives the weights of the sparse Lerp at every point,
+// for points inside, on the border and outside of the domain of a ball
+// shaped body, with several threads.
+//
+// Usage: benderWeightMapMathTest
+
+// Bender includes
+#include "benderDomainMask.h"
+#include "benderWeightMap.h"
+#include "benderWeightMapMath.h"
+
+// ITK includes
+#include <itkContinuousIndex.h>
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkPoint.h>
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+typedef itk::Image<float,3> WeightImage;
+typedef bender::VoxelIndex::Voxel Voxel;
+typedef bender::VoxelIndex::Region Region;
+
+const int NumberOfSites = 6;
+const size_t NumberOfPoints = 5000;
+
+//-------------------------------------------------------------------------------
+// The geometry of the weights, with a ball shaped domain in a region that
+// does not start at 0
+void CreateGeometry(WeightImage::Pointer geometry, std::vector<Voxel>& voxels)
+{
+  Region::IndexType start;
+  start[0] = 1;
+  start[1] = 3;
+  start[2] = 2;
+  Region::SizeType size;
+  size[0] = 12;
+  size[1] = 10;
+  size[2] = 11;
+  Region region(start, size);
+  geometry->SetRegions(region);
+  geometry->Allocate();
+  geometry->FillBuffer(-1);
+  WeightImage::PointType origin;
+  origin[0] = 1.5;
+  origin[1] = -3.0;
+  origin[2] = 2.25;
+  geometry->SetOrigin(origin);
+
+  for(itk::ImageRegionIteratorWithIndex<WeightImage> it(geometry, region); !it.IsAtEnd(); ++it)
+    {
+    Voxel v = it.GetIndex();
+    double r2(0);
+    for(int dim=0; dim<3; ++dim)
+      {
+      const double x = v[dim]-start[dim]-0.5*(size[dim]-1);
+      r2+= x*x;
+      }
+    if(r2<=16.0)
+      {
+      it.Set(0);
+      voxels.push_back(v);
+      }
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class WeightMapType>
+void CreateWeightMap(const std::vector<Voxel>& voxels, const Region& region,
+                     WeightMapType& weightMap)
+{
+  weightMap.Init(voxels, region);
+  for(size_t j=0; j<voxels.size(); ++j)
+    {
+    const Voxel& v = voxels[j];
+    for(int i=0; i<NumberOfSites; ++i)
+      {
+      const int w = (7*v[0]+3*v[1]+v[2]+5*i)%4;
+      if(w>0)
+        {
+        weightMap.Insert(v, static_cast<typename WeightMapType::SiteIndex>(i), 0.25f*w);
+        }
+      }
+    }
+  weightMap.Finalize();
+}
+
+//-------------------------------------------------------------------------------
+template<class WeightMapType>
+bool CompareLerps(const WeightMapType& weightMap, const bender::DomainMask::Pointer& domain,
+                  const std::vector<double>& points)
+{
+  const size_t numPoints = points.size()/3;
+  bender::WeightBatch batch;
+  bender::LerpBatch<bender::DomainMask>(weightMap, domain, true, &points[0], numPoints, batch, 4);
+  if(batch.Offsets.size()!=numPoints+1 || batch.Valid.size()!=numPoints)
+    {
+    std::cerr << "LerpBatch has " << batch.Valid.size() << " points, expected "
+              << numPoints << std::endl;
+    return false;
+    }
+
+  bender::SparseWeightVector corners[8];
+  bender::SparseWeightVector values;
+  size_t numValid(0);
+  for(size_t i=0; i<numPoints; ++i)
+    {
+    itk::Point<double,3> x;
+    for(int dim=0; dim<3; ++dim)
+      {
+      x[dim] = points[3*i+dim];
+      }
+    itk::ContinuousIndex<double,3> coord;
+    domain->TransformPhysicalPointToContinuousIndex(x, coord);
+    const bool valid = bender::Lerp<bender::DomainMask>(weightMap, coord, domain, true, corners, values);
+    numValid+= valid ? 1 : 0;
+
+    const size_t first = batch.Offsets[i];
+    bool same = valid==(batch.Valid[i]!=0)
+      && (!valid || batch.Offsets[i+1]-first==values.GetSize());
+    for(size_t k=0; k<values.GetSize() && valid && same; ++k)
+      {
+      same = batch.Indices[first+k]==values.GetIndex(k)
+        && std::fabs(batch.Values[first+k]-values.GetValue(k))<=1e-6f;
+      }
+    if(!same)
+      {
+      std::cerr << "LerpBatch and Lerp differ at point " << i << " ("
+                << coord[0] << "," << coord[1] << "," << coord[2] << ")" << std::endl;
+      return false;
+      }
+    }
+  if(numValid==0 || numValid==numPoints)
+    {
+    std::cerr << numValid << " of the " << numPoints << " points are valid, expected "
+              << "points inside and outside of the domain" << std::endl;
+    return false;
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderWeightMapMathTest(int, char*[])
+{
+  WeightImage::Pointer geometry = WeightImage::New();
+  std::vector<Voxel> voxels;
+  CreateGeometry(geometry, voxels);
+  const Region& region = geometry->GetLargestPossibleRegion();
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  domain->Init(geometry, 0);
+
+  //random points in the cells of the region, and the voxels themselves
+  std::vector<double> points;
+  srand(0);
+  for(size_t i=0; i<NumberOfPoints; ++i)
+    {
+    for(int dim=0; dim<3; ++dim)
+      {
+      const double c = region.GetIndex()[dim]
+        + rand()/(RAND_MAX+1.0)*(region.GetSize()[dim]-1);
+      points.push_back(geometry->GetOrigin()[dim]+c); //unit spacing
+      }
+    }
+  for(size_t j=0; j<voxels.size(); ++j)
+    {
+    for(int dim=0; dim<3; ++dim)
+      {
+      points.push_back(geometry->GetOrigin()[dim]+voxels[j][dim]);
+      }
+    }
+
+  bender::WeightMap<unsigned char, float> floatMap;
+  CreateWeightMap(voxels, region, floatMap);
+  bender::WeightMap<unsigned short, bender::HalfFloat> halfMap;
+  CreateWeightMap(voxels, region, halfMap);
+  if(!CompareLerps(floatMap, domain, points) || !CompareLerps(halfMap, domain, points))
+    {
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,163 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Check the conversions of the 16 bit weight values from and to float.
+//
+// Usage: benderWeightValueTest
+
+// Bender includes
+#include "benderWeightValue.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+
+namespace
+{
+//-------------------------------------------------------------------------------
+template<class TValue>
+bool CheckValue(float value, float expected)
+{
+  const float converted = TValue(value);
+  if(converted!=expected)
+    {
+    std::cerr << bender::WeightValueTraits<TValue>::GetName() << " of " << value
+              << " is " << converted << ", expected " << expected << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool TestHalfFloat()
+{
+  typedef bender::HalfFloat HalfFloat;
+  const float infinity = std::numeric_limits<float>::infinity();
+
+  //every half float but the NaNs is converted back to the same bits
+  for(unsigned int bits=0; bits<=0xffff; ++bits)
+    {
+    const itk::uint16_t half = static_cast<itk::uint16_t>(bits);
+    const float value = HalfFloat::ToFloat(half);
+    if((bits & 0x7c00)==0x7c00 && (bits & 0x3ff))
+      {
+      const float converted = HalfFloat::ToFloat(HalfFloat::FromFloat(value));
+      if(value==value || converted==converted)
+        {
+        std::cerr << "The half float NaN " << bits << " is not a NaN" << std::endl;
+        return false;
+        }
+      continue;
+      }
+    if(HalfFloat::FromFloat(value)!=half)
+      {
+      std::cerr << "The half float " << bits << " (" << value << ") is converted to "
+                << HalfFloat::FromFloat(value) << std::endl;
+      return false;
+      }
+    }
+
+  //exact values, rounding to nearest even, overflow and underflow
+  const float smallest = std::ldexp(1.0f, -24);
+  if(!CheckValue<HalfFloat>(0.0f, 0.0f)
+     || !CheckValue<HalfFloat>(1.0f, 1.0f)
+     || !CheckValue<HalfFloat>(0.5f, 0.5f)
+     || !CheckValue<HalfFloat>(-2.0f, -2.0f)
+     || !CheckValue<HalfFloat>(65504.0f, 65504.0f)
+     || !CheckValue<HalfFloat>(smallest, smallest)
+     || !CheckValue<HalfFloat>(1.0f+std::ldexp(1.0f, -11), 1.0f)
+     || !CheckValue<HalfFloat>(1.0f+3*std::ldexp(1.0f, -11), 1.0f+std::ldexp(1.0f, -9))
+     || !CheckValue<HalfFloat>(1.0e6f, infinity)
+     || !CheckValue<HalfFloat>(-infinity, -infinity)
+     || !CheckValue<HalfFloat>(1.0e-10f, 0.0f))
+    {
+    return false;
+    }
+
+  //the relative error of a weight is at most 2^-11, the absolute error of
+  //a subnormal half float 2^-25
+  for(int i=0; i<=100000; ++i)
+    {
+    const float value = i/100000.0f;
+    const float error = std::fabs(static_cast<float>(HalfFloat(value))-value);
+    if(error>std::max(value*std::ldexp(1.0f, -11), std::ldexp(1.0f, -25)))
+      {
+      std::cerr << "The half float of " << value << " has an error of " << error << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool TestFixed16()
+{
+  typedef bender::Fixed16 Fixed16;
+
+  //every step of [0,1] is converted back to itself
+  for(unsigned int bits=0; bits<=0xffff; ++bits)
+    {
+    const float value = bits*(1.0f/65535.0f);
+    if(Fixed16::FromFloat(value)!=bits)
+      {
+      std::cerr << "The fixed16 " << bits << " (" << value << ") is converted to "
+                << Fixed16::FromFloat(value) << std::endl;
+      return false;
+      }
+    }
+
+  //exact values and clamping
+  if(!CheckValue<Fixed16>(0.0f, 0.0f)
+     || !CheckValue<Fixed16>(1.0f, 1.0f)
+     || !CheckValue<Fixed16>(-0.5f, 0.0f)
+     || !CheckValue<Fixed16>(2.0f, 1.0f)
+     || !CheckValue<Fixed16>(std::numeric_limits<float>::quiet_NaN(), 0.0f))
+    {
+    return false;
+    }
+
+  //the absolute error of a weight is at most half a step
+  const float maximumError = 1.0f/131070.0f + std::numeric_limits<float>::epsilon();
+  for(int i=0; i<=100000; ++i)
+    {
+    const float value = i/100000.0f;
+    const float error = std::fabs(static_cast<float>(Fixed16(value))-value);
+    if(error>maximumError)
+      {
+      std::cerr << "The fixed16 of " << value << " has an error of " << error << std::endl;
+      return false;
+      }
+    }
+  return true;
+}
+}
+
+//-------------------------------------------------------------------------------
+int benderWeightValueTest(int, char*[])
+{
+  if(!TestHalfFloat() || !TestFixed16())
+    {
+    return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
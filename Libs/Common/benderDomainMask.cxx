@@ -0,0 +1,114 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+// Bender includes
+#include "benderDomainMask.h"
+
+// ITK includes
+#include <itkImageRegionConstIterator.h>
+
+namespace bender
+{
+//-------------------------------------------------------------------------------
+DomainMask::Pointer DomainMask::New()
+{
+  Pointer mask = new DomainMask;
+  mask->UnRegister();
+  return mask;
+}
+
+//-------------------------------------------------------------------------------
+DomainMask::DomainMask()
+{
+  this->Geometry = GeometryImage::New();
+}
+
+//-------------------------------------------------------------------------------
+size_t DomainMask::GetNumberOfWords(const RegionType& region)
+{
+  return (region.GetNumberOfPixels()+31)/32;
+}
+
+//-------------------------------------------------------------------------------
+void DomainMask::SetGeometry(const GeometryImage* geometry)
+{
+  this->Geometry = GeometryImage::New();
+  this->Geometry->CopyInformation(geometry);
+  this->Geometry->SetRegions(geometry->GetLargestPossibleRegion());
+  this->Region = geometry->GetLargestPossibleRegion();
+}
+
+//-------------------------------------------------------------------------------
+void DomainMask::Init(const GeometryImage* image, float foregroundMinimum)
+{
+  this->SetGeometry(image);
+
+  std::vector<Word> words(GetNumberOfWords(this->Region), 0);
+  itk::uint64_t i(0);
+  for(itk::ImageRegionConstIterator<GeometryImage> it(image,this->Region); !it.IsAtEnd(); ++it, ++i)
+    {
+    if(it.Get()>=foregroundMinimum)
+      {
+      words[i>>5]|= Word(1)<<(i&31);
+      }
+    }
+  this->Bits.Swap(words);
+}
+
+//-------------------------------------------------------------------------------
+void DomainMask::Init(const GeometryImage* geometry, const std::vector<IndexType>& voxels)
+{
+  this->SetGeometry(geometry);
+
+  std::vector<Word> words(GetNumberOfWords(this->Region), 0);
+  for(size_t j=0; j<voxels.size(); ++j)
+    {
+    itk::uint64_t i = this->ComputeOffset(voxels[j]);
+    words[i>>5]|= Word(1)<<(i&31);
+    }
+  this->Bits.Swap(words);
+}
+
+//-------------------------------------------------------------------------------
+bool DomainMask::SetWords(const GeometryImage* geometry, const Words& words)
+{
+  if(words.size()!=GetNumberOfWords(geometry->GetLargestPossibleRegion()))
+    {
+    return false;
+    }
+  this->SetGeometry(geometry);
+  this->Bits = words;
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+size_t DomainMask::GetNumberOfVoxelsInDomain() const
+{
+  size_t numVoxels(0);
+  for(size_t k=0; k<this->Bits.size(); ++k)
+    {
+    for(Word word = this->Bits[k]; word; word&= word-1)
+      {
+      ++numVoxels;
+      }
+    }
+  return numVoxels;
+}
+};
@@ -0,0 +1,135 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+#ifndef __DomainMask_h
+#define __DomainMask_h
+
+// .NAME DomainMask - one bit per voxel telling if it is in the weight domain
+// .SECTION General Description
+// DomainMask replaces a weight image kept in memory only to test whether
+// its voxels are in the domain (weight>=0). It stores one bit per voxel of
+// the region and the geometry of the weight images, without their pixels.
+// It has the part of the itk::Image interface used by the Lerp functions,
+// GetPixel() returns whether a voxel is in the domain.
+
+// Bender includes
+#include "BenderCommonExport.h"
+#include "benderWeightMap.h"
+
+// ITK includes
+#include <itkContinuousIndex.h>
+#include <itkImage.h>
+#include <itkIntTypes.h>
+#include <itkLightObject.h>
+#include <itkPoint.h>
+
+// STD includes
+#include <vector>
+
+namespace bender
+{
+class BENDER_COMMON_EXPORT DomainMask: public itk::LightObject
+{
+ public:
+  typedef DomainMask Self;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  typedef itk::Image<float,3> GeometryImage;
+  typedef bool PixelType;
+  typedef GeometryImage::IndexType IndexType;
+  typedef GeometryImage::RegionType RegionType;
+  typedef GeometryImage::PointType PointType;
+  typedef GeometryImage::DirectionType DirectionType;
+
+  // The bit of the i-th voxel of the region, in linear order, is the bit
+  // i%32 of the word i/32
+  typedef itk::uint32_t Word;
+  typedef PackedArray<Word> Words;
+
+  static Pointer New();
+
+  // The voxels where the image is at least foregroundMinimum are in the domain
+  void Init(const GeometryImage* image, float foregroundMinimum);
+  // The given voxels of the region of geometry are in the domain
+  void Init(const GeometryImage* geometry, const std::vector<IndexType>& voxels);
+  // Use words saved elsewhere, e.g. in a weight map file. Return false if
+  // their number does not match the region of geometry.
+  bool SetWords(const GeometryImage* geometry, const Words& words);
+  const Words& GetWords() const
+  {
+    return this->Bits;
+  }
+  static size_t GetNumberOfWords(const RegionType& region);
+
+  // Whether a voxel of the region is in the domain
+  bool GetPixel(const IndexType& q) const
+  {
+    itk::uint64_t i = this->ComputeOffset(q);
+    return (this->Bits[i>>5]>>(i&31)) & 1;
+  }
+  size_t GetNumberOfVoxelsInDomain() const;
+
+  // Geometry of the weight images
+  const GeometryImage* GetGeometry() const
+  {
+    return this->Geometry;
+  }
+  const RegionType& GetLargestPossibleRegion() const
+  {
+    return this->Region;
+  }
+  const PointType& GetOrigin() const
+  {
+    return this->Geometry->GetOrigin();
+  }
+  const DirectionType& GetPhysicalPointToIndex() const
+  {
+    return this->Geometry->GetPhysicalPointToIndex();
+  }
+  template<class TCoordRep>
+  bool TransformPhysicalPointToContinuousIndex(const itk::Point<TCoordRep,3>& point,
+                                               itk::ContinuousIndex<TCoordRep,3>& index) const
+  {
+    return this->Geometry->TransformPhysicalPointToContinuousIndex(point, index);
+  }
+
+ protected:
+  DomainMask();
+
+ private:
+  DomainMask(const Self&); //not implemented
+  void operator=(const Self&); //not implemented
+
+  void SetGeometry(const GeometryImage* geometry);
+  itk::uint64_t ComputeOffset(const IndexType& q) const
+  {
+    const IndexType& start = this->Region.GetIndex();
+    const RegionType::SizeType& size = this->Region.GetSize();
+    return (static_cast<itk::uint64_t>(q[2]-start[2])*size[1] + (q[1]-start[1]))*size[0] + (q[0]-start[0]);
+  }
+
+  GeometryImage::Pointer Geometry; //not allocated
+  RegionType Region;
+  Words Bits;
+};
+};
+
+#endif
@@ -0,0 +1,175 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+#ifndef __FixedWeightMap_h
+#define __FixedWeightMap_h
+
+// .NAME FixedWeightMap - weight map with at most K influences per voxel
+// .SECTION General Description
+// FixedWeightMap keeps the K largest weights of each voxel of a WeightMap,
+// renormalized to sum to one. Every voxel has exactly K entries sorted by
+// site index, the unused ones come last with a zero value. The weights that
+// round to zero in the value type are not kept. The memory does not depend
+// on the number of sites and the loops over the entries of a voxel have a
+// fixed length. The site indices and the values have the types of the
+// WeightMap template, and can be initialized from any of its
+// instantiations.
+
+// Bender includes
+#include "benderWeightMap.h"
+
+// STD includes
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace bender
+{
+template<unsigned int K, class TSiteIndex = unsigned short, class TValue = float>
+class FixedWeightMap
+{
+ public:
+  typedef TSiteIndex SiteIndex;
+  typedef TValue ValueType;
+  typedef VoxelIndex::Voxel Voxel;
+  typedef VoxelIndex::Region Region;
+  typedef itk::VariableLengthVector<float> WeightVector;
+
+  struct WeightEntry
+  {
+    SiteIndex Index[K];
+    ValueType Value[K];
+  };
+  typedef std::vector<WeightEntry> WeightEntries;
+
+  template<class TWeightMap>
+  void Init(const TWeightMap& weightMap);
+
+  // Entry of a voxel, 0 if the voxel is not in the map
+  const WeightEntry* GetEntry(const Voxel& v) const
+  {
+    size_t j = this->Voxels.Find(v);
+    return j==VoxelIndex::NoVoxel ? 0 : &this->Entries[j];
+  }
+
+  void Get(const Voxel& v, WeightVector& values) const
+  {
+    values.Fill(0);
+    const WeightEntry* entry = this->GetEntry(v);
+    if(entry)
+      {
+      for(unsigned int k=0; k<K; ++k)
+        {
+        values[entry->Index[k]]+= entry->Value[k];
+        }
+      }
+  }
+
+  void Get(const Voxel& v, SparseWeightVector& values) const
+  {
+    values.Clear();
+    const WeightEntry* entry = this->GetEntry(v);
+    if(entry)
+      {
+      for(unsigned int k=0; k<K; ++k)
+        {
+        const float value = entry->Value[k];
+        if(value>0)
+          {
+          values.Append(entry->Index[k], value);
+          }
+        }
+      }
+  }
+
+  const VoxelIndex& GetVoxels() const
+  {
+    return this->Voxels;
+  }
+
+ private:
+  static bool LessSiteIndex(const std::pair<float, SiteIndex>& a, const std::pair<float, SiteIndex>& b)
+  {
+    return a.second<b.second;
+  }
+
+  VoxelIndex Voxels;
+  WeightEntries Entries;
+};
+
+//-------------------------------------------------------------------------------
+template<unsigned int K, class TSiteIndex, class TValue>
+template<class TWeightMap>
+void FixedWeightMap<K, TSiteIndex, TValue>::Init(const TWeightMap& weightMap)
+{
+  typedef std::pair<float, SiteIndex> Influence;
+
+  this->Voxels = weightMap.GetVoxels();
+  this->Entries.resize(this->Voxels.GetNumberOfVoxels());
+
+  std::vector<Influence> influences;
+  for(size_t j=0; j<this->Entries.size(); ++j)
+    {
+    size_t rowSize = weightMap.GetRowSize(j);
+    const typename TWeightMap::SiteIndex* indices = weightMap.GetRowIndices(j);
+    const typename TWeightMap::ValueType* values = weightMap.GetRowValues(j);
+
+    influences.clear();
+    for(size_t k=0; k<rowSize; ++k)
+      {
+      influences.push_back(Influence(values[k], static_cast<SiteIndex>(indices[k])));
+      }
+    size_t numKept = std::min(rowSize, static_cast<size_t>(K));
+    std::partial_sort(influences.begin(), influences.begin()+numKept, influences.end(),
+                      std::greater<Influence>());
+    //the kept influences are stored by site index, the unused slots last
+    std::sort(influences.begin(), influences.begin()+numKept, LessSiteIndex);
+
+    float sum(0);
+    for(size_t k=0; k<numKept; ++k)
+      {
+      sum+= influences[k].first;
+      }
+
+    //the influences that round to zero in the value type are dropped
+    WeightEntry& entry = this->Entries[j];
+    unsigned int numEntries(0);
+    for(size_t k=0; k<numKept && sum>0; ++k)
+      {
+      const ValueType value(influences[k].first/sum);
+      if(static_cast<float>(value)>0)
+        {
+        entry.Index[numEntries] = influences[k].second;
+        entry.Value[numEntries] = value;
+        ++numEntries;
+        }
+      }
+    for(unsigned int k=numEntries; k<K; ++k)
+      {
+      entry.Index[k] = 0;
+      entry.Value[k] = 0;
+      }
+    }
+}
+
+};
+
+#endif
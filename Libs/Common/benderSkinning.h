@@ -0,0 +1,307 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+#ifndef __Skinning_h
+#define __Skinning_h
+
+// .NAME Skinning - pose vertices with the weights of their bones
+// .SECTION General Description
+// LinearBlendSkinning converts the rigid transform of each bone once into a
+// packed 3x4 float matrix [R|t]. A vertex is posed by the sum of the
+// matrices of its non-zero weights, normalized by the sum of the weights,
+// applied once. The vertices are processed in blocks of BlockSize, with
+// the blended matrices and the coordinates of a block stored by component
+// (structure of arrays) so that the products vectorize across the
+// vertices of the block.
+//
+// DualQuaternionSkinning blends the unit dual quaternions of the bones the
+// same way. The quaternion of each bone is flipped to the hemisphere of the
+// largest weight of the vertex before the blend, and the vertex is
+// transformed by the normalized blend directly, without conversion to a
+// matrix.
+
+// Bender includes
+#include "benderWeightMapMath.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace bender
+{
+class LinearBlendSkinning
+{
+ public:
+  enum
+    {
+    BlockSize = 8,
+    MatrixSize = 12
+    };
+
+  void SetNumberOfBones(size_t numBones)
+  {
+    this->Matrices.assign(MatrixSize*numBones, 0.0f);
+  }
+  size_t GetNumberOfBones() const
+  {
+    return this->Matrices.size()/MatrixSize;
+  }
+
+  // The bone maps x to rotation*x+translation
+  void SetBone(size_t i, const double rotation[3][3], const double translation[3])
+  {
+    float* matrix = &this->Matrices[MatrixSize*i];
+    for(int r=0; r<3; ++r)
+      {
+      for(int c=0; c<3; ++c)
+        {
+        matrix[4*r+c] = static_cast<float>(rotation[r][c]);
+        }
+      matrix[4*r+3] = static_cast<float>(translation[r]);
+      }
+  }
+
+  // Pose the vertices [begin,end) of a batch, the weights of the i-th vertex
+  // are the i-th row of weights. The coordinates (x,y,z of each vertex) of
+  // the input and the output are indexed like the rows. A vertex without
+  // weights keeps its position.
+  template<class T>
+  void Apply(const double* vertices, const WeightBatch& weights,
+             size_t begin, size_t end, T* posed) const
+  {
+    float matrix[MatrixSize][BlockSize];
+    float x[3][BlockSize];
+    float scale[BlockSize];
+    size_t first[BlockSize];
+    size_t count[BlockSize];
+    for(size_t block=begin; block<end; block+=BlockSize)
+      {
+      const size_t numVertices = std::min(static_cast<size_t>(BlockSize), end-block);
+      size_t maxCount(0);
+      for(size_t lane=0; lane<BlockSize; ++lane)
+        {
+        //the lanes past the end repeat the last vertex
+        const size_t i = block+std::min(lane, numVertices-1);
+        first[lane] = weights.Offsets[i];
+        count[lane] = weights.Offsets[i+1]-weights.Offsets[i];
+        maxCount = std::max(maxCount, count[lane]);
+        float sum(0);
+        for(size_t k=0; k<count[lane]; ++k)
+          {
+          sum+= weights.Values[first[lane]+k];
+          }
+        scale[lane] = sum>0 ? 1.0f/sum : 0.0f;
+        for(int c=0; c<MatrixSize; ++c)
+          {
+          //identity for the vertices without weights
+          matrix[c][lane] = sum>0 || c%5!=0 ? 0.0f : 1.0f;
+          }
+        for(int dim=0; dim<3; ++dim)
+          {
+          x[dim][lane] = static_cast<float>(vertices[3*i+dim]);
+          }
+        }
+
+      //blend the matrices of the k-th influence of every vertex
+      for(size_t k=0; k<maxCount; ++k)
+        {
+        for(size_t lane=0; lane<BlockSize; ++lane)
+          {
+          if(k>=count[lane])
+            {
+            continue;
+            }
+          const size_t j = first[lane]+k;
+          const float w = weights.Values[j]*scale[lane];
+          const float* bone = &this->Matrices[MatrixSize*weights.Indices[j]];
+          for(int c=0; c<MatrixSize; ++c)
+            {
+            matrix[c][lane]+= w*bone[c];
+            }
+          }
+        }
+
+      float y[3][BlockSize];
+      for(int r=0; r<3; ++r)
+        {
+        for(size_t lane=0; lane<BlockSize; ++lane)
+          {
+          y[r][lane] = matrix[4*r][lane]*x[0][lane] + matrix[4*r+1][lane]*x[1][lane]
+            + matrix[4*r+2][lane]*x[2][lane] + matrix[4*r+3][lane];
+          }
+        }
+      for(size_t lane=0; lane<numVertices; ++lane)
+        {
+        for(int dim=0; dim<3; ++dim)
+          {
+          posed[3*(block+lane)+dim] = static_cast<T>(y[dim][lane]);
+          }
+        }
+      }
+  }
+
+ private:
+  std::vector<float> Matrices; //MatrixSize per bone, rows first
+};
+
+class DualQuaternionSkinning
+{
+ public:
+  enum
+    {
+    BlockSize = 8,
+    DualQuaternionSize = 8
+    };
+
+  void SetNumberOfBones(size_t numBones)
+  {
+    this->DualQuaternions.assign(DualQuaternionSize*numBones, 0.0f);
+  }
+  size_t GetNumberOfBones() const
+  {
+    return this->DualQuaternions.size()/DualQuaternionSize;
+  }
+
+  // The bone maps x to q*x*conj(q)+translation, q is the unit quaternion
+  // (w,x,y,z) of the rotation
+  void SetBone(size_t i, const double rotation[4], const double translation[3])
+  {
+    const double* q = rotation;
+    const double* t = translation;
+    float* dq = &this->DualQuaternions[DualQuaternionSize*i];
+    for(int c=0; c<4; ++c)
+      {
+      dq[c] = static_cast<float>(q[c]);
+      }
+    //dual part 0.5*t*q
+    dq[4] = static_cast<float>(-0.5*(t[0]*q[1] + t[1]*q[2] + t[2]*q[3]));
+    dq[5] = static_cast<float>(0.5*(t[0]*q[0] + t[1]*q[3] - t[2]*q[2]));
+    dq[6] = static_cast<float>(0.5*(-t[0]*q[3] + t[1]*q[0] + t[2]*q[1]));
+    dq[7] = static_cast<float>(0.5*(t[0]*q[2] - t[1]*q[1] + t[2]*q[0]));
+  }
+
+  // Pose the vertices [begin,end) of a batch, see LinearBlendSkinning::Apply
+  template<class T>
+  void Apply(const double* vertices, const WeightBatch& weights,
+             size_t begin, size_t end, T* posed) const
+  {
+    float dq[DualQuaternionSize][BlockSize];
+    float x[3][BlockSize];
+    size_t first[BlockSize];
+    size_t count[BlockSize];
+    const float* pivot[BlockSize];
+    for(size_t block=begin; block<end; block+=BlockSize)
+      {
+      const size_t numVertices = std::min(static_cast<size_t>(BlockSize), end-block);
+      size_t maxCount(0);
+      for(size_t lane=0; lane<BlockSize; ++lane)
+        {
+        //the lanes past the end repeat the last vertex
+        const size_t i = block+std::min(lane, numVertices-1);
+        first[lane] = weights.Offsets[i];
+        count[lane] = weights.Offsets[i+1]-weights.Offsets[i];
+        maxCount = std::max(maxCount, count[lane]);
+        size_t largest = first[lane];
+        for(size_t k=1; k<count[lane]; ++k)
+          {
+          if(weights.Values[first[lane]+k]>weights.Values[largest])
+            {
+            largest = first[lane]+k;
+            }
+          }
+        pivot[lane] = count[lane]>0 ?
+          &this->DualQuaternions[DualQuaternionSize*weights.Indices[largest]] : 0;
+        for(int c=0; c<DualQuaternionSize; ++c)
+          {
+          //identity for the vertices without weights
+          dq[c][lane] = pivot[lane] || c!=0 ? 0.0f : 1.0f;
+          }
+        for(int dim=0; dim<3; ++dim)
+          {
+          x[dim][lane] = static_cast<float>(vertices[3*i+dim]);
+          }
+        }
+
+      //blend the k-th influence of every vertex, q and -q are the same
+      //rotation so the closest one to the pivot is used
+      for(size_t k=0; k<maxCount; ++k)
+        {
+        for(size_t lane=0; lane<BlockSize; ++lane)
+          {
+          if(k>=count[lane])
+            {
+            continue;
+            }
+          const size_t j = first[lane]+k;
+          const float* bone = &this->DualQuaternions[DualQuaternionSize*weights.Indices[j]];
+          const float* p = pivot[lane];
+          const float dot = bone[0]*p[0] + bone[1]*p[1] + bone[2]*p[2] + bone[3]*p[3];
+          const float w = dot<0 ? -weights.Values[j] : weights.Values[j];
+          for(int c=0; c<DualQuaternionSize; ++c)
+            {
+            dq[c][lane]+= w*bone[c];
+            }
+          }
+        }
+
+      //y = x + 2*v x (v x x + w*x) + t with the normalized real part (w,v)
+      //and t = 2*(w*ve - we*v + v x ve) with its dual part (we,ve)
+      float y[3][BlockSize];
+      for(size_t lane=0; lane<BlockSize; ++lane)
+        {
+        const float norm2 = dq[0][lane]*dq[0][lane] + dq[1][lane]*dq[1][lane]
+          + dq[2][lane]*dq[2][lane] + dq[3][lane]*dq[3][lane];
+        const float invNorm = norm2>0 ? 1.0f/std::sqrt(norm2) : 0.0f;
+        const float w = dq[0][lane]*invNorm;
+        const float vx = dq[1][lane]*invNorm;
+        const float vy = dq[2][lane]*invNorm;
+        const float vz = dq[3][lane]*invNorm;
+        const float we = dq[4][lane]*invNorm;
+        const float ex = dq[5][lane]*invNorm;
+        const float ey = dq[6][lane]*invNorm;
+        const float ez = dq[7][lane]*invNorm;
+
+        const float px = x[0][lane];
+        const float py = x[1][lane];
+        const float pz = x[2][lane];
+        const float ax = vy*pz - vz*py + w*px;
+        const float ay = vz*px - vx*pz + w*py;
+        const float az = vx*py - vy*px + w*pz;
+        y[0][lane] = px + 2.0f*(vy*az - vz*ay + w*ex - we*vx + vy*ez - vz*ey);
+        y[1][lane] = py + 2.0f*(vz*ax - vx*az + w*ey - we*vy + vz*ex - vx*ez);
+        y[2][lane] = pz + 2.0f*(vx*ay - vy*ax + w*ez - we*vz + vx*ey - vy*ex);
+        }
+      for(size_t lane=0; lane<numVertices; ++lane)
+        {
+        for(int dim=0; dim<3; ++dim)
+          {
+          posed[3*(block+lane)+dim] = static_cast<T>(y[dim][lane]);
+          }
+        }
+      }
+  }
+
+ private:
+  std::vector<float> DualQuaternions; //real part (w,x,y,z) then dual part
+};
+};
+
+#endif
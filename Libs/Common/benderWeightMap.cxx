@@ -21,92 +21,336 @@
 // Bender includes
 #include "benderWeightMap.h"
 
-// ITK includes
-#include <itkImageRegionIterator.h>
-
 // STD includes
+#include <algorithm>
+#include <cassert>
 #include <iostream>
-#include <numeric>
 
 namespace bender
 {
+const size_t VoxelIndex::NoVoxel = std::numeric_limits<size_t>::max();
+
+namespace
+{
 //-------------------------------------------------------------------------------
-WeightMap::WeightMap():Cols(0)
+// Spread the 21 low bits of x to every third bit
+itk::uint64_t SpreadBits(itk::uint64_t x)
 {
+  x&= 0x1fffff;
+  x = (x | x<<32) & 0x1f00000000ffffULL;
+  x = (x | x<<16) & 0x1f0000ff0000ffULL;
+  x = (x | x<<8)  & 0x100f00f00f00f00fULL;
+  x = (x | x<<4)  & 0x10c30c30c30c30c3ULL;
+  x = (x | x<<2)  & 0x1249249249249249ULL;
+  return x;
 }
 
 //-------------------------------------------------------------------------------
-void WeightMap::Init(const std::vector<Voxel>& voxels, const Region& region)
+// Inverse of SpreadBits
+itk::uint64_t CompactBits(itk::uint64_t x)
 {
-  this->Cols = voxels.size();
-  this->RowSize.resize(this->Cols,0);
+  x&= 0x1249249249249249ULL;
+  x = (x | x>>2)  & 0x10c30c30c30c30c3ULL;
+  x = (x | x>>4)  & 0x100f00f00f00f00fULL;
+  x = (x | x>>8)  & 0x1f0000ff0000ffULL;
+  x = (x | x>>16) & 0x1f00000000ffffULL;
+  x = (x | x>>32) & 0x1fffff;
+  return x;
+}
+}
 
-  this->LUTIndex = WeightLUTIndex::New();
-  this->LUTIndex->SetRegions(region);
-  this->LUTIndex->Allocate();
+//-------------------------------------------------------------------------------
+VoxelIndex::VoxelIndex(): Order(LinearOrder)
+{
+}
 
-  itk::ImageRegionIterator<WeightLUTIndex> it(this->LUTIndex,region);
-  for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+//-------------------------------------------------------------------------------
+void VoxelIndex::Init(const std::vector<Voxel>& voxels, const Region& region, Ordering order)
+{
+  this->Domain = region;
+  this->Order = order;
+  //Morton codes take 21 bits per dimension
+  for(int d=0; d<3; ++d)
     {
-    it.Set(std::numeric_limits<std::size_t>::max());
+    if(region.GetSize()[d]>(1u<<21))
+      {
+      this->Order = LinearOrder;
+      }
     }
-
+  std::vector<VoxelKey> keys;
+  keys.reserve(voxels.size());
   for(size_t j=0; j<voxels.size(); ++j)
     {
-    this->LUTIndex->SetPixel(voxels[j], j);
+    if(region.IsInside(voxels[j]))
+      {
+      keys.push_back(this->ComputeKey(voxels[j]));
+      }
     }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  this->Keys.Swap(keys);
 }
 
 //-------------------------------------------------------------------------------
-bool WeightMap::Insert(const Voxel& v, SiteIndex index, float value)
+void VoxelIndex::SetKeys(const Region& region, const VoxelKeys& keys, Ordering order)
 {
-  if(value<=0)
+  this->Domain = region;
+  this->Keys = keys;
+  this->Order = order;
+}
+
+//-------------------------------------------------------------------------------
+VoxelIndex::VoxelKey VoxelIndex::ComputeKey(const Voxel& v) const
+{
+  VoxelKey key(0);
+  for(int d=2; d>=0; --d)
     {
-    return false;
+    VoxelKey x = v[d]-this->Domain.GetIndex()[d];
+    if(this->Order==MortonOrder)
+      {
+      key = key<<1 | SpreadBits(x);
+      }
+    else
+      {
+      key = key*this->Domain.GetSize()[d] + x;
+      }
+    }
+  return key;
+}
+
+//-------------------------------------------------------------------------------
+size_t VoxelIndex::Find(const Voxel& v) const
+{
+  if(!this->Domain.IsInside(v))
+    {
+    return NoVoxel;
+    }
+  VoxelKey key = this->ComputeKey(v);
+  const VoxelKey* it = std::lower_bound(this->Keys.begin(), this->Keys.end(), key);
+  if(it==this->Keys.end() || *it!=key)
+    {
+    return NoVoxel;
     }
-  size_t j = this->LUTIndex->GetPixel(v);
-  assert(j<Cols);
-  size_t i = this->RowSize[j];
-  if (i>=LUT.size())
+  return it - this->Keys.begin();
+}
+
+//-------------------------------------------------------------------------------
+VoxelIndex::Voxel VoxelIndex::GetVoxel(size_t j) const
+{
+  Voxel v;
+  VoxelKey key = this->Keys[j];
+  for(unsigned int d=0; d<3; ++d)
     {
-    this->AddRow();
+    if(this->Order==MortonOrder)
+      {
+      v[d] = this->Domain.GetIndex()[d] + CompactBits(key>>d);
+      }
+    else
+      {
+      v[d] = this->Domain.GetIndex()[d] + key%this->Domain.GetSize()[d];
+      key/= this->Domain.GetSize()[d];
+      }
     }
-  WeightEntry& weight = this->LUT[i][j];
-  weight.Index = index;
-  weight.Value = value;
+  return v;
+}
 
-  this->RowSize[j]++;
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+WeightMap<TSiteIndex, TValue>::WeightMap()
+{
+}
+
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Init(const std::vector<Voxel>& voxels, const Region& region,
+                                         VoxelIndex::Ordering order)
+{
+  this->Voxels.Init(voxels, region, order);
+  std::vector<RowOffset> offsets(this->Voxels.GetNumberOfVoxels()+1, 0);
+  std::vector<SiteIndex> indices;
+  std::vector<ValueType> values;
+  this->Offsets.Swap(offsets);
+  this->Indices.Swap(indices);
+  this->Values.Swap(values);
+  this->Staged.clear();
+}
+
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::SetPacked(const VoxelIndex& voxels, const RowOffsets& offsets,
+                                              const SiteIndices& indices, const WeightValues& values)
+{
+  assert(offsets.size()==voxels.GetNumberOfVoxels()+1);
+  assert(indices.size()==offsets[voxels.GetNumberOfVoxels()]);
+  assert(values.size()==indices.size());
+  this->Voxels = voxels;
+  this->Offsets = offsets;
+  this->Indices = indices;
+  this->Values = values;
+  this->Staged.clear();
+}
+
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+bool WeightMap<TSiteIndex, TValue>::Insert(const Voxel& v, SiteIndex index, float value)
+{
+  ValueType storedValue(value);
+  if(!(static_cast<float>(storedValue)>0))
+    {
+    return false;
+    }
+  size_t j = this->Voxels.Find(v);
+  assert(j!=VoxelIndex::NoVoxel);
+  if(j==VoxelIndex::NoVoxel)
+    {
+    return false;
+    }
+  StagedEntry entry;
+  entry.Row = j;
+  entry.Index = index;
+  entry.Value = storedValue;
+  this->Staged.push_back(entry);
   return true;
 }
 
 //-------------------------------------------------------------------------------
-void WeightMap::Get(const Voxel& v, WeightVector& values) const
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Insert(StagedEntries& entries)
 {
-  values.Fill(0);
-  size_t j = this->LUTIndex->GetPixel(v);
-  assert(j<Cols);
+  if(this->Staged.empty())
+    {
+    this->Staged.swap(entries);
+    }
+  else
+    {
+    this->Staged.insert(this->Staged.end(), entries.begin(), entries.end());
+    }
+  StagedEntries().swap(entries);
+}
 
-  const size_t rows = this->RowSize[j];
-  for(size_t i=0; i<rows; ++i)
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Finalize()
+{
+  if(this->Staged.empty())
     {
-    const WeightEntry& entry = this->LUT[i][j];
-    values[entry.Index] = entry.Value;
+    return;
+    }
+  const size_t numRows = this->Voxels.GetNumberOfVoxels();
 
+  //count the entries of each row, the packed ones and the staged ones
+  std::vector<RowOffset> offsets(numRows+1, 0);
+  for(size_t j=0; j<numRows; ++j)
+    {
+    offsets[j+1] = this->Offsets[j+1]-this->Offsets[j];
+    }
+  for(size_t k=0; k<this->Staged.size(); ++k)
+    {
+    ++offsets[this->Staged[k].Row+1];
     }
+  for(size_t j=0; j<numRows; ++j)
+    {
+    offsets[j+1]+= offsets[j];
+    }
+
+  std::vector<SiteIndex> indices(offsets[numRows]);
+  std::vector<ValueType> values(offsets[numRows]);
+  std::vector<RowOffset> end(offsets.begin(), offsets.end()-1);
+  for(size_t j=0; j<numRows; ++j)
+    {
+    for(size_t k=this->Offsets[j]; k<this->Offsets[j+1]; ++k)
+      {
+      indices[end[j]] = this->Indices[k];
+      values[end[j]] = this->Values[k];
+      ++end[j];
+      }
+    }
+  for(size_t k=0; k<this->Staged.size(); ++k)
+    {
+    const StagedEntry& entry = this->Staged[k];
+    indices[end[entry.Row]] = entry.Index;
+    values[end[entry.Row]] = entry.Value;
+    ++end[entry.Row];
+    }
+
+  //keep each row sorted by site index, the rows are short
+  for(size_t j=0; j<numRows; ++j)
+    {
+    for(size_t k=offsets[j]+1; k<offsets[j+1]; ++k)
+      {
+      for(size_t l=k; l>offsets[j] && indices[l-1]>indices[l]; --l)
+        {
+        std::swap(indices[l-1],indices[l]);
+        std::swap(values[l-1],values[l]);
+        }
+      }
+    }
+
+  this->Offsets.Swap(offsets);
+  this->Indices.Swap(indices);
+  this->Values.Swap(values);
+  StagedEntries().swap(this->Staged);
 }
 
 //-------------------------------------------------------------------------------
-void WeightMap::AddRow()
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Get(const Voxel& v, WeightVector& values) const
 {
-  this->LUT.push_back(WeightEntries(this->Cols));
+  assert(this->Staged.empty());
+  values.Fill(0);
+  size_t j = this->Voxels.Find(v);
+  if(j==VoxelIndex::NoVoxel)
+    {
+    return;
+    }
+  for(size_t k=this->Offsets[j]; k<this->Offsets[j+1]; ++k)
+    {
+    values[this->Indices[k]] = this->Values[k];
+    }
 }
 
 //-------------------------------------------------------------------------------
-void WeightMap::Print() const
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Get(const Voxel& v, SparseWeightVector& values) const
 {
-  int numEntries = std::accumulate(this->RowSize.begin(), this->RowSize.end(),0);
-  std::cout<<"Weight map "<<this->LUT.size()<<"x"<<Cols<<" has "<<numEntries<<" entries"<<std::endl;
+  assert(this->Staged.empty());
+  values.Clear();
+  size_t j = this->Voxels.Find(v);
+  if(j==VoxelIndex::NoVoxel)
+    {
+    return;
+    }
+  values.Reserve(this->Offsets[j+1]-this->Offsets[j]);
+  for(size_t k=this->Offsets[j]; k<this->Offsets[j+1]; ++k)
+    {
+    values.Append(this->Indices[k], this->Values[k]);
+    }
 }
-};
 
+//-------------------------------------------------------------------------------
+template<class TSiteIndex, class TValue>
+void WeightMap<TSiteIndex, TValue>::Print() const
+{
+  size_t maxRowSize(0);
+  for(size_t j=0; j+1<this->Offsets.size(); ++j)
+    {
+    maxRowSize = std::max(maxRowSize, this->GetRowSize(j));
+    }
+  std::cout<<"Weight map of "<<this->Voxels.GetNumberOfVoxels()<<" voxels ("
+           <<sizeof(SiteIndex)<<" byte indices, "<<WeightValueTraits<ValueType>::GetName()<<" values) has "
+           <<this->Indices.size()+this->Staged.size()<<" entries";
+  if(!this->Staged.empty())
+    {
+    std::cout<<" ("<<this->Staged.size()<<" staged)";
+    }
+  std::cout<<", at most "<<maxRowSize<<" per packed voxel"<<std::endl;
+}
 
+//-------------------------------------------------------------------------------
+template class WeightMap<unsigned char, float>;
+template class WeightMap<unsigned char, HalfFloat>;
+template class WeightMap<unsigned char, Fixed16>;
+template class WeightMap<unsigned short, float>;
+template class WeightMap<unsigned short, HalfFloat>;
+template class WeightMap<unsigned short, Fixed16>;
+};
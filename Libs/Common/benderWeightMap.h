@@ -27,14 +27,21 @@
 // with a dense representation, e.g. storing a set of weight images., this is
 // sparse in two ways:
 // -  Not all voxel weights are stored, only a set of chosen voxels.
-// -  Define the "support" of a voxel by the number of non-zero weights at the voxel.
-//    Then, for each voxel, the storage we spend is at most the max support over the volume.
+// -  Only the non-zero weights of a voxel are stored.
+//
+// The weights are stored in a compressed sparse row layout: the voxels are
+// sorted by their linear offset in the region, and the non-zero weights of
+// the j-th voxel are Indices[k] and Values[k] for k in [Offsets[j], Offsets[j+1]).
+// Insert() only stages the weights, Finalize() packs them into the rows.
 
 // Bender includes
 #include "BenderCommonExport.h"
+#include "benderWeightValue.h"
 
 // ITK includes
 #include <itkImage.h>
+#include <itkIntTypes.h>
+#include <itkLightObject.h>
 #include <itkVariableLengthVector.h>
 
 // STD includes
@@ -43,44 +50,349 @@
 
 namespace bender
 {
-class BENDER_COMMON_EXPORT WeightMap
+// .NAME PackedArray - read-only array owned or borrowed
+// .SECTION General Description
+// PackedArray either owns its elements or points to elements owned by
+// another object, e.g. a memory mapped file, which it keeps alive.
+template<class T>
+class PackedArray
 {
  public:
-  typedef unsigned char SiteIndex;
-  struct WeightEntry
+  PackedArray(): Data(0), Size(0)
   {
-    SiteIndex Index;
-    float Value;
+  }
+  PackedArray(const PackedArray& other): Data(0), Size(0)
+  {
+    *this = other;
+  }
+  PackedArray& operator=(const PackedArray& other)
+  {
+    this->Storage = other.Storage;
+    this->Owner = other.Owner;
+    this->Size = other.Size;
+    this->Data = other.Owner ? other.Data : this->GetStorageData();
+    return *this;
+  }
 
-  WeightEntry(): Index(std::numeric_limits<std::size_t>::max()), Value(0){}
-  };
+  // Take the elements of a vector, which is left empty
+  void Swap(std::vector<T>& elements)
+  {
+    this->Storage.swap(elements);
+    this->Owner = 0;
+    this->Size = this->Storage.size();
+    this->Data = this->GetStorageData();
+  }
+  // Use elements owned by another object
+  void Borrow(const T* data, size_t size, const itk::LightObject* owner)
+  {
+    std::vector<T>().swap(this->Storage);
+    this->Owner = owner;
+    this->Size = size;
+    this->Data = data;
+  }
+
+  size_t size() const
+  {
+    return this->Size;
+  }
+  bool empty() const
+  {
+    return this->Size==0;
+  }
+  const T* begin() const
+  {
+    return this->Data;
+  }
+  const T* end() const
+  {
+    return this->Data+this->Size;
+  }
+  const T& operator[](size_t i) const
+  {
+    return this->Data[i];
+  }
+
+ private:
+  const T* GetStorageData() const
+  {
+    return this->Storage.empty() ? 0 : &this->Storage[0];
+  }
+
+  std::vector<T> Storage;
+  itk::LightObject::ConstPointer Owner;
+  const T* Data;
+  size_t Size;
+};
+
+// .NAME VoxelIndex - sorted set of voxels of a region
+// .SECTION General Description
+// VoxelIndex numbers a set of voxels of a region by sorting their keys.
+// It replaces a full-volume index image by a few bytes per indexed voxel,
+// a voxel is found by binary search. The key of a voxel is either its
+// linear offset in the region, or its Morton code, which interleaves the
+// bits of its coordinates: voxels close in space then get close numbers,
+// e.g. the 8 corners of a cell.
+class BENDER_COMMON_EXPORT VoxelIndex
+{
+ public:
+  typedef itk::Index<3> Voxel;
+  typedef itk::ImageRegion<3> Region;
+  typedef itk::uint64_t VoxelKey;
+  typedef PackedArray<VoxelKey> VoxelKeys; //sorted
+
+  enum Ordering
+    {
+    LinearOrder = 0,
+    MortonOrder = 1
+    };
+
+  static const size_t NoVoxel;
+
+  VoxelIndex();
+  void Init(const std::vector<Voxel>& voxels, const Region& region,
+            Ordering order = MortonOrder);
+  size_t Find(const Voxel& v) const; //NoVoxel if v is not indexed
+  size_t GetNumberOfVoxels() const
+  {
+    return this->Keys.size();
+  }
+  Voxel GetVoxel(size_t j) const;
+  const Region& GetRegion() const
+  {
+    return this->Domain;
+  }
+
+  // Sorted keys of the voxels, e.g. to save or load them
+  const VoxelKeys& GetKeys() const
+  {
+    return this->Keys;
+  }
+  void SetKeys(const Region& region, const VoxelKeys& keys, Ordering order);
+  Ordering GetOrdering() const
+  {
+    return this->Order;
+  }
+
+  // Key of a voxel of the region, the indexed voxels are sorted by key
+  VoxelKey ComputeKey(const Voxel& v) const;
+
+ private:
+  Region Domain;
+  Ordering Order;
+  VoxelKeys Keys;
+};
+
+// .NAME SparseWeightVector - non-zero weights of a point
+// .SECTION General Description
+// SparseWeightVector holds (site index, value) pairs sorted by site index.
+// Its storage only grows, so a vector reused between queries stops
+// allocating once it has reached the largest number of weights.
+class SparseWeightVector
+{
+ public:
+  typedef unsigned short SiteIndex;
+
+  SparseWeightVector(): NumberOfEntries(0)
+  {
+  }
+  void Clear()
+  {
+    this->NumberOfEntries = 0;
+  }
+  void Reserve(size_t n)
+  {
+    if(n>this->Indices.size())
+      {
+      this->Indices.resize(n);
+      this->Values.resize(n);
+      }
+  }
+  // Append a weight, the site indices must be appended in increasing order
+  void Append(SiteIndex index, float value)
+  {
+    this->Reserve(this->NumberOfEntries+1);
+    this->Indices[this->NumberOfEntries] = index;
+    this->Values[this->NumberOfEntries] = value;
+    ++this->NumberOfEntries;
+  }
+  size_t GetSize() const
+  {
+    return this->NumberOfEntries;
+  }
+  SiteIndex GetIndex(size_t k) const
+  {
+    return this->Indices[k];
+  }
+  float GetValue(size_t k) const
+  {
+    return this->Values[k];
+  }
+  float& GetValue(size_t k)
+  {
+    return this->Values[k];
+  }
 
+ private:
+  std::vector<SiteIndex> Indices;
+  std::vector<float> Values;
+  size_t NumberOfEntries;
+};
+
+// The weight map is a template over the type of the site indices, e.g.
+// unsigned char up to 256 sites and unsigned short up to 65536, and over
+// the type of the stored values: float, HalfFloat or Fixed16. It is
+// instantiated in BenderCommon for these types only.
+template<class TSiteIndex, class TValue = float>
+class BENDER_COMMON_EXPORT WeightMap
+{
+ public:
+  typedef TSiteIndex SiteIndex;
+  typedef TValue ValueType;
   typedef itk::Index<3> Voxel;
-  typedef std::vector<SiteIndex> RowSizes;
-  typedef std::vector<WeightEntry> WeightEntries;
   typedef itk::ImageRegion<3> Region;
   typedef itk::VariableLengthVector<float> WeightVector;
 
-  typedef std::vector<WeightEntries> WeightLUT; //for any j, WeightTable[...][j] correspond to
-  //the weights at a vixel
+  typedef itk::uint64_t RowOffset;
+  typedef PackedArray<RowOffset> RowOffsets; //start of the row of each voxel, plus the end
+  typedef PackedArray<SiteIndex> SiteIndices;
+  typedef PackedArray<ValueType> WeightValues;
 
-  typedef itk::Image<size_t,3> WeightLUTIndex; //for each voxel v, WeightLUTIndex[v] index into the
-  //the "column" of WeightLUT
+  // Weight to insert at the j-th voxel of the map
+  struct StagedEntry
+  {
+    size_t Row;
+    SiteIndex Index;
+    ValueType Value;
+  };
+  typedef std::vector<StagedEntry> StagedEntries;
 
+  // Largest number of sites the site indices can address
+  static size_t GetMaximumNumberOfSites()
+  {
+    return static_cast<size_t>(std::numeric_limits<SiteIndex>::max())+1;
+  }
 
   WeightMap();
-  void Init(const std::vector<Voxel>& voxels, const Region& region);
+  void Init(const std::vector<Voxel>& voxels, const Region& region,
+            VoxelIndex::Ordering order = VoxelIndex::MortonOrder);
+  // Stage a weight, the weights that are 0 once stored are skipped
   bool Insert(const Voxel& v, SiteIndex index, float value);
+  // Insert weights staged elsewhere, e.g. by another thread. entries is
+  // left empty.
+  void Insert(StagedEntries& entries);
+  void Finalize();
   void Get(const Voxel& v, WeightVector& values) const;
-  void AddRow();
+  void Get(const Voxel& v, SparseWeightVector& values) const;
   void Print() const;
 
+  // Voxels of the map, sorted and without duplicates
+  const VoxelIndex& GetVoxels() const
+  {
+    return this->Voxels;
+  }
+  size_t GetNumberOfVoxels() const
+  {
+    return this->Voxels.GetNumberOfVoxels();
+  }
+  Voxel GetVoxel(size_t j) const
+  {
+    return this->Voxels.GetVoxel(j);
+  }
+
+  // Packed weights of the j-th voxel, sorted by site index
+  size_t GetRowSize(size_t j) const
+  {
+    return this->Offsets[j+1]-this->Offsets[j];
+  }
+  const SiteIndex* GetRowIndices(size_t j) const
+  {
+    return this->Indices.begin() + this->Offsets[j];
+  }
+  const ValueType* GetRowValues(size_t j) const
+  {
+    return this->Values.begin() + this->Offsets[j];
+  }
+
+  // Packed arrays, e.g. to save or load them
+  const RowOffsets& GetRowOffsets() const
+  {
+    return this->Offsets;
+  }
+  const SiteIndices& GetIndices() const
+  {
+    return this->Indices;
+  }
+  const WeightValues& GetValues() const
+  {
+    return this->Values;
+  }
+  void SetPacked(const VoxelIndex& voxels, const RowOffsets& offsets,
+                 const SiteIndices& indices, const WeightValues& values);
+
  private:
-  WeightLUT LUT;
-  WeightLUTIndex::Pointer LUTIndex;
-  RowSizes RowSize;
-  size_t Cols;
+  VoxelIndex Voxels;
+  RowOffsets Offsets;
+  SiteIndices Indices;
+  WeightValues Values;
+  StagedEntries Staged;
 };
+
+// Size of the smallest site indices that address numSites sites, 0 if
+// there are too many sites
+inline size_t GetSiteIndexSize(size_t numSites)
+{
+  if(numSites<=WeightMap<unsigned char>::GetMaximumNumberOfSites())
+    {
+    return sizeof(unsigned char);
+    }
+  if(numSites<=WeightMap<unsigned short>::GetMaximumNumberOfSites())
+    {
+    return sizeof(unsigned short);
+    }
+  return 0;
+}
+
+// Call functor(weightMap) with an empty weight map of one of the
+// instantiated types, chosen at run time by the size of its site indices
+// and the type of its values. Return false if there is no such map,
+// otherwise what the functor returns.
+template<class TSiteIndex, class TFunctor>
+bool DispatchWeightMap(WeightValueType valueType, TFunctor& functor)
+{
+  switch(valueType)
+    {
+    case FloatWeight:
+      {
+      WeightMap<TSiteIndex, float> weightMap;
+      return functor(weightMap);
+      }
+    case HalfWeight:
+      {
+      WeightMap<TSiteIndex, HalfFloat> weightMap;
+      return functor(weightMap);
+      }
+    case Fixed16Weight:
+      {
+      WeightMap<TSiteIndex, Fixed16> weightMap;
+      return functor(weightMap);
+      }
+    }
+  return false;
+}
+
+template<class TFunctor>
+bool DispatchWeightMap(size_t siteIndexSize, WeightValueType valueType, TFunctor& functor)
+{
+  if(siteIndexSize==sizeof(unsigned char))
+    {
+    return DispatchWeightMap<unsigned char>(valueType, functor);
+    }
+  if(siteIndexSize==sizeof(unsigned short))
+    {
+    return DispatchWeightMap<unsigned short>(valueType, functor);
+    }
+  return false;
+}
 };
 
 #endif
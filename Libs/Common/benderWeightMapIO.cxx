@@ -20,17 +20,460 @@
 
 // Bender includes
 #include "benderWeightMapIO.h"
+#include "benderWeightMapMath.h"
 
 // ITK includes
+#include <itkContinuousIndex.h>
 #include <itkImageRegion.h>
 #include <itkImageFileReader.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
 #include <itkDirectory.h>
+#include <itkIntTypes.h>
+#include <itkMultiThreader.h>
+#include <itkMutexLock.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace bender;
 
 typedef itk::ImageRegion<3> Region;
 typedef itk::Image<float, 3>  WeightImage;
 
+namespace
+{
+//-------------------------------------------------------------------------------
+// Header of a weight map file, followed by the arrays at the given offsets
+struct WeightMapFileHeader
+{
+  char Magic[8];
+  itk::uint32_t Version;
+  itk::uint32_t ByteOrder; //ByteOrderMark as written by the saving machine
+  itk::uint32_t SiteIndexSize; //sizeof(WeightMap::SiteIndex)
+  itk::uint32_t NumberOfSites;
+  itk::int64_t Index[3];
+  itk::uint64_t Size[3];
+  double Origin[3];
+  double Spacing[3];
+  double Direction[9];
+  itk::uint64_t NumberOfVoxels;
+  itk::uint64_t NumberOfEntries;
+  itk::uint64_t KeysOffset; //NumberOfVoxels VoxelIndex::VoxelKey
+  itk::uint64_t RowOffsetsOffset; //NumberOfVoxels+1 WeightMap::RowOffset
+  itk::uint64_t ValuesOffset; //NumberOfEntries WeightMap::ValueType
+  itk::uint64_t IndicesOffset; //NumberOfEntries WeightMap::SiteIndex
+  itk::uint32_t VoxelOrder; //VoxelIndex::Ordering of the keys
+  itk::uint32_t ValueType; //WeightValueType of the values
+  itk::uint64_t DomainOffset; //DomainMask::GetNumberOfWords(region) DomainMask::Word
+};
+
+//-------------------------------------------------------------------------------
+// Header of a skin binding file, followed by the arrays at the given offsets
+struct SkinBindingFileHeader
+{
+  char Magic[8];
+  itk::uint32_t Version;
+  itk::uint32_t ByteOrder; //ByteOrderMark as written by the saving machine
+  itk::uint32_t SiteIndexSize; //sizeof(SparseWeightVector::SiteIndex)
+  itk::uint32_t NumberOfSites;
+  itk::uint64_t NumberOfVertices;
+  itk::uint64_t NumberOfEntries;
+  itk::uint64_t OffsetsOffset; //NumberOfVertices+1 itk::uint32_t
+  itk::uint64_t IndicesOffset; //NumberOfEntries SparseWeightVector::SiteIndex
+  itk::uint64_t ValuesOffset; //NumberOfEntries float
+  itk::uint64_t ValidOffset; //NumberOfVertices unsigned char
+};
+
+const char WeightMapMagic[8] = {'B','N','D','R','W','M','A','P'};
+const char SkinBindingMagic[8] = {'B','N','D','R','S','K','I','N'};
+const itk::uint32_t SkinBindingVersion = 1;
+const itk::uint32_t WeightMapVersion = 1;
+const itk::uint32_t ByteOrderMark = 0x01020304;
+const itk::uint64_t WeightMapAlignment = 8;
+
+//-------------------------------------------------------------------------------
+itk::uint64_t Align(itk::uint64_t offset)
+{
+  return (offset+WeightMapAlignment-1)/WeightMapAlignment*WeightMapAlignment;
+}
+
+//-------------------------------------------------------------------------------
+template<class T>
+void WriteArray(std::ofstream& out, const PackedArray<T>& array, itk::uint64_t offset)
+{
+  static const char padding[WeightMapAlignment] = {0};
+  itk::uint64_t pos = static_cast<itk::uint64_t>(out.tellp());
+  out.write(padding, offset-pos);
+  if(!array.empty())
+    {
+    out.write(reinterpret_cast<const char*>(array.begin()), array.size()*sizeof(T));
+    }
+}
+
+//-------------------------------------------------------------------------------
+template<class T>
+void WriteArray(std::ofstream& out, const std::vector<T>& array, itk::uint64_t offset)
+{
+  static const char padding[WeightMapAlignment] = {0};
+  itk::uint64_t pos = static_cast<itk::uint64_t>(out.tellp());
+  out.write(padding, offset-pos);
+  if(!array.empty())
+    {
+    out.write(reinterpret_cast<const char*>(&array[0]), array.size()*sizeof(T));
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Read an array of a file of fileSize bytes, if it fits in the file
+template<class T>
+bool ReadArray(std::ifstream& in, itk::uint64_t fileSize, itk::uint64_t offset, itk::uint64_t size,
+               std::vector<T>& array)
+{
+  if(offset>fileSize || size>(fileSize-offset)/sizeof(T))
+    {
+    return false;
+    }
+  array.resize(size);
+  in.seekg(offset);
+  if(size>0)
+    {
+    in.read(reinterpret_cast<char*>(&array[0]), size*sizeof(T));
+    }
+  return !in.fail();
+}
+
+//-------------------------------------------------------------------------------
+// Region of a weight image in the index space of geometry, if it has the
+// spacing and the direction of geometry and its voxels are voxels of
+// geometry. A cropped weight image of ArmatureWeight starts at index 0, its
+// origin gives where it is.
+bool GetPlacedRegion(const WeightImage* geometry, const WeightImage* image, Region& placed)
+{
+  const double tolerance = 1e-3;
+  for(int i=0; i<3; ++i)
+    {
+    if(std::fabs(image->GetSpacing()[i]-geometry->GetSpacing()[i])>tolerance*geometry->GetSpacing()[i])
+      {
+      return false;
+      }
+    for(int j=0; j<3; ++j)
+      {
+      if(std::fabs(image->GetDirection()[i][j]-geometry->GetDirection()[i][j])>tolerance)
+        {
+        return false;
+        }
+      }
+    }
+  itk::ContinuousIndex<double,3> origin;
+  geometry->TransformPhysicalPointToContinuousIndex(image->GetOrigin(), origin);
+  Region::IndexType start = image->GetLargestPossibleRegion().GetIndex();
+  for(int i=0; i<3; ++i)
+    {
+    const double rounded = std::floor(origin[i]+0.5);
+    if(std::fabs(origin[i]-rounded)>tolerance)
+      {
+      return false;
+      }
+    start[i]+= static_cast<itk::IndexValueType>(rounded);
+    }
+  placed = Region(start, image->GetLargestPossibleRegion().GetSize());
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+// Smallest region that contains a and b
+Region GetBoundingRegion(const Region& a, const Region& b)
+{
+  Region::IndexType start;
+  Region::SizeType size;
+  for(int i=0; i<3; ++i)
+    {
+    start[i] = std::min(a.GetIndex()[i], b.GetIndex()[i]);
+    const itk::IndexValueType end = std::max(a.GetIndex()[i]+static_cast<itk::IndexValueType>(a.GetSize()[i]),
+                                             b.GetIndex()[i]+static_cast<itk::IndexValueType>(b.GetSize()[i]));
+    size[i] = end-start[i];
+    }
+  return Region(start, size);
+}
+
+//-------------------------------------------------------------------------------
+// Read weight files in parallel: each thread takes the next file, reads the
+// part of it over the bounding box of the map voxels and stages the weights
+// of its site. A file placed over a part of the geometry gives no weight to
+// the map voxels outside of it.
+template<class TWeightMap>
+class ReadWeightsTask
+{
+public:
+  typedef TWeightMap WeightMapType;
+
+  ReadWeightsTask(const std::vector<std::string>& fnames, WeightMapType& weightMap, const WeightImage* geometry)
+    :FileNames(fnames), Map(weightMap), Geometry(geometry), NextFile(0), NumberOfInserted(0), NumberOfFailures(0)
+  {
+    const VoxelIndex& voxels = weightMap.GetVoxels();
+    Region::IndexType lower = geometry->GetLargestPossibleRegion().GetIndex();
+    Region::IndexType upper = lower;
+    for(size_t j=0; j<voxels.GetNumberOfVoxels(); ++j)
+      {
+      VoxelIndex::Voxel v = voxels.GetVoxel(j);
+      for(int d=0; d<3; ++d)
+        {
+        lower[d] = j==0 ? v[d] : std::min(lower[d], v[d]);
+        upper[d] = j==0 ? v[d] : std::max(upper[d], v[d]);
+        }
+      }
+    Region::SizeType size;
+    for(int d=0; d<3; ++d)
+      {
+      size[d] = voxels.GetNumberOfVoxels()>0 ? upper[d]-lower[d]+1 : 0;
+      }
+    this->BoundingBox = Region(lower, size);
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreadedRun(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    static_cast<ReadWeightsTask*>(info->UserData)->Run();
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void Run()
+  {
+    typedef itk::ImageFileReader<WeightImage>  ReaderType;
+    const VoxelIndex& voxels = this->Map.GetVoxels();
+    typename WeightMapType::StagedEntries entries;
+    size_t i;
+    while(this->PopFile(i))
+      {
+      ReaderType::Pointer reader = ReaderType::New();
+      reader->SetFileName(this->FileNames[i].c_str());
+      reader->UpdateOutputInformation();
+      Region placed;
+      if(!GetPlacedRegion(this->Geometry, reader->GetOutput(), placed))
+        {
+        this->Lock.Lock();
+        std::cerr << "ERROR: " << this->FileNames[i] << " is not on the voxels of the weights" << std::endl;
+        ++this->NumberOfFailures;
+        this->Lock.Unlock();
+        continue;
+        }
+
+      //only read the part of the file over the map voxels
+      Region overlap = this->BoundingBox;
+      if(voxels.GetNumberOfVoxels()>0 && overlap.Crop(placed))
+        {
+        itk::Offset<3> shift = placed.GetIndex()-reader->GetOutput()->GetLargestPossibleRegion().GetIndex();
+        reader->GetOutput()->SetRequestedRegion(Region(overlap.GetIndex()-shift, overlap.GetSize()));
+        reader->Update();
+        WeightImage::Pointer weight_i = reader->GetOutput();
+
+        typename WeightMapType::StagedEntry entry;
+        entry.Index = static_cast<typename WeightMapType::SiteIndex>(i);
+        for(size_t j=0; j<voxels.GetNumberOfVoxels(); ++j)
+          {
+          VoxelIndex::Voxel v = voxels.GetVoxel(j);
+          if(!overlap.IsInside(v))
+            {
+            continue;
+            }
+          entry.Row = j;
+          entry.Value = weight_i->GetPixel(v-shift);
+          if(static_cast<float>(entry.Value)>0)
+            {
+            entries.push_back(entry);
+            }
+          }
+        }
+
+      this->Lock.Lock();
+      std::cout << "Read " << this->FileNames[i] << std::endl;
+      this->NumberOfInserted+= entries.size();
+      this->Map.Insert(entries);
+      this->Lock.Unlock();
+      }
+  }
+
+  size_t GetNumberOfInserted() const
+  {
+    return this->NumberOfInserted;
+  }
+
+  size_t GetNumberOfFailures() const
+  {
+    return this->NumberOfFailures;
+  }
+
+private:
+  bool PopFile(size_t& i)
+  {
+    this->Lock.Lock();
+    bool hasFile = this->NextFile<this->FileNames.size();
+    if(hasFile)
+      {
+      i = this->NextFile++;
+      }
+    this->Lock.Unlock();
+    return hasFile;
+  }
+
+  const std::vector<std::string>& FileNames;
+  WeightMapType& Map;
+  const WeightImage* Geometry;
+  Region BoundingBox; //of the map voxels
+  size_t NextFile;
+  size_t NumberOfInserted;
+  size_t NumberOfFailures;
+  itk::SimpleMutexLock Lock;
+};
+
+//-------------------------------------------------------------------------------
+// Read-only memory mapping of a whole file, unmapped when released
+class MappedFile: public itk::LightObject
+{
+public:
+  typedef MappedFile Self;
+  typedef itk::SmartPointer<Self> Pointer;
+
+  static Pointer Open(const std::string& fname)
+  {
+    Pointer file = new MappedFile;
+    file->UnRegister();
+    if(!file->Map(fname))
+      {
+      return 0;
+      }
+    return file;
+  }
+  const char* GetData() const
+  {
+    return this->Data;
+  }
+  itk::uint64_t GetSize() const
+  {
+    return this->Size;
+  }
+
+protected:
+  MappedFile(): Data(0), Size(0)
+  {
+  }
+  ~MappedFile()
+  {
+    if(!this->Data)
+      {
+      return;
+      }
+#ifdef _WIN32
+    UnmapViewOfFile(this->Data);
+#else
+    munmap(const_cast<char*>(this->Data), this->Size);
+#endif
+  }
+
+private:
+  bool Map(const std::string& fname)
+  {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(file==INVALID_HANDLE_VALUE)
+      {
+      return false;
+      }
+    LARGE_INTEGER size;
+    HANDLE mapping = 0;
+    if(GetFileSizeEx(file, &size) && size.QuadPart>0)
+      {
+      mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+      }
+    if(mapping)
+      {
+      this->Data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+      this->Size = size.QuadPart;
+      CloseHandle(mapping);
+      }
+    CloseHandle(file);
+#else
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd<0)
+      {
+      return false;
+      }
+    struct stat st;
+    if(fstat(fd, &st)==0 && st.st_size>0)
+      {
+      void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(data!=MAP_FAILED)
+        {
+        this->Data = static_cast<const char*>(data);
+        this->Size = st.st_size;
+        }
+      }
+    close(fd);
+#endif
+    return this->Data!=0;
+  }
+
+  const char* Data;
+  itk::uint64_t Size;
+};
+
+//-------------------------------------------------------------------------------
+// Point a packed array to an array of the mapped file, if it fits in the file
+template<class T>
+bool BorrowArray(const MappedFile* file, itk::uint64_t offset, itk::uint64_t size, PackedArray<T>& array)
+{
+  if(offset%WeightMapAlignment!=0 || offset>file->GetSize()
+     || size>(file->GetSize()-offset)/sizeof(T))
+    {
+    return false;
+    }
+  array.Borrow(reinterpret_cast<const T*>(file->GetData()+offset), size, file);
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+// Copy and check the header at the start of a weight map file
+bool ReadHeader(const std::string& fname, const char* data, itk::uint64_t size, WeightMapFileHeader& header)
+{
+  memset(&header, 0, sizeof(header));
+  if(size<sizeof(header))
+    {
+    std::cerr << fname << " is not a weight map file" << std::endl;
+    return false;
+    }
+  memcpy(&header, data, sizeof(header));
+  if(memcmp(header.Magic, WeightMapMagic, sizeof(header.Magic))!=0)
+    {
+    std::cerr << fname << " is not a weight map file" << std::endl;
+    return false;
+    }
+  if(header.Version!=WeightMapVersion || header.ByteOrder!=ByteOrderMark
+     || header.VoxelOrder>VoxelIndex::MortonOrder)
+    {
+    std::cerr << fname << " has version " << header.Version
+              << " or a different byte order" << std::endl;
+    return false;
+    }
+  return true;
+}
+}
+
 namespace bender
 {
 //----------------------------------------------------------------------------
@@ -55,50 +498,458 @@ namespace bender
 }
 
 //-------------------------------------------------------------------------------
-//create a weight map from a series of files
-int ReadWeights(const std::vector<std::string>& fnames, const std::vector<WeightMap::Voxel>& bodyVoxels, WeightMap& weightMap)
+DomainMask::GeometryImage::Pointer ReadWeightGeometry(const std::vector<std::string>& fnames)
 {
-  typedef std::vector<WeightMap::Voxel> Voxels;
-  Region region;
-  int numSites = fnames.size();
+  if(fnames.empty())
+    {
+    return 0;
+    }
+  typedef itk::ImageFileReader<WeightImage>  ReaderType;
+  ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(fnames[0].c_str());
+  reader->UpdateOutputInformation();
+  WeightImage::Pointer geometry = WeightImage::New();
+  geometry->CopyInformation(reader->GetOutput());
+  Region region = reader->GetOutput()->GetLargestPossibleRegion();
+  geometry->SetRegions(region);
 
-  int numInserted(0);
-  for(size_t i=0; i<fnames.size(); ++i)
+  for(size_t i=1; i<fnames.size(); ++i)
     {
-    std::cout << "Read " << fnames[i] << std::endl;
+    reader = ReaderType::New();
+    reader->SetFileName(fnames[i].c_str());
+    reader->UpdateOutputInformation();
+    Region placed;
+    if(!GetPlacedRegion(geometry, reader->GetOutput(), placed))
+      {
+      std::cerr << fnames[i] << " is not on the voxels of " << fnames[0] << std::endl;
+      return 0;
+      }
+    region = GetBoundingRegion(region, placed);
+    }
 
-    typedef itk::ImageFileReader<WeightImage>  ReaderType;
+  //the region keeps the start index of the first file, the origin moves
+  //to the start of the region
+  Region::IndexType start = geometry->GetLargestPossibleRegion().GetIndex();
+  Region::IndexType originIndex;
+  for(int i=0; i<3; ++i)
+    {
+    originIndex[i] = region.GetIndex()[i]-start[i];
+    }
+  WeightImage::PointType origin;
+  geometry->TransformIndexToPhysicalPoint(originIndex, origin);
+  geometry->SetOrigin(origin);
+  geometry->SetRegions(Region(start, region.GetSize()));
+  return geometry;
+}
+
+//-------------------------------------------------------------------------------
+bool ReadWeightDomain(const std::vector<std::string>& fnames, const DomainMask::GeometryImage* geometry,
+                      DomainMask* domain)
+{
+  const Region& region = geometry->GetLargestPossibleRegion();
+  WeightImage::Pointer weight = WeightImage::New();
+  weight->CopyInformation(geometry);
+  weight->SetRegions(region);
+  weight->Allocate();
+  weight->FillBuffer(-1.0f);
+
+  typedef itk::ImageFileReader<WeightImage>  ReaderType;
+  for(size_t i=0; i<fnames.size(); ++i)
+    {
     ReaderType::Pointer reader = ReaderType::New();
     reader->SetFileName(fnames[i].c_str());
     reader->Update();
-    WeightImage::Pointer weight_i =  reader->GetOutput();
-
-    if(i==0)
+    WeightImage::Pointer weight_i = reader->GetOutput();
+    Region placed;
+    if(!GetPlacedRegion(geometry, weight_i, placed))
       {
-      region = weight_i->GetLargestPossibleRegion();
-      weightMap.Init(bodyVoxels,region);
+      std::cerr << fnames[i] << " is not on the voxels of the weights" << std::endl;
+      return false;
       }
+    itk::Offset<3> shift = placed.GetIndex()-weight_i->GetLargestPossibleRegion().GetIndex();
+    for(itk::ImageRegionConstIteratorWithIndex<WeightImage> it(weight_i, weight_i->GetLargestPossibleRegion());
+        !it.IsAtEnd(); ++it)
+      {
+      if(it.Get()>=0)
+        {
+        weight->SetPixel(it.GetIndex()+shift, 0.0f);
+        }
+      }
+    //a whole weight image has the whole domain
+    if(placed==region)
+      {
+      break;
+      }
+    }
+  domain->Init(weight, 0);
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+//create a weight map from a series of files
+template<class TWeightMap>
+int ReadWeights(const std::vector<std::string>& fnames, const std::vector<VoxelIndex::Voxel>& bodyVoxels,
+                TWeightMap& weightMap, int numThreads)
+{
+  int numSites = fnames.size();
+  if(numSites==0)
+    {
+    return 0;
+    }
+  if(fnames.size()>TWeightMap::GetMaximumNumberOfSites())
+    {
+    std::cerr << numSites << " sites do not fit in " << sizeof(typename TWeightMap::SiteIndex)
+              << " byte site indices" << std::endl;
+    return 0;
+    }
 
-    if(weight_i->GetLargestPossibleRegion()!=region)
+  //the files can each cover a part of the region of all the weights
+  WeightImage::Pointer geometry = ReadWeightGeometry(fnames);
+  if(!geometry)
+    {
+    return 0;
+    }
+  weightMap.Init(bodyVoxels,geometry->GetLargestPossibleRegion());
+
+  ReadWeightsTask<TWeightMap> task(fnames, weightMap, geometry);
+  if(numThreads<=0)
+    {
+    numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    }
+  numThreads = std::min(numThreads, numSites);
+  numThreads = std::min(numThreads,
+    static_cast<int>(itk::MultiThreader::GetGlobalMaximumNumberOfThreads()));
+  if(numThreads<=1)
+    {
+    task.Run();
+    }
+  else
+    {
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numThreads);
+    threader->SetSingleMethod(ReadWeightsTask<TWeightMap>::ThreadedRun, &task);
+    threader->SingleMethodExecute();
+    }
+
+  if(task.GetNumberOfFailures()>0)
+    {
+    return 0;
+    }
+  std::cout << task.GetNumberOfInserted() << " inserted to weight map" << std::endl;
+  weightMap.Finalize();
+  weightMap.Print();
+  return numSites;
+}
+
+//-------------------------------------------------------------------------------
+template<class TWeightMap>
+bool WriteWeightMap(const std::string& fname, const TWeightMap& weightMap,
+                    const DomainMask* domain, int numSites)
+{
+  typedef typename TWeightMap::SiteIndex SiteIndex;
+  typedef typename TWeightMap::ValueType ValueType;
+  const VoxelIndex& voxels = weightMap.GetVoxels();
+  const Region& region = voxels.GetRegion();
+  const WeightImage* geometry = domain->GetGeometry();
+  if(domain->GetLargestPossibleRegion()!=region)
+    {
+    std::cerr << "The domain does not match the region of the weight map" << std::endl;
+    return false;
+    }
+
+  WeightMapFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.Magic, WeightMapMagic, sizeof(header.Magic));
+  header.Version = WeightMapVersion;
+  header.ByteOrder = ByteOrderMark;
+  header.SiteIndexSize = sizeof(SiteIndex);
+  header.NumberOfSites = numSites;
+  for(int d=0; d<3; ++d)
+    {
+    header.Index[d] = region.GetIndex()[d];
+    header.Size[d] = region.GetSize()[d];
+    header.Origin[d] = geometry->GetOrigin()[d];
+    header.Spacing[d] = geometry->GetSpacing()[d];
+    for(int e=0; e<3; ++e)
       {
-      std::cerr << "WARNING: " << fnames[i] << " skipped" << std::endl;
+      header.Direction[3*d+e] = geometry->GetDirection()[d][e];
       }
-    else
+    }
+  header.NumberOfVoxels = voxels.GetNumberOfVoxels();
+  header.VoxelOrder = voxels.GetOrdering();
+  header.ValueType = WeightValueTraits<ValueType>::GetType();
+  header.NumberOfEntries = weightMap.GetValues().size();
+  header.KeysOffset = Align(sizeof(header));
+  header.RowOffsetsOffset = Align(header.KeysOffset + header.NumberOfVoxels*sizeof(VoxelIndex::VoxelKey));
+  header.ValuesOffset = Align(header.RowOffsetsOffset + (header.NumberOfVoxels+1)*sizeof(typename TWeightMap::RowOffset));
+  header.IndicesOffset = Align(header.ValuesOffset + header.NumberOfEntries*sizeof(ValueType));
+  header.DomainOffset = Align(header.IndicesOffset + header.NumberOfEntries*sizeof(SiteIndex));
+
+  std::ofstream out(fname.c_str(), std::ios::out | std::ios::binary);
+  if(!out)
+    {
+    std::cerr << "Cannot open " << fname << " for writing" << std::endl;
+    return false;
+    }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  WriteArray(out, voxels.GetKeys(), header.KeysOffset);
+  WriteArray(out, weightMap.GetRowOffsets(), header.RowOffsetsOffset);
+  WriteArray(out, weightMap.GetValues(), header.ValuesOffset);
+  WriteArray(out, weightMap.GetIndices(), header.IndicesOffset);
+  WriteArray(out, domain->GetWords(), header.DomainOffset);
+  out.close();
+  if(!out)
+    {
+    std::cerr << "Failed to write " << fname << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+bool ReadWeightMapInformation(const std::string& fname, WeightMapInformation& information)
+{
+  std::ifstream in(fname.c_str(), std::ios::in | std::ios::binary);
+  char data[sizeof(WeightMapFileHeader)];
+  in.read(data, sizeof(data));
+  WeightMapFileHeader header;
+  if(!ReadHeader(fname, data, in.gcount(), header))
+    {
+    return false;
+    }
+  information.NumberOfSites = header.NumberOfSites;
+  information.SiteIndexSize = header.SiteIndexSize;
+  information.ValueType = static_cast<WeightValueType>(header.ValueType);
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+template<class TWeightMap>
+int ReadWeightMap(const std::string& fname, TWeightMap& weightMap, DomainMask* domain)
+{
+  typedef typename TWeightMap::SiteIndex SiteIndex;
+  typedef typename TWeightMap::ValueType ValueType;
+  MappedFile::Pointer file = MappedFile::Open(fname);
+  if(!file)
+    {
+    std::cerr << "Cannot map " << fname << std::endl;
+    return 0;
+    }
+
+  WeightMapFileHeader header;
+  if(!ReadHeader(fname, file->GetData(), file->GetSize(), header))
+    {
+    return 0;
+    }
+  if(header.SiteIndexSize!=sizeof(SiteIndex)
+     || header.ValueType!=static_cast<itk::uint32_t>(WeightValueTraits<ValueType>::GetType()))
+    {
+    std::cerr << fname << " has " << header.SiteIndexSize << " byte site indices and "
+              << GetWeightValueName(static_cast<WeightValueType>(header.ValueType))
+              << " values, expected " << sizeof(SiteIndex) << " byte site indices and "
+              << WeightValueTraits<ValueType>::GetName() << " values" << std::endl;
+    return 0;
+    }
+
+  Region::IndexType index;
+  Region::SizeType size;
+  for(int d=0; d<3; ++d)
+    {
+    index[d] = header.Index[d];
+    size[d] = header.Size[d];
+    }
+  Region region(index, size);
+
+  VoxelIndex::VoxelKeys keys;
+  typename TWeightMap::RowOffsets offsets;
+  typename TWeightMap::WeightValues values;
+  typename TWeightMap::SiteIndices indices;
+  if(!BorrowArray(file.GetPointer(), header.KeysOffset, header.NumberOfVoxels, keys)
+     || !BorrowArray(file.GetPointer(), header.RowOffsetsOffset, header.NumberOfVoxels+1, offsets)
+     || !BorrowArray(file.GetPointer(), header.ValuesOffset, header.NumberOfEntries, values)
+     || !BorrowArray(file.GetPointer(), header.IndicesOffset, header.NumberOfEntries, indices)
+     || offsets[header.NumberOfVoxels]!=header.NumberOfEntries)
+    {
+    std::cerr << fname << " is truncated or corrupted" << std::endl;
+    return 0;
+    }
+  VoxelIndex voxels;
+  voxels.SetKeys(region, keys, static_cast<VoxelIndex::Ordering>(header.VoxelOrder));
+
+  //the map indexes its arrays with the offsets and the keys, the sites with
+  //the site indices
+  bool valid = offsets[0]==0;
+  for(itk::uint64_t j=0; j<header.NumberOfVoxels && valid; ++j)
+    {
+    VoxelIndex::Voxel v = voxels.GetVoxel(j);
+    valid = offsets[j]<=offsets[j+1] && (j==0 || keys[j-1]<keys[j])
+      && region.IsInside(v) && voxels.ComputeKey(v)==keys[j];
+    }
+  for(itk::uint64_t k=0; k<header.NumberOfEntries && valid; ++k)
+    {
+    valid = indices[k]<header.NumberOfSites;
+    }
+  if(!valid)
+    {
+    std::cerr << fname << " is truncated or corrupted" << std::endl;
+    return 0;
+    }
+  weightMap.SetPacked(voxels, offsets, indices, values);
+
+  if(domain)
+    {
+    WeightImage::Pointer geometry = WeightImage::New();
+    WeightImage::PointType origin;
+    WeightImage::SpacingType spacing;
+    WeightImage::DirectionType direction;
+    for(int d=0; d<3; ++d)
       {
-      for(Voxels::const_iterator v_iter = bodyVoxels.begin(); v_iter!=bodyVoxels.end(); ++v_iter)
+      origin[d] = header.Origin[d];
+      spacing[d] = header.Spacing[d];
+      for(int e=0; e<3; ++e)
         {
-        const WeightMap::Voxel& v(*v_iter);
-        WeightMap::SiteIndex index = static_cast<WeightMap::SiteIndex>(i);
-        float value = weight_i->GetPixel(v);
-        bool inserted = weightMap.Insert(v,index,value);
-        numInserted+= inserted;
+        direction[d][e] = header.Direction[3*d+e];
         }
-      std::cout << numInserted << " inserted to weight map" << std::endl;
-      weightMap.Print();
+      }
+    geometry->SetRegions(region);
+    geometry->SetOrigin(origin);
+    geometry->SetSpacing(spacing);
+    geometry->SetDirection(direction);
+
+    DomainMask::Words words;
+    if(!BorrowArray(file.GetPointer(), header.DomainOffset, DomainMask::GetNumberOfWords(region), words)
+       || !domain->SetWords(geometry, words))
+      {
+      std::cerr << fname << " is truncated or corrupted" << std::endl;
+      return 0;
       }
     }
-  return numSites;
+
+  std::cout << "Map " << fname << std::endl;
+  weightMap.Print();
+  return header.NumberOfSites;
 }
-};
 
+//-------------------------------------------------------------------------------
+bool WriteSkinBinding(const std::string& fname, const WeightBatch& weights, int numSites)
+{
+  typedef SparseWeightVector::SiteIndex SiteIndex;
+  const size_t numVertices = weights.Valid.size();
+  const size_t numEntries = weights.Offsets[numVertices];
+  if(numEntries>std::numeric_limits<itk::uint32_t>::max())
+    {
+    std::cerr << "Too many weights for a skin binding: " << numEntries << std::endl;
+    return false;
+    }
+
+  SkinBindingFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.Magic, SkinBindingMagic, sizeof(header.Magic));
+  header.Version = SkinBindingVersion;
+  header.ByteOrder = ByteOrderMark;
+  header.SiteIndexSize = sizeof(SiteIndex);
+  header.NumberOfSites = numSites;
+  header.NumberOfVertices = numVertices;
+  header.NumberOfEntries = numEntries;
+  header.OffsetsOffset = Align(sizeof(header));
+  header.IndicesOffset = Align(header.OffsetsOffset + (numVertices+1)*sizeof(itk::uint32_t));
+  header.ValuesOffset = Align(header.IndicesOffset + numEntries*sizeof(SiteIndex));
+  header.ValidOffset = Align(header.ValuesOffset + numEntries*sizeof(float));
+
+  std::vector<itk::uint32_t> offsets(weights.Offsets.begin(), weights.Offsets.end());
+  WeightBatch normalized(weights);
+  NormalizeWeights(normalized);
+
+  std::ofstream out(fname.c_str(), std::ios::out | std::ios::binary);
+  if(!out)
+    {
+    std::cerr << "Cannot open " << fname << " for writing" << std::endl;
+    return false;
+    }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  WriteArray(out, offsets, header.OffsetsOffset);
+  WriteArray(out, weights.Indices, header.IndicesOffset);
+  WriteArray(out, normalized.Values, header.ValuesOffset);
+  WriteArray(out, weights.Valid, header.ValidOffset);
+  out.close();
+  if(!out)
+    {
+    std::cerr << "Failed to write " << fname << std::endl;
+    return false;
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+int ReadSkinBinding(const std::string& fname, WeightBatch& weights)
+{
+  typedef SparseWeightVector::SiteIndex SiteIndex;
+  std::ifstream in(fname.c_str(), std::ios::in | std::ios::binary);
+  SkinBindingFileHeader header;
+  memset(&header, 0, sizeof(header));
+  in.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if(!in || memcmp(header.Magic, SkinBindingMagic, sizeof(header.Magic))!=0)
+    {
+    std::cerr << fname << " is not a skin binding file" << std::endl;
+    return 0;
+    }
+  if(header.Version!=SkinBindingVersion || header.ByteOrder!=ByteOrderMark
+     || header.SiteIndexSize!=sizeof(SiteIndex))
+    {
+    std::cerr << fname << " has version " << header.Version
+              << " or a different byte order" << std::endl;
+    return 0;
+    }
+
+  //the array sizes of the header are checked against the file size before
+  //the arrays are allocated
+  in.seekg(0, std::ios::end);
+  const itk::uint64_t fileSize = static_cast<itk::uint64_t>(in.tellg());
+  std::vector<itk::uint32_t> offsets;
+  if(header.NumberOfVertices>=fileSize
+     || !ReadArray(in, fileSize, header.OffsetsOffset, header.NumberOfVertices+1, offsets)
+     || !ReadArray(in, fileSize, header.IndicesOffset, header.NumberOfEntries, weights.Indices)
+     || !ReadArray(in, fileSize, header.ValuesOffset, header.NumberOfEntries, weights.Values)
+     || !ReadArray(in, fileSize, header.ValidOffset, header.NumberOfVertices, weights.Valid))
+    {
+    std::cerr << fname << " is truncated or corrupted" << std::endl;
+    return 0;
+    }
+  weights.Offsets.assign(offsets.begin(), offsets.end());
+
+  //the skinning indexes the bones with the offsets and the site indices
+  bool valid = weights.Offsets.front()==0 && weights.Offsets.back()==header.NumberOfEntries;
+  for(size_t i=0; i<header.NumberOfVertices && valid; ++i)
+    {
+    valid = weights.Offsets[i]<=weights.Offsets[i+1];
+    }
+  for(size_t k=0; k<header.NumberOfEntries && valid; ++k)
+    {
+    valid = weights.Indices[k]<header.NumberOfSites;
+    }
+  if(!valid)
+    {
+    std::cerr << fname << " is truncated or corrupted" << std::endl;
+    return 0;
+    }
+  std::cout << "Read the weights of " << header.NumberOfVertices << " vertices from "
+            << fname << std::endl;
+  return header.NumberOfSites;
+}
+
+//-------------------------------------------------------------------------------
+#define BENDER_INSTANTIATE_WEIGHT_MAP_IO(SiteIndex, ValueType) \
+  template int ReadWeights(const std::vector<std::string>&, \
+    const std::vector<VoxelIndex::Voxel>&, WeightMap<SiteIndex, ValueType>&, int); \
+  template bool WriteWeightMap(const std::string&, \
+    const WeightMap<SiteIndex, ValueType>&, const DomainMask*, int); \
+  template int ReadWeightMap(const std::string&, \
+    WeightMap<SiteIndex, ValueType>&, DomainMask*);
 
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned char, float)
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned char, HalfFloat)
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned char, Fixed16)
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned short, float)
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned short, HalfFloat)
+BENDER_INSTANTIATE_WEIGHT_MAP_IO(unsigned short, Fixed16)
+};
@@ -22,6 +22,7 @@
 #define __WeightMapIO_h
 
 // Bender includes
+#include "benderDomainMask.h"
 #include "benderWeightMap.h"
 
 // STD includes
@@ -30,11 +31,73 @@
 
 namespace bender
 {
+struct WeightBatch;
+
 // Get the weight files from a directory
 void BENDER_COMMON_EXPORT GetWeightFileNames(const std::string& dirName, std::vector<std::string>& fnames);
 
-// Create a weight map from a series of files
-int BENDER_COMMON_EXPORT ReadWeights(const std::vector<std::string>& fnames,  const std::vector<bender::WeightMap::Voxel>& bodyVoxels, bender::WeightMap& weightMap);
+// The functions below are instantiated in BenderCommon for the weight map
+// instantiations of benderWeightMap.cxx.
+
+// Geometry of the weights of a series of files, without pixels. The files
+// can each cover a part of its region, like the cropped weights of
+// ArmatureWeight: they are placed by their origin. The region starts at the
+// start index of the first file, which is the whole region if the weights
+// are not cropped. Return 0 if a file does not have the spacing, the
+// direction and the voxels of the first one.
+bender::DomainMask::GeometryImage::Pointer BENDER_COMMON_EXPORT ReadWeightGeometry(const std::vector<std::string>& fnames);
+
+// Set a domain to the voxels of geometry that have a weight (>=0) in a
+// series of files. The files are read until one covers the whole region,
+// i.e. only the first one if the weights are not cropped.
+bool BENDER_COMMON_EXPORT ReadWeightDomain(const std::vector<std::string>& fnames,
+                                           const bender::DomainMask::GeometryImage* geometry,
+                                           bender::DomainMask* domain);
+
+// Create a weight map from a series of files over the region of their
+// geometry (see ReadWeightGeometry). The files are read by numThreads
+// threads (0 for the ITK default), and only over the bounding box of the
+// body voxels; the voxels out of a cropped file have a zero weight for its
+// site. Return 0 if there are more files than the site indices of the map
+// can address or if the files do not share the voxels of a geometry.
+template<class TWeightMap>
+int BENDER_COMMON_EXPORT ReadWeights(const std::vector<std::string>& fnames,  const std::vector<bender::VoxelIndex::Voxel>& bodyVoxels, TWeightMap& weightMap, int numThreads = 0);
+
+// Save a weight map to a single binary file, with the number of sites, the
+// geometry (region, origin, spacing and direction) of the weight images and
+// their domain. The file holds a versioned header followed by the packed
+// arrays of the map and the bits of the domain.
+template<class TWeightMap>
+bool BENDER_COMMON_EXPORT WriteWeightMap(const std::string& fname, const TWeightMap& weightMap,
+                                         const bender::DomainMask* domain, int numSites);
+
+// Load a weight map saved by WriteWeightMap. The file is memory mapped and
+// the map and the domain use its arrays in place. The domain, if given, is
+// set with the geometry and the domain of the weight images. Return the
+// number of sites, 0 if the file could not be read or if its site indices
+// and values are not the ones of the map.
+template<class TWeightMap>
+int BENDER_COMMON_EXPORT ReadWeightMap(const std::string& fname, TWeightMap& weightMap,
+                                       bender::DomainMask* domain = 0);
+
+// What a weight map file holds, to choose the map to load it into
+struct WeightMapInformation
+{
+  int NumberOfSites;
+  int SiteIndexSize; //in bytes
+  bender::WeightValueType ValueType;
+};
+bool BENDER_COMMON_EXPORT ReadWeightMapInformation(const std::string& fname, WeightMapInformation& information);
+
+// Save the weights of the vertices of a mesh to a binary skin binding
+// file, the weights of each vertex are normalized to sum to one. The file
+// holds a versioned header followed by the arrays of the batch.
+bool BENDER_COMMON_EXPORT WriteSkinBinding(const std::string& fname, const bender::WeightBatch& weights,
+                                           int numSites);
+
+// Load a skin binding saved by WriteSkinBinding. Return the number of
+// sites, 0 if the file could not be read.
+int BENDER_COMMON_EXPORT ReadSkinBinding(const std::string& fname, bender::WeightBatch& weights);
 };
 
 #endif
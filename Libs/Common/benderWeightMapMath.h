@@ -22,21 +22,57 @@
 #define __WeightMapMath_h
 
 // Bender includes
+#include "benderDomainMask.h"
 #include "benderWeightMap.h"
+#include "benderFixedWeightMap.h"
+
+// ITK includes
+#include <itkContinuousIndex.h>
+#include <itkMultiThreader.h>
+
+// STD includes
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <vector>
 
 namespace bender
 {
+  // Whether a voxel is in the domain of the weights: the pixel of a mask
+  // image is at least the foreground minimum
   template<class MaskImageType>
-  inline bool Lerp(const bender::WeightMap& weightMap, //weight input
+  struct DomainTest
+  {
+    static bool IsInside(const MaskImageType* mask,
+                         const typename MaskImageType::PixelType& foreground_minimum,
+                         const typename MaskImageType::IndexType& q)
+    {
+      return mask->GetPixel(q)>=foreground_minimum;
+    }
+  };
+
+  // A domain mask answers with a single bit, the foreground is ignored
+  template<>
+  struct DomainTest<bender::DomainMask>
+  {
+    static bool IsInside(const bender::DomainMask* mask, bool,
+                         const bender::DomainMask::IndexType& q)
+    {
+      return mask->GetPixel(q);
+    }
+  };
+
+  template<class MaskImageType, class TSiteIndex, class TValue>
+  inline bool Lerp(const bender::WeightMap<TSiteIndex, TValue>& weightMap, //weight input
                    const itk::ContinuousIndex<double,3>& coord, //the point to evaluate at
                    const typename MaskImageType::Pointer& mask, //mask that defines the function domain, only the voxels in domain will be used
                    const typename MaskImageType::PixelType& foreground_minimum, //pixels > this value will be considered in the domain
-                   bender::WeightMap::WeightVector& w_pi) //output, assumed to be initialized to the vector dimension of the weight map
+                   itk::VariableLengthVector<float>& w_pi) //output, assumed to be initialized to the vector dimension of the weight map
   {
-    typedef bender::WeightMap WeightMap;
-    typedef WeightMap::Voxel Voxel;
+    typedef bender::VoxelIndex::Voxel Voxel;
     w_pi.Fill(0);
-    WeightMap::WeightVector w_corner=w_pi;
+    itk::VariableLengthVector<float> w_corner=w_pi;
     w_corner.Fill(0);
 
     Voxel m; //min index of the cell containing the point
@@ -60,7 +96,7 @@ namespace bender
         }
       assert(cornerW>=0);
       w_corner.Fill(0);
-      if(mask->GetPixel(q)>=foreground_minimum)
+      if(DomainTest<MaskImageType>::IsInside(mask, foreground_minimum, q))
         {
         cornerWSum+=cornerW;
         weightMap.Get(q, w_corner);
@@ -80,6 +116,521 @@ namespace bender
       return false;
       }
     }
+
+  // Same as above for a weight map with K influences per voxel: the
+  // influences of the corners are added directly to the output
+  template<class MaskImageType, unsigned int K, class TSiteIndex, class TValue>
+  inline bool Lerp(const bender::FixedWeightMap<K, TSiteIndex, TValue>& weightMap, //weight input
+                   const itk::ContinuousIndex<double,3>& coord, //the point to evaluate at
+                   const typename MaskImageType::Pointer& mask, //mask that defines the function domain, only the voxels in domain will be used
+                   const typename MaskImageType::PixelType& foreground_minimum, //pixels > this value will be considered in the domain
+                   itk::VariableLengthVector<float>& w_pi) //output, assumed to be initialized to the vector dimension of the weight map
+  {
+    typedef typename bender::FixedWeightMap<K, TSiteIndex, TValue>::WeightEntry WeightEntry;
+    typedef bender::VoxelIndex::Voxel Voxel;
+    w_pi.Fill(0);
+
+    Voxel m; //min index of the cell containing the point
+    m.CopyWithCast(coord);
+
+    double cornerWSum(0);
+    for(unsigned int corner=0; corner<8; ++corner)
+      {
+      unsigned int bit = corner;
+      double cornerW=1.0;
+      Voxel q;
+      for(int dim=0; dim<3; ++dim)
+        {
+        bool upper = bit & 1;
+        bit>>=1;
+        float t = coord[dim] - static_cast<float>(m[dim]);
+        cornerW*= upper? t : 1-t;
+        q[dim] = m[dim]+ static_cast<int>(upper);
+        }
+      assert(cornerW>=0);
+      if(DomainTest<MaskImageType>::IsInside(mask, foreground_minimum, q))
+        {
+        cornerWSum+=cornerW;
+        const WeightEntry* entry = weightMap.GetEntry(q);
+        if(entry)
+          {
+          for(unsigned int k=0; k<K; ++k)
+            {
+            w_pi[entry->Index[k]]+= cornerW*entry->Value[k];
+            }
+          }
+        }
+      }
+    if(cornerWSum!=0.0)
+      {
+      w_pi*= 1.0/cornerWSum;
+      return true;
+      }
+    else
+      {
+      return false;
+      }
+    }
+
+  // Sparse version of the above for any weight map with a sparse Get():
+  // the non-zero weights of the 8 corners, each sorted by site index, are
+  // merged into w_pi. corners is an array of 8 vectors used as scratch space.
+  template<class MaskImageType, class WeightMapType>
+  inline bool Lerp(const WeightMapType& weightMap, //weight input
+                   const itk::ContinuousIndex<double,3>& coord, //the point to evaluate at
+                   const typename MaskImageType::Pointer& mask, //mask that defines the function domain, only the voxels in domain will be used
+                   const typename MaskImageType::PixelType& foreground_minimum, //pixels > this value will be considered in the domain
+                   bender::SparseWeightVector* corners, //scratch space, 8 vectors
+                   bender::SparseWeightVector& w_pi) //output
+  {
+    typedef bender::VoxelIndex::Voxel Voxel;
+    typedef bender::SparseWeightVector::SiteIndex SiteIndex;
+    w_pi.Clear();
+
+    Voxel m; //min index of the cell containing the point
+    m.CopyWithCast(coord);
+
+    double cornerWs[8];
+    size_t numCorners(0);
+    size_t numEntries(0);
+    double cornerWSum(0);
+    for(unsigned int corner=0; corner<8; ++corner)
+      {
+      unsigned int bit = corner;
+      double cornerW=1.0;
+      Voxel q;
+      for(int dim=0; dim<3; ++dim)
+        {
+        bool upper = bit & 1;
+        bit>>=1;
+        float t = coord[dim] - static_cast<float>(m[dim]);
+        cornerW*= upper? t : 1-t;
+        q[dim] = m[dim]+ static_cast<int>(upper);
+        }
+      assert(cornerW>=0);
+      if(DomainTest<MaskImageType>::IsInside(mask, foreground_minimum, q))
+        {
+        cornerWSum+=cornerW;
+        weightMap.Get(q, corners[numCorners]);
+        numEntries+= corners[numCorners].GetSize();
+        cornerWs[numCorners++] = cornerW;
+        }
+      }
+    if(cornerWSum==0.0)
+      {
+      return false;
+      }
+
+    //merge the corner lists, taking the smallest site index at each step
+    w_pi.Reserve(numEntries);
+    size_t heads[8] = {0,0,0,0,0,0,0,0};
+    const double scale = 1.0/cornerWSum;
+    for(;;)
+      {
+      size_t minIndex = std::numeric_limits<size_t>::max();
+      for(size_t c=0; c<numCorners; ++c)
+        {
+        if(heads[c]<corners[c].GetSize())
+          {
+          minIndex = std::min(minIndex, static_cast<size_t>(corners[c].GetIndex(heads[c])));
+          }
+        }
+      if(minIndex==std::numeric_limits<size_t>::max())
+        {
+        break;
+        }
+      double w(0);
+      for(size_t c=0; c<numCorners; ++c)
+        {
+        if(heads[c]<corners[c].GetSize() && corners[c].GetIndex(heads[c])==minIndex)
+          {
+          w+= cornerWs[c]*corners[c].GetValue(heads[c]);
+          ++heads[c];
+          }
+        }
+      if(w>0)
+        {
+        w_pi.Append(static_cast<SiteIndex>(minIndex), static_cast<float>(w*scale));
+        }
+      }
+    return true;
+  }
+
+  // Order in which to evaluate points so that consecutive points look up
+  // nearby voxels of the weight map: the points are sorted by the key of
+  // the first corner of their cell, e.g. in Z-order for a Morton index.
+  inline void ComputeEvaluationOrder(const bender::VoxelIndex& voxels,
+                                     const std::vector<itk::ContinuousIndex<double,3> >& coords,
+                                     std::vector<size_t>& order)
+  {
+    typedef bender::VoxelIndex::Voxel Voxel;
+    typedef bender::VoxelIndex::VoxelKey VoxelKey;
+    const bender::VoxelIndex::Region& region = voxels.GetRegion();
+
+    std::vector<std::pair<VoxelKey, size_t> > keys(coords.size());
+    for(size_t i=0; i<coords.size(); ++i)
+      {
+      Voxel m;
+      m.CopyWithCast(coords[i]);
+      for(int dim=0; dim<3; ++dim)
+        {
+        m[dim] = std::max(m[dim], region.GetIndex()[dim]);
+        m[dim] = std::min(m[dim], static_cast<itk::IndexValueType>(
+          region.GetIndex()[dim]+region.GetSize()[dim]-1));
+        }
+      keys[i] = std::make_pair(voxels.ComputeKey(m), i);
+      }
+    std::sort(keys.begin(), keys.end());
+
+    order.resize(coords.size());
+    for(size_t i=0; i<keys.size(); ++i)
+      {
+      order[i] = keys[i].second;
+      }
+  }
+
+  // Weights of a batch of points in compressed sparse rows: the non-zero
+  // weights of the i-th point are (Indices[k], Values[k]) for k in
+  // [Offsets[i], Offsets[i+1]), sorted by site index. Valid[i] is 0 if
+  // none of the corners of the cell of the point is in the domain.
+  struct WeightBatch
+  {
+    std::vector<size_t> Offsets;
+    std::vector<bender::SparseWeightVector::SiteIndex> Indices;
+    std::vector<float> Values;
+    std::vector<unsigned char> Valid;
+  };
+
+  // Batched version of the sparse Lerp, see LerpBatch()
+  template<class MaskImageType, class WeightMapType>
+  class BatchLerp
+  {
+  public:
+    typedef bender::VoxelIndex::Voxel Voxel;
+    typedef bender::SparseWeightVector::SiteIndex SiteIndex;
+    typedef itk::ContinuousIndex<double,3> Coordinate;
+
+    BatchLerp(const WeightMapType& weightMap, const typename MaskImageType::Pointer& mask,
+              const typename MaskImageType::PixelType& foreground_minimum)
+      :Map(weightMap), Mask(mask), ForegroundMinimum(foreground_minimum), Output(0)
+    {
+    }
+
+    void Execute(const double* points, size_t numPoints, WeightBatch& weights, int numThreads)
+    {
+      this->Output = &weights;
+
+      //transform all the points with the affine map of the mask
+      const typename MaskImageType::DirectionType& toIndex = this->Mask->GetPhysicalPointToIndex();
+      const typename MaskImageType::PointType& origin = this->Mask->GetOrigin();
+      this->Coordinates.resize(numPoints);
+      for(size_t i=0; i<numPoints; ++i)
+        {
+        for(int r=0; r<3; ++r)
+          {
+          double c(0);
+          for(int dim=0; dim<3; ++dim)
+            {
+            c+= toIndex[r][dim]*(points[3*i+dim]-origin[dim]);
+            }
+          this->Coordinates[i][r] = c;
+          }
+        }
+
+      //points of a cell are consecutive in the order
+      bender::ComputeEvaluationOrder(this->Map.GetVoxels(), this->Coordinates, this->Order);
+
+      weights.Offsets.assign(numPoints+1, 0);
+      weights.Valid.assign(numPoints, 0);
+      numThreads = std::max(1, std::min(numThreads, static_cast<int>(numPoints/1024)+1));
+      this->Threads.assign(numThreads, ThreadOutput());
+      if(numThreads>1)
+        {
+        //one threader for both passes
+        this->Threader = itk::MultiThreader::New();
+        this->Threader->SetNumberOfThreads(numThreads);
+        this->Threader->SetSingleMethod(BatchLerp::ThreadedRun, this);
+        }
+      this->CopyOutput = false;
+      this->Run(numThreads);
+
+      for(size_t i=0; i<numPoints; ++i)
+        {
+        weights.Offsets[i+1]+= weights.Offsets[i];
+        }
+      weights.Indices.resize(weights.Offsets[numPoints]);
+      weights.Values.resize(weights.Offsets[numPoints]);
+      this->CopyOutput = true;
+      this->Run(numThreads);
+      this->Threads.clear();
+      this->Threader = 0;
+    }
+
+  private:
+    // Weights of the points of a chunk of the order
+    struct ThreadOutput
+    {
+      std::vector<SiteIndex> Indices;
+      std::vector<float> Values;
+    };
+
+    void Run(int numThreads)
+    {
+      if(numThreads==1)
+        {
+        this->RunChunk(0, 1);
+        return;
+        }
+      this->Threader->SingleMethodExecute();
+    }
+
+    static ITK_THREAD_RETURN_TYPE ThreadedRun(void* arg)
+    {
+      itk::MultiThreader::ThreadInfoStruct* info =
+        static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+      static_cast<BatchLerp*>(info->UserData)->RunChunk(info->ThreadID, info->NumberOfThreads);
+      return ITK_THREAD_RETURN_VALUE;
+    }
+
+    void RunChunk(int threadId, int numThreads)
+    {
+      const size_t begin = this->Order.size()*threadId/numThreads;
+      const size_t end = this->Order.size()*(threadId+1)/numThreads;
+      ThreadOutput& output = this->Threads[threadId];
+
+      if(this->CopyOutput)
+        {
+        //move the weights of the chunk to their rows
+        size_t k(0);
+        for(size_t n=begin; n<end; ++n)
+          {
+          size_t i = this->Order[n];
+          for(size_t l=this->Output->Offsets[i]; l<this->Output->Offsets[i+1]; ++l, ++k)
+            {
+            this->Output->Indices[l] = output.Indices[k];
+            this->Output->Values[l] = output.Values[k];
+            }
+          }
+        return;
+        }
+
+      const typename MaskImageType::RegionType& maskRegion = this->Mask->GetLargestPossibleRegion();
+      bender::SparseWeightVector corners[8];
+      bool inDomain[8];
+      std::vector<SiteIndex> sites; //union of the sites of the corners
+      std::vector<float> values; //values of the corners at the sites, one row per corner
+
+      Voxel m;
+      for(size_t n=begin; n<end; ++n)
+        {
+        size_t i = this->Order[n];
+        const Coordinate& coord = this->Coordinates[i];
+        Voxel p;
+        p.CopyWithCast(coord);
+
+        //fetch the corners once for all the points of a cell
+        if(n==begin || p!=m)
+          {
+          m = p;
+          this->FetchCell(m, maskRegion, corners, inDomain, sites, values);
+          }
+
+        double cornerWs[8];
+        double cornerWSum(0);
+        for(unsigned int corner=0; corner<8; ++corner)
+          {
+          unsigned int bit = corner;
+          double cornerW=1.0;
+          for(int dim=0; dim<3; ++dim)
+            {
+            bool upper = bit & 1;
+            bit>>=1;
+            float t = coord[dim] - static_cast<float>(m[dim]);
+            cornerW*= upper? t : 1-t;
+            }
+          cornerWs[corner] = inDomain[corner] ? cornerW : 0.0;
+          cornerWSum+= cornerWs[corner];
+          }
+        if(cornerWSum==0.0)
+          {
+          continue;
+          }
+        this->Output->Valid[i] = 1;
+
+        const double scale = 1.0/cornerWSum;
+        const size_t numSites = sites.size();
+        size_t numWeights(0);
+        for(size_t u=0; u<numSites; ++u)
+          {
+          double w(0);
+          for(unsigned int corner=0; corner<8; ++corner)
+            {
+            w+= cornerWs[corner]*values[corner*numSites+u];
+            }
+          if(w>0)
+            {
+            output.Indices.push_back(sites[u]);
+            output.Values.push_back(static_cast<float>(w*scale));
+            ++numWeights;
+            }
+          }
+        this->Output->Offsets[i+1] = numWeights;
+        }
+    }
+
+    void FetchCell(const Voxel& m, const typename MaskImageType::RegionType& maskRegion,
+                   bender::SparseWeightVector* corners, bool* inDomain,
+                   std::vector<SiteIndex>& sites, std::vector<float>& values) const
+    {
+      sites.clear();
+      for(unsigned int corner=0; corner<8; ++corner)
+        {
+        Voxel q;
+        for(int dim=0; dim<3; ++dim)
+          {
+          q[dim] = m[dim] + ((corner>>dim) & 1);
+          }
+        inDomain[corner] = maskRegion.IsInside(q)
+          && DomainTest<MaskImageType>::IsInside(this->Mask, this->ForegroundMinimum, q);
+        corners[corner].Clear();
+        if(inDomain[corner])
+          {
+          this->Map.Get(q, corners[corner]);
+          for(size_t k=0; k<corners[corner].GetSize(); ++k)
+            {
+            sites.push_back(corners[corner].GetIndex(k));
+            }
+          }
+        }
+      std::sort(sites.begin(), sites.end());
+      sites.erase(std::unique(sites.begin(), sites.end()), sites.end());
+
+      values.assign(8*sites.size(), 0.0f);
+      for(unsigned int corner=0; corner<8; ++corner)
+        {
+        size_t u(0);
+        for(size_t k=0; k<corners[corner].GetSize(); ++k)
+          {
+          while(sites[u]!=corners[corner].GetIndex(k))
+            {
+            ++u;
+            }
+          values[corner*sites.size()+u] = corners[corner].GetValue(k);
+          }
+        }
+    }
+
+    const WeightMapType& Map;
+    typename MaskImageType::Pointer Mask;
+    typename MaskImageType::PixelType ForegroundMinimum;
+    std::vector<Coordinate> Coordinates;
+    std::vector<size_t> Order;
+    std::vector<ThreadOutput> Threads;
+    itk::MultiThreader::Pointer Threader; //set if there are several threads
+    bool CopyOutput;
+    WeightBatch* Output;
+  };
+
+  // Interpolate the weights at a batch of points, given by their physical
+  // coordinates (x,y,z for each point). This gives the same weights as the
+  // sparse Lerp, but the points are transformed with the affine map of the
+  // mask, grouped by cell so that the corners of a cell are fetched once for
+  // all its points, and interpolated by numThreads threads.
+  template<class MaskImageType, class WeightMapType>
+  inline void LerpBatch(const WeightMapType& weightMap, //weight input
+                        const typename MaskImageType::Pointer& mask, //mask that defines the function domain, and the geometry of the weights
+                        const typename MaskImageType::PixelType& foreground_minimum, //pixels > this value will be considered in the domain
+                        const double* points, //physical coordinates of the points
+                        size_t numPoints,
+                        bender::WeightBatch& weights, //output
+                        int numThreads = 0) //0 for the ITK default
+  {
+    if(numThreads<=0)
+      {
+      numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numThreads = std::min(numThreads,
+      static_cast<int>(itk::MultiThreader::GetGlobalMaximumNumberOfThreads()));
+    BatchLerp<MaskImageType, WeightMapType> batch(weightMap, mask, foreground_minimum);
+    batch.Execute(points, numPoints, weights, numThreads);
+  }
+
+  inline bool LessInfluenceSite(const std::pair<float, bender::SparseWeightVector::SiteIndex>& a,
+                                const std::pair<float, bender::SparseWeightVector::SiteIndex>& b)
+  {
+    return a.second<b.second;
+  }
+
+  // Keep the maxInfluences largest weights of each point of a batch,
+  // renormalized to the sum of the weights of the point. The rows stay
+  // sorted by site index.
+  inline void LimitInfluences(bender::WeightBatch& weights, size_t maxInfluences)
+  {
+    typedef bender::SparseWeightVector::SiteIndex SiteIndex;
+    typedef std::pair<float, SiteIndex> Influence;
+
+    std::vector<Influence> influences;
+    size_t numPoints = weights.Valid.size();
+    size_t k(0);
+    for(size_t i=0; i<numPoints; ++i)
+      {
+      const size_t begin = weights.Offsets[i];
+      const size_t end = weights.Offsets[i+1];
+      weights.Offsets[i] = k;
+      if(end-begin<=maxInfluences)
+        {
+        for(size_t l=begin; l<end; ++l, ++k)
+          {
+          weights.Indices[k] = weights.Indices[l];
+          weights.Values[k] = weights.Values[l];
+          }
+        continue;
+        }
+
+      influences.clear();
+      float sum(0);
+      for(size_t l=begin; l<end; ++l)
+        {
+        influences.push_back(Influence(weights.Values[l], weights.Indices[l]));
+        sum+= weights.Values[l];
+        }
+      std::partial_sort(influences.begin(), influences.begin()+maxInfluences, influences.end(),
+                        std::greater<Influence>());
+      std::sort(influences.begin(), influences.begin()+maxInfluences, LessInfluenceSite);
+      float keptSum(0);
+      for(size_t l=0; l<maxInfluences; ++l)
+        {
+        keptSum+= influences[l].first;
+        }
+      const float scale = keptSum>0 ? sum/keptSum : 0.0f;
+      for(size_t l=0; l<maxInfluences; ++l, ++k)
+        {
+        weights.Indices[k] = influences[l].second;
+        weights.Values[k] = influences[l].first*scale;
+        }
+      }
+    weights.Offsets[numPoints] = k;
+    weights.Indices.resize(k);
+    weights.Values.resize(k);
+  }
+
+  // Scale the weights of each point of a batch to sum to one
+  inline void NormalizeWeights(bender::WeightBatch& weights)
+  {
+    size_t numPoints = weights.Valid.size();
+    for(size_t i=0; i<numPoints; ++i)
+      {
+      float sum(0);
+      for(size_t k=weights.Offsets[i]; k<weights.Offsets[i+1]; ++k)
+        {
+        sum+= weights.Values[k];
+        }
+      for(size_t k=weights.Offsets[i]; k<weights.Offsets[i+1] && sum>0; ++k)
+        {
+        weights.Values[k]/= sum;
+        }
+      }
+  }
 };
 
 #endif
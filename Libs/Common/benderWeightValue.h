@@ -0,0 +1,249 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+#ifndef __WeightValue_h
+#define __WeightValue_h
+
+// .NAME WeightValue - 16 bit storage types for the weights of a WeightMap
+// .SECTION General Description
+// HalfFloat and Fixed16 store a weight on 2 bytes instead of 4, they
+// convert from and to float so that the weight map code handles them as
+// floats. HalfFloat is an IEEE 754 binary16 number, it has 11 significant
+// bits at any scale. Fixed16 maps [0,1] uniformly to 0..65535, it has an
+// absolute precision of 1/131070 and clamps values outside of [0,1].
+
+// ITK includes
+#include <itkIntTypes.h>
+
+// STD includes
+#include <cstring>
+#include <string>
+
+namespace bender
+{
+class HalfFloat
+{
+ public:
+  HalfFloat(): Bits(0)
+  {
+  }
+  HalfFloat(float value): Bits(FromFloat(value))
+  {
+  }
+  operator float() const
+  {
+    return ToFloat(this->Bits);
+  }
+
+  static itk::uint16_t FromFloat(float value)
+  {
+    itk::uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    const itk::uint32_t sign = (x>>16) & 0x8000;
+    const itk::uint32_t floatExponent = (x>>23) & 0xff;
+    itk::uint32_t mantissa = x & 0x7fffff;
+    if(floatExponent==0xff) //infinity or NaN
+      {
+      return static_cast<itk::uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+      }
+    const int exponent = static_cast<int>(floatExponent)-127+15;
+    if(exponent>=31) //too large
+      {
+      return static_cast<itk::uint16_t>(sign | 0x7c00);
+      }
+    itk::uint32_t shift = 13;
+    itk::uint32_t bits = 0;
+    if(exponent>0)
+      {
+      bits = static_cast<itk::uint32_t>(exponent)<<10;
+      }
+    else //subnormal or zero
+      {
+      if(exponent<-10)
+        {
+        return static_cast<itk::uint16_t>(sign);
+        }
+      mantissa|= 0x800000;
+      shift = 14-exponent;
+      }
+    //round to nearest even, a carry into the exponent is still right
+    bits|= mantissa>>shift;
+    const itk::uint32_t rest = mantissa & ((1u<<shift)-1);
+    const itk::uint32_t halfway = 1u<<(shift-1);
+    if(rest>halfway || (rest==halfway && (bits & 1)))
+      {
+      ++bits;
+      }
+    return static_cast<itk::uint16_t>(sign | bits);
+  }
+
+  static float ToFloat(itk::uint16_t bits)
+  {
+    const itk::uint32_t sign = static_cast<itk::uint32_t>(bits & 0x8000)<<16;
+    itk::uint32_t exponent = (bits>>10) & 0x1f;
+    itk::uint32_t mantissa = bits & 0x3ff;
+    itk::uint32_t x;
+    if(exponent==0x1f) //infinity or NaN
+      {
+      x = sign | 0x7f800000 | (mantissa<<13);
+      }
+    else if(exponent!=0)
+      {
+      x = sign | ((exponent-15+127)<<23) | (mantissa<<13);
+      }
+    else if(mantissa==0)
+      {
+      x = sign;
+      }
+    else //subnormal, normalize it
+      {
+      exponent = 127-15+1;
+      while(!(mantissa & 0x400))
+        {
+        mantissa<<= 1;
+        --exponent;
+        }
+      x = sign | (exponent<<23) | ((mantissa & 0x3ff)<<13);
+      }
+    float value;
+    memcpy(&value, &x, sizeof(value));
+    return value;
+  }
+
+ private:
+  itk::uint16_t Bits;
+};
+
+class Fixed16
+{
+ public:
+  Fixed16(): Bits(0)
+  {
+  }
+  Fixed16(float value): Bits(FromFloat(value))
+  {
+  }
+  operator float() const
+  {
+    return this->Bits*(1.0f/65535.0f);
+  }
+
+  static itk::uint16_t FromFloat(float value)
+  {
+    if(!(value>0.0f))
+      {
+      return 0;
+      }
+    if(value>=1.0f)
+      {
+      return 65535;
+      }
+    return static_cast<itk::uint16_t>(value*65535.0f+0.5f);
+  }
+
+ private:
+  itk::uint16_t Bits;
+};
+
+// Code of a value type in the weight map files
+enum WeightValueType
+  {
+  FloatWeight = 0,
+  HalfWeight = 1,
+  Fixed16Weight = 2
+  };
+
+template<class TValue> struct WeightValueTraits;
+
+template<> struct WeightValueTraits<float>
+{
+  static WeightValueType GetType()
+  {
+    return FloatWeight;
+  }
+  static const char* GetName()
+  {
+    return "float";
+  }
+};
+
+template<> struct WeightValueTraits<HalfFloat>
+{
+  static WeightValueType GetType()
+  {
+    return HalfWeight;
+  }
+  static const char* GetName()
+  {
+    return "half";
+  }
+};
+
+template<> struct WeightValueTraits<Fixed16>
+{
+  static WeightValueType GetType()
+  {
+    return Fixed16Weight;
+  }
+  static const char* GetName()
+  {
+    return "fixed16";
+  }
+};
+
+// Value type of a name returned by WeightValueTraits::GetName()
+inline bool GetWeightValueType(const std::string& name, WeightValueType& type)
+{
+  if(name==WeightValueTraits<float>::GetName())
+    {
+    type = FloatWeight;
+    }
+  else if(name==WeightValueTraits<HalfFloat>::GetName())
+    {
+    type = HalfWeight;
+    }
+  else if(name==WeightValueTraits<Fixed16>::GetName())
+    {
+    type = Fixed16Weight;
+    }
+  else
+    {
+    return false;
+    }
+  return true;
+}
+
+// Name of a value type, for the messages
+inline const char* GetWeightValueName(WeightValueType type)
+{
+  switch(type)
+    {
+    case FloatWeight:
+      return WeightValueTraits<float>::GetName();
+    case HalfWeight:
+      return WeightValueTraits<HalfFloat>::GetName();
+    case Fixed16Weight:
+      return WeightValueTraits<Fixed16>::GetName();
+    }
+  return "unknown";
+}
+};
+
+#endif
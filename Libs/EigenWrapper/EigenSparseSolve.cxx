@@ -21,8 +21,335 @@
 // Bender includes
 #include "EigenSparseSolve.h"
 
+// STD includes
+#include <cmath>
+#include <vector>
+
 Eigen::VectorXf Solve(SpMat& A,  Eigen::VectorXf& b)
 {
   Eigen::SimplicialCholesky<SpMat> solver(A);  // performs a Cholesky factorization of A
   return solver.solve(b);
 }
+
+//-------------------------------------------------------------------------------
+CholeskySolver::CholeskySolver()
+{
+}
+
+//-------------------------------------------------------------------------------
+bool CholeskySolver::Factorize(SpMat& A)
+{
+  this->Solver.compute(A);
+  return this->Solver.info()==Eigen::Success;
+}
+
+//-------------------------------------------------------------------------------
+Eigen::VectorXf CholeskySolver::Solve(const Eigen::VectorXf& b) const
+{
+  return this->Solver.solve(b);
+}
+
+//-------------------------------------------------------------------------------
+Eigen::MatrixXf CholeskySolver::Solve(const Eigen::MatrixXf& B) const
+{
+  return this->Solver.solve(B);
+}
+
+//-------------------------------------------------------------------------------
+LinearOperator::~LinearOperator()
+{
+}
+
+//-------------------------------------------------------------------------------
+LinearPreconditioner::~LinearPreconditioner()
+{
+}
+
+//-------------------------------------------------------------------------------
+SparseMatrixOperator::SparseMatrixOperator()
+  :A(0)
+{
+}
+
+//-------------------------------------------------------------------------------
+void SparseMatrixOperator::SetMatrix(const SpMat* A)
+{
+  this->A = A;
+}
+
+//-------------------------------------------------------------------------------
+const SpMat* SparseMatrixOperator::GetMatrix() const
+{
+  return this->A;
+}
+
+//-------------------------------------------------------------------------------
+int SparseMatrixOperator::GetSize() const
+{
+  return static_cast<int>(this->A->rows());
+}
+
+//-------------------------------------------------------------------------------
+void SparseMatrixOperator::Apply(const Eigen::VectorXf& x, Eigen::VectorXf& y) const
+{
+  y = (*this->A)*x;
+}
+
+//-------------------------------------------------------------------------------
+void SparseMatrixOperator::GetDiagonal(Eigen::VectorXf& diagonal) const
+{
+  const SpMat& A = *this->A;
+  diagonal.setZero(A.rows());
+  for(int k=0; k<A.outerSize(); ++k)
+    {
+    for(SpMat::InnerIterator it(A,k); it; ++it)
+      {
+      if(it.row()==it.col())
+        {
+        diagonal[it.row()] = it.value();
+        }
+      }
+    }
+}
+
+//-------------------------------------------------------------------------------
+ConjugateGradientSolver::ConjugateGradientSolver()
+  :Operator(0),Preconditioner(IncompleteCholesky),CustomPreconditioner(0),Tolerance(1e-5f),MaxIterations(1000),
+   UseFactor(false)
+{
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::SetPreconditioner(PreconditionerType type)
+{
+  this->Preconditioner = type;
+}
+
+//-------------------------------------------------------------------------------
+ConjugateGradientSolver::PreconditionerType ConjugateGradientSolver::GetPreconditioner() const
+{
+  return this->Preconditioner;
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::SetPreconditioner(const LinearPreconditioner* preconditioner)
+{
+  this->CustomPreconditioner = preconditioner;
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::SetTolerance(float tolerance)
+{
+  this->Tolerance = tolerance;
+}
+
+//-------------------------------------------------------------------------------
+float ConjugateGradientSolver::GetTolerance() const
+{
+  return this->Tolerance;
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::SetMaxIterations(int maxIterations)
+{
+  this->MaxIterations = maxIterations;
+}
+
+//-------------------------------------------------------------------------------
+int ConjugateGradientSolver::GetMaxIterations() const
+{
+  return this->MaxIterations;
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::Compute(const SpMat& A)
+{
+  this->Matrix.SetMatrix(&A);
+  this->Compute(this->Matrix);
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::Compute(const LinearOperator& A)
+{
+  this->Operator = &A;
+  A.GetDiagonal(this->InverseDiagonal);
+  for(int i=0; i<this->InverseDiagonal.size(); ++i)
+    {
+    float d = this->InverseDiagonal[i];
+    this->InverseDiagonal[i] = d!=0 ? 1.0f/d : 1.0f;
+    }
+
+  this->UseFactor = false;
+  this->L = SpMat();
+  const SparseMatrixOperator* matrix = dynamic_cast<const SparseMatrixOperator*>(&A);
+  if(this->Preconditioner==IncompleteCholesky && matrix && !this->CustomPreconditioner)
+    {
+    this->UseFactor = this->FactorizeIncompleteCholesky(*matrix->GetMatrix());
+    if(!this->UseFactor)
+      {
+      this->L = SpMat();
+      }
+    }
+}
+
+//-------------------------------------------------------------------------------
+// IC(0): L has the sparsity pattern of the lower triangle of A
+bool ConjugateGradientSolver::FactorizeIncompleteCholesky(const SpMat& A)
+{
+  int n = static_cast<int>(A.rows());
+  typedef Eigen::Triplet<float> Entry;
+  std::vector<Entry> entries;
+  entries.reserve(A.nonZeros()/2+n);
+  for(int k=0; k<A.outerSize(); ++k)
+    {
+    for(SpMat::InnerIterator it(A,k); it; ++it)
+      {
+      if(it.row()>=it.col())
+        {
+        entries.push_back(Entry(it.row(),it.col(),it.value()));
+        }
+      }
+    }
+  this->L.resize(n,n);
+  this->L.setFromTriplets(entries.begin(),entries.end());
+  this->L.makeCompressed();
+
+  const int* outer = this->L.outerIndexPtr();
+  const int* inner = this->L.innerIndexPtr();
+  float* value = this->L.valuePtr();
+
+  //position of each row in the current column j, -1 if not in its pattern
+  std::vector<int> position(n,-1);
+  for(int k=0; k<n; ++k)
+    {
+    //the rows in each column are sorted: the diagonal comes first
+    if(outer[k]==outer[k+1] || inner[outer[k]]!=k || value[outer[k]]<=0)
+      {
+      return false;
+      }
+    float pivot = std::sqrt(value[outer[k]]);
+    value[outer[k]] = pivot;
+    for(int p=outer[k]+1; p<outer[k+1]; ++p)
+      {
+      value[p]/=pivot;
+      }
+
+    //update the columns j>k that are in the pattern of column k
+    for(int p=outer[k]+1; p<outer[k+1]; ++p)
+      {
+      int j = inner[p];
+      for(int q=outer[j]; q<outer[j+1]; ++q)
+        {
+        position[inner[q]] = q;
+        }
+      for(int q=p; q<outer[k+1]; ++q)
+        {
+        int pos = position[inner[q]];
+        if(pos>=0)
+          {
+          value[pos]-= value[q]*value[p];
+          }
+        }
+      for(int q=outer[j]; q<outer[j+1]; ++q)
+        {
+        position[inner[q]] = -1;
+        }
+      }
+    }
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+void ConjugateGradientSolver::ApplyPreconditioner(const Eigen::VectorXf& r, Eigen::VectorXf& z) const
+{
+  if(this->CustomPreconditioner)
+    {
+    this->CustomPreconditioner->Apply(r,z);
+    return;
+    }
+  if(!this->UseFactor)
+    {
+    z = this->InverseDiagonal.cwiseProduct(r);
+    return;
+    }
+
+  const int* outer = this->L.outerIndexPtr();
+  const int* inner = this->L.innerIndexPtr();
+  const float* value = this->L.valuePtr();
+  int n = static_cast<int>(r.size());
+
+  //L y = r
+  z = r;
+  for(int k=0; k<n; ++k)
+    {
+    z[k]/=value[outer[k]];
+    for(int p=outer[k]+1; p<outer[k+1]; ++p)
+      {
+      z[inner[p]]-=value[p]*z[k];
+      }
+    }
+  //L^T z = y
+  for(int k=n-1; k>=0; --k)
+    {
+    float zk = z[k];
+    for(int p=outer[k]+1; p<outer[k+1]; ++p)
+      {
+      zk-=value[p]*z[inner[p]];
+      }
+    z[k] = zk/value[outer[k]];
+    }
+}
+
+//-------------------------------------------------------------------------------
+int ConjugateGradientSolver::Solve(const Eigen::VectorXf& b, Eigen::VectorXf& x, float& error) const
+{
+  const LinearOperator& A = *this->Operator;
+  int n = static_cast<int>(b.size());
+  if(x.size()!=n)
+    {
+    x.setZero(n);
+    }
+
+  float bNorm = b.norm();
+  if(bNorm==0)
+    {
+    x.setZero(n);
+    error = 0;
+    return 0;
+    }
+
+  Eigen::VectorXf r(n), z(n), p(n), Ap(n);
+  A.Apply(x,Ap);
+  r = b - Ap;
+  error = r.norm()/bNorm;
+  if(error<=this->Tolerance)
+    {
+    return 0;
+    }
+
+  this->ApplyPreconditioner(r,z);
+  p = z;
+  float rz = r.dot(z);
+
+  int i=0;
+  while(i<this->MaxIterations)
+    {
+    A.Apply(p,Ap);
+    float alpha = rz/p.dot(Ap);
+    x+= alpha*p;
+    r-= alpha*Ap;
+    ++i;
+
+    error = r.norm()/bNorm;
+    if(error<=this->Tolerance)
+      {
+      break;
+      }
+
+    this->ApplyPreconditioner(r,z);
+    float rzNew = r.dot(z);
+    p = z + (rzNew/rz)*p;
+    rz = rzNew;
+    }
+  return i;
+}
@@ -33,4 +33,128 @@ typedef Eigen::SparseMatrix<float> SpMat;
 //Solve a sparse matrix.  Just wrap around Eignen
 Eigen::VectorXf BENDER_EIGENWRAPPER_EXPORT Solve(SpMat& A,  Eigen::VectorXf& b);
 
+//Factor a sparse symmetric positive definite matrix once and solve it for
+//any number of right hand sides. Solve() does not modify the factorization
+//and can be called concurrently.
+class BENDER_EIGENWRAPPER_EXPORT CholeskySolver
+{
+public:
+  CholeskySolver();
+
+  //Return false if the factorization failed, e.g. A is singular
+  bool Factorize(SpMat& A);
+
+  Eigen::VectorXf Solve(const Eigen::VectorXf& b) const;
+  Eigen::MatrixXf Solve(const Eigen::MatrixXf& B) const;
+
+private:
+  CholeskySolver(const CholeskySolver&); //not implemented
+  void operator=(const CholeskySolver&); //not implemented
+
+  Eigen::SimplicialCholesky<SpMat> Solver;
+};
+
+//Symmetric positive definite operator that does not need to be stored as a
+//matrix, e.g. a stencil over a voxel grid
+class BENDER_EIGENWRAPPER_EXPORT LinearOperator
+{
+public:
+  virtual ~LinearOperator();
+
+  virtual int GetSize() const = 0;
+
+  //y = A x
+  virtual void Apply(const Eigen::VectorXf& x, Eigen::VectorXf& y) const = 0;
+
+  virtual void GetDiagonal(Eigen::VectorXf& diagonal) const = 0;
+};
+
+//Approximate inverse of a LinearOperator, e.g. a multigrid cycle
+class BENDER_EIGENWRAPPER_EXPORT LinearPreconditioner
+{
+public:
+  virtual ~LinearPreconditioner();
+
+  //z ~= A^-1 r. Must be symmetric positive definite to be used by the
+  //conjugate gradient.
+  virtual void Apply(const Eigen::VectorXf& r, Eigen::VectorXf& z) const = 0;
+};
+
+//LinearOperator of an explicit sparse matrix
+class BENDER_EIGENWRAPPER_EXPORT SparseMatrixOperator: public LinearOperator
+{
+public:
+  SparseMatrixOperator();
+
+  //A is referenced, not copied
+  void SetMatrix(const SpMat* A);
+  const SpMat* GetMatrix() const;
+
+  virtual int GetSize() const;
+  virtual void Apply(const Eigen::VectorXf& x, Eigen::VectorXf& y) const;
+  virtual void GetDiagonal(Eigen::VectorXf& diagonal) const;
+
+private:
+  const SpMat* A;
+};
+
+//Preconditioned conjugate gradient for sparse symmetric positive definite
+//matrices or operators. Unlike a Cholesky factorization, the memory used is linear in
+//the size of A. Solve() does not modify the solver and can be called
+//concurrently.
+class BENDER_EIGENWRAPPER_EXPORT ConjugateGradientSolver
+{
+public:
+  enum PreconditionerType
+    {
+    Jacobi,
+    IncompleteCholesky //zero fill-in, falls back to Jacobi if it breaks down
+    };
+
+  ConjugateGradientSolver();
+
+  void SetPreconditioner(PreconditionerType type);
+  PreconditionerType GetPreconditioner() const;
+
+  //Use a preconditioner of the caller instead of the built-in ones. It is
+  //referenced, not copied. Set to 0 to go back to the built-in ones.
+  void SetPreconditioner(const LinearPreconditioner* preconditioner);
+
+  //Iterate until |b-Ax| <= Tolerance*|b|
+  void SetTolerance(float tolerance);
+  float GetTolerance() const;
+
+  void SetMaxIterations(int maxIterations);
+  int GetMaxIterations() const;
+
+  //Build the preconditioner. A is referenced, not copied, and must
+  //outlive the solver.
+  void Compute(const SpMat& A);
+
+  //Same as above for any operator. IncompleteCholesky needs a
+  //SparseMatrixOperator, it falls back to Jacobi for the other operators.
+  void Compute(const LinearOperator& A);
+
+  //On input x is the initial guess, on output the solution.
+  //Return the number of iterations. error is set to the relative residual.
+  int Solve(const Eigen::VectorXf& b, Eigen::VectorXf& x, float& error) const;
+
+private:
+  ConjugateGradientSolver(const ConjugateGradientSolver&); //not implemented
+  void operator=(const ConjugateGradientSolver&); //not implemented
+
+  bool FactorizeIncompleteCholesky(const SpMat& A);
+  void ApplyPreconditioner(const Eigen::VectorXf& r, Eigen::VectorXf& z) const;
+
+  SparseMatrixOperator Matrix;
+  const LinearOperator* Operator;
+  PreconditionerType Preconditioner;
+  const LinearPreconditioner* CustomPreconditioner;
+  float Tolerance;
+  int MaxIterations;
+  bool UseFactor;
+  Eigen::VectorXf InverseDiagonal;
+  SpMat L; //lower triangular incomplete Cholesky factor, column major
+};
+
 #endif
@@ -20,6 +20,9 @@
 
 // Bender includes
 #include "ArmatureWeightCLP.h"
+#include "benderDomainMask.h"
+#include "benderWeightMap.h"
+#include "benderWeightMapIO.h"
 
 // Eigen includes
 #include "EigenSparseSolve.h"
@@ -31,24 +34,35 @@
 #include <itkBinaryThresholdImageFilter.h>
 #include <itkPluginUtilities.h>
 #include <itkImageRegionIteratorWithIndex.h>
+#include <itkImageRegionConstIterator.h>
 #include <itkBresenhamLine.h>
 #include <itkMath.h>
 #include <itkIndex.h>
+#include <itkContinuousIndex.h>
 #include <itkConnectedComponentImageFilter.h>
+#include <itkMultiThreader.h>
+#include <itkMutexLock.h>
+#include <itkConditionVariable.h>
+#include <itkIntTypes.h>
 
 // VTK includes
 #include <vtkNew.h>
 #include <vtkPolyDataReader.h>
 #include <vtkPolyDataWriter.h>
 #include <vtkPolyData.h>
+#include <vtkPoints.h>
 #include <vtkCellArray.h>
 #include <vtkTimerLog.h>
 
 // STD includes
 #include <sstream>
 #include <vector>
+#include <map>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 
 typedef unsigned char CharType;
 typedef unsigned short LabelType;
@@ -63,6 +77,19 @@ typedef itk::ImageRegion<3> Region;
 
 bool DumpSegmentationImages = false;
 
+//-------------------------------------------------------------------------------
+// The armature edges are processed on several threads: a message is built
+// first and written in a single insertion under OutputLock, so that the
+// lines of different edges do not mix.
+itk::SimpleMutexLock OutputLock;
+
+void WriteLine(std::ostream& os, const std::string& line)
+{
+  OutputLock.Lock();
+  os << line << std::endl;
+  OutputLock.Unlock();
+}
+
 //-------------------------------------------------------------------------------
 template<unsigned int dimension>
 class Neighborhood
@@ -104,10 +131,9 @@ public:
 class BodyDiffusionRegion: public PixelShape<3>
 {
 public:
-  BodyDiffusionRegion(LabelImage::Pointer domain, LabelImage::Pointer labelMap)
-    :Domain(domain),LabelMap(labelMap)
+  BodyDiffusionRegion(LabelImage::Pointer domain, LabelImage::Pointer labelMap, const Region& region)
+    :Domain(domain),LabelMap(labelMap),ImRegion(region)
   {
-    this->ImRegion = domain->GetLargestPossibleRegion();
   }
   bool IsMember(Voxel p) const
   {
@@ -145,11 +171,32 @@ void Allocate(typename InImage::Pointer in, typename OutImage::Pointer out)
   out->Allocate();
 }
 
+//-------------------------------------------------------------------------------
+// Same as above, but only allocate the given part of the input image region
+template<class InImage, class OutImage>
+void Allocate(typename InImage::Pointer in, typename OutImage::Pointer out, const Region& region)
+{
+  out->SetOrigin(in->GetOrigin());
+  out->SetSpacing(in->GetSpacing());
+  out->SetRegions(region);
+  out->Allocate();
+}
+
+//-------------------------------------------------------------------------------
+// Grow a region by radius voxels in every direction, without leaving bounds
+Region PadRegion(const Region& region, int radius, const Region& bounds)
+{
+  Region padded = region;
+  padded.PadByRadius(radius);
+  padded.Crop(bounds);
+  return padded;
+}
+
 //-------------------------------------------------------------------------------
 template <class ImageType>
 void WriteImage(typename ImageType::Pointer image,const char* fname)
 {
-  std::cout << "Write image to "<<fname << std::endl;
+  WriteLine(std::cout, std::string("Write image to ")+fname);
   typedef typename itk::ImageFileWriter<ImageType> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
   writer->SetFileName(fname);
@@ -294,135 +341,205 @@ void ComputeManhattanVoronoi(typename InputImageType::Pointer siteMap,
 }
 
 //-------------------------------------------------------------------------------
-template<class T>
-inline int NumConnectedComponents(typename T::Pointer domain)
-{
-  typedef typename itk::Image<unsigned short, T::ImageDimension> OutImageType;
-  typedef itk::ConnectedComponentImageFilter<T, OutImageType>  ConnectedComponent;
-  typename ConnectedComponent::Pointer connectedComponents = ConnectedComponent::New ();
-  connectedComponents->SetInput(domain);
-  connectedComponents->SetBackgroundValue(0);
-  connectedComponents->Update();
-  return connectedComponents->GetObjectCount();
-}
-
-//-------------------------------------------------------------------------------
-template<class T>
-inline int NumConnectedComponents(typename T::Pointer image, typename T::PixelType value)
+// Exact Euclidean distance transform of the sites of a label image along one
+// dimension at a time (Felzenszwalb and Huttenlocher), carrying the label of
+// the nearest site. The scanlines of each dimension are split between threads.
+template<class InputImageType>
+class EuclideanVoronoi
 {
-  typedef itk::BinaryThresholdImageFilter<T, T> Threshold;
-  typename Threshold::Pointer threshold = Threshold::New();
-  threshold->SetInput(image);
-  threshold->SetLowerThreshold(value);
-  threshold->SetUpperThreshold(value);
-  threshold->SetInsideValue(1);
-  threshold->SetOutsideValue(0);
-
-  typedef itk::ConnectedComponentImageFilter<T, T>  ConnectedComponent;
-  typename ConnectedComponent::Pointer connectedComponents = ConnectedComponent::New ();
-  connectedComponents->SetInput(threshold->GetOutput());
-  connectedComponents->SetBackgroundValue(0);
-  connectedComponents->Update();
-  return connectedComponents->GetObjectCount();
+public:
+  typedef typename InputImageType::PixelType PixelValue;
 
-}
+  EuclideanVoronoi(typename InputImageType::Pointer siteMap,
+                   PixelValue background, PixelValue unknown)
+    :SiteMap(siteMap),Background(background),Unknown(unknown),Dimension(0)
+  {
+    typename InputImageType::RegionType region = siteMap->GetLargestPossibleRegion();
+    size_t stride = 1;
+    for(unsigned int i=0; i<InputImageType::ImageDimension; ++i)
+      {
+      this->Size[i] = region.GetSize()[i];
+      this->Stride[i] = stride;
+      this->Spacing[i] = siteMap->GetSpacing()[i];
+      stride*= this->Size[i];
+      }
 
-//-------------------------------------------------------------------------------
-template<class RealImageType>
-void DiffuseHeatIteratively(typename RealImageType::Pointer heat,
-                            const PixelShape<RealImageType::ImageDimension>& shape,
-                            int numIterations)
-{
-  typedef typename RealImageType::IndexType Pixel;
-  typedef typename RealImageType::PixelType Real;
+    const PixelValue* sites = siteMap->GetBufferPointer();
+    this->Distance.resize(stride);
+    this->Labels.assign(sites, sites+stride);
+    for(size_t i=0; i<stride; ++i)
+      {
+      bool isSite = sites[i]!=background && sites[i]!=unknown;
+      this->Distance[i] = isSite? 0.0f : std::numeric_limits<float>::infinity();
+      }
+  }
 
-  typename RealImageType::RegionType region = heat->GetLargestPossibleRegion();
-  Neighborhood<RealImageType::ImageDimension> nbrs;
-  typedef typename RealImageType::OffsetType OffsetType;
-  OffsetType* offsets = nbrs.Offsets;
+  void Compute(int numThreads)
+  {
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(std::max(numThreads,1));
+    threader->SetSingleMethod(EuclideanVoronoi::ThreadedTransform, this);
+    for(this->Dimension=0; this->Dimension<InputImageType::ImageDimension; ++this->Dimension)
+      {
+      threader->SingleMethodExecute();
+      }
 
-  std::vector<Pixel> interior;
-  for(itk::ImageRegionIteratorWithIndex<RealImageType> it(heat,region); !it.IsAtEnd(); ++it)
-    {
-    Pixel p = it.GetIndex();
-    if(shape.IsInterior(p))
+    //only the unknown voxels are labeled
+    PixelValue* sites = this->SiteMap->GetBufferPointer();
+    for(size_t i=0; i<this->Labels.size(); ++i)
       {
-      interior.push_back(p);
+      if(sites[i]==this->Unknown && this->Distance[i]<std::numeric_limits<float>::infinity())
+        {
+        sites[i] = this->Labels[i];
+        }
       }
-    }
+  }
 
-  std::cout << "Smooth iteratively: ";
-  for(int iteration=0; iteration<numIterations; ++iteration)
-    {
-    std::cout << ". " << std::flush;
-    for(typename std::vector<Pixel>::iterator pi = interior.begin(); pi!=interior.end(); ++pi)
+private:
+  static ITK_THREAD_RETURN_TYPE ThreadedTransform(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    EuclideanVoronoi* self = static_cast<EuclideanVoronoi*>(info->UserData);
+    size_t numLines = self->Labels.size()/self->Size[self->Dimension];
+    size_t numThreads = info->NumberOfThreads;
+    size_t first = numLines*info->ThreadID/numThreads;
+    size_t last = numLines*(info->ThreadID+1)/numThreads;
+    self->TransformLines(first, last);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  // Lower envelope of the parabolas rooted at the finite samples of each line
+  void TransformLines(size_t first, size_t last)
+  {
+    unsigned int d = this->Dimension;
+    size_t n = this->Size[d];
+    size_t stride = this->Stride[d];
+    double spacing = this->Spacing[d];
+    std::vector<double> f(n), z(n+1);
+    std::vector<size_t> v(n);
+    std::vector<PixelValue> labels(n);
+    for(size_t line=first; line<last; ++line)
       {
-      Pixel p = *pi;
-      Real sum=0.0;
-      Real diag = 0.0;
-      for(OffsetType* offset = offsets; offset!=offsets+2*RealImageType::ImageDimension; ++offset)
+      //the line start: line enumerates the coordinates of the other dimensions
+      size_t start = (line/stride)*stride*n + line%stride;
+
+      int k = -1;
+      for(size_t q=0; q<n; ++q)
         {
-        Pixel q = p + *offset;
-        if(shape.IsMember(q))
+        size_t i = start+q*stride;
+        f[q] = this->Distance[i];
+        labels[q] = this->Labels[i];
+        if(this->Distance[i]==std::numeric_limits<float>::infinity())
+          {
+          continue;
+          }
+        double xq = q*spacing;
+        double s = -std::numeric_limits<double>::infinity();
+        while(k>=0)
           {
-          assert(heat->GetPixel(q)>=0);
-          sum+=heat->GetPixel(q);
-          diag+=1.0;
+          double xv = v[k]*spacing;
+          s = ((f[q]+xq*xq) - (f[v[k]]+xv*xv))/(2.0*(xq-xv));
+          if(s>z[k])
+            {
+            break;
+            }
+          --k;
           }
+        ++k;
+        v[k] = q;
+        z[k] = k==0? -std::numeric_limits<double>::infinity() : s;
+        z[k+1] = std::numeric_limits<double>::infinity();
         }
-      if(diag==0.0)
+      if(k<0)
         {
-        cerr<<p<<" has no neighbor" << std::endl;
+        continue; //no site reaches this line yet
         }
-      else
+
+      k = 0;
+      for(size_t q=0; q<n; ++q)
         {
-        heat->SetPixel(p, sum/diag);
+        double xq = q*spacing;
+        while(z[k+1]<xq)
+          {
+          ++k;
+          }
+        double dx = xq-v[k]*spacing;
+        size_t i = start+q*stride;
+        this->Distance[i] = static_cast<float>(dx*dx + f[v[k]]);
+        this->Labels[i] = labels[v[k]];
         }
       }
-    }
-  std::cout << endl;
+  }
+
+  typename InputImageType::Pointer SiteMap;
+  PixelValue Background;
+  PixelValue Unknown;
+  size_t Size[InputImageType::ImageDimension];
+  size_t Stride[InputImageType::ImageDimension];
+  double Spacing[InputImageType::ImageDimension];
+  unsigned int Dimension; //of the current pass
+  std::vector<float> Distance; //squared, to the nearest site
+  std::vector<PixelValue> Labels; //of the nearest site
+};
+
+//-------------------------------------------------------------------------------
+// Same as ComputeManhattanVoronoi, with the straight line distance to the
+// sites. Unlike the Manhattan distance, it is not measured within the
+// unknown voxels.
+template<class InputImageType>
+void ComputeEuclideanVoronoi(typename InputImageType::Pointer siteMap,
+                             typename InputImageType::PixelType background,
+                             typename InputImageType::PixelType unknown,
+                             int numThreads)
+{
+  EuclideanVoronoi<InputImageType> voronoi(siteMap, background, unknown);
+  voronoi.Compute(numThreads);
 }
 
 //-------------------------------------------------------------------------------
-void DiffuseHeat(CharImage::Pointer domain, //a binary image that describes the domain
-                 LabelImage::Pointer sourceMap, //a label image that defines the heat sources
-                 LabelType hotSourceLabel, //any source voxel with this label will be assigned weight 1
-                                          //other source voxels are assigned weight 0
-                 WeightImage::Pointer heat)  ////output
+// The linear system of the heat diffusion over a domain. The domain voxels
+// with label 0 in the source map are the unknowns (interior), the other ones
+// are fixed (boundary):
+//   A*xI = -B*xB
+struct HeatDiffusionSystem
+{
+  int NumInterior; //m
+  int NumVoxels; //n
+  std::vector<Voxel> ImageIndex; //the first m voxels are the interior ones
+  SpMat A; //m x m
+  SpMat B; //m x (n-m)
+};
+
+//-------------------------------------------------------------------------------
+void AssembleHeatDiffusion(CharImage::Pointer domain, //a binary image that describes the domain
+                           LabelImage::Pointer sourceMap, //a label image that defines the heat sources
+                           HeatDiffusionSystem& system) //output
 {
   Region imDomain = domain->GetLargestPossibleRegion();
 
   Neighborhood<3> neighbors;
   VoxelOffset* offsets = neighbors.Offsets ;
 
-  int m(0),n(0),numHotSource(0);
+  int m(0),n(0);
   itk::ImageRegionIteratorWithIndex<CharImage> it(domain,imDomain);
   for(it.GoToBegin(); !it.IsAtEnd(); ++it)
     {
     if(it.Get()>0)
       {
       ++n;
-      LabelType label = sourceMap->GetPixel(it.GetIndex());
-      if(label==0) //interior
+      if(sourceMap->GetPixel(it.GetIndex())==0) //interior
         {
         ++m;
         }
-      else
-        {
-        if(label==hotSourceLabel)
-          {
-          numHotSource++;
-          }
-        }
       }
     }
-  std::cout << "Problem dimension: "<<m<<" x "<<n << std::endl;
-  std::cout << "num hot: "<<numHotSource << std::endl;
 
   typedef itk::Image<int, 3> ImageIndexMap;
   ImageIndexMap::Pointer matrixIndex = ImageIndexMap::New();
   Allocate<CharImage,ImageIndexMap>(domain, matrixIndex);
-  std::vector<Voxel> imageIndex(n);
+  std::vector<Voxel>& imageIndex = system.ImageIndex;
+  imageIndex.resize(n);
   int i1(0),i2(m); //index is the image pixel index, i1 and i2 are matrix indices
   for(it.GoToBegin(); !it.IsAtEnd(); ++it)
     {
@@ -452,9 +569,10 @@ void DiffuseHeat(CharImage::Pointer domain, //a binary image that describes the
   assert(i1==m);
   assert(i2==n);
 
-  typedef Eigen::SparseMatrix<float> SpMat;
-  SpMat A(m,m);
-  SpMat B(m,n-m);
+  system.NumInterior = m;
+  system.NumVoxels = n;
+  system.A.resize(m,m);
+  system.B.resize(m,n-m);
     {
     typedef Eigen::Triplet<float> SpMatEntry;
     std::vector<SpMatEntry> entryA, entryB;
@@ -480,219 +598,1386 @@ void DiffuseHeat(CharImage::Pointer domain, //a binary image that describes the
         }
       entryA.push_back(SpMatEntry(i,i,Aii));
       }
-    A.setFromTriplets(entryA.begin(),entryA.end());
-    B.setFromTriplets(entryB.begin(),entryB.end());
+    system.A.setFromTriplets(entryA.begin(),entryA.end());
+    system.B.setFromTriplets(entryB.begin(),entryB.end());
     }
+}
 
-  Eigen::VectorXf xB(n-m);
+//-------------------------------------------------------------------------------
+// Boundary values of the heat diffusion: 1 on the hot source voxels, 0 on the
+// other source voxels. Return the number of hot voxels.
+int GetHeatSourceValues(const HeatDiffusionSystem& system,
+                        LabelImage::Pointer sourceMap,
+                        LabelType hotSourceLabel,
+                        Eigen::VectorXf& xB) //output
+{
+  int m = system.NumInterior;
+  int n = system.NumVoxels;
+  xB.resize(n-m);
   int numOnes=0;
   for(int i=0,i0=m; i<n-m; ++i,++i0)
     {
-    Voxel voxel = imageIndex[i0];
+    Voxel voxel = system.ImageIndex[i0];
     LabelType label = sourceMap->GetPixel(voxel);
     xB[i] = label==hotSourceLabel? 1.0 : 0.0;
     numOnes += xB[i]==1.0;
     }
-  assert(numOnes==numHotSource);
-
-  Eigen::VectorXf b(m);
-    {
-    b = B*xB;
-    b*=-1.0;
-    }
-
-  // Solving:
-  Eigen::VectorXf xI(m);
-  vtkNew<vtkTimerLog> timer;
-  timer->StartTimer();
-
-  if(0)
-    {
-    }
-  else
-    {
-    try
-      {
-      xI = Solve(A,b);
-      }
-    catch(std::bad_alloc)
-      {
-      cout << "Cholesky runs out of memory, switch to conjugate gradient instead\n";
-      Eigen::ConjugateGradient<SpMat> solver(A);
-      xI= solver.solve(b);
-      }
-    }
+  return numOnes;
+}
 
-  timer->StopTimer();
-  std::cout << "Simple heat diffusion of size "<<m<<", solve time: " << timer->GetElapsedTime() << std::endl;
+//-------------------------------------------------------------------------------
+// Copy the solution of a heat diffusion system into an image
+void SetHeat(const HeatDiffusionSystem& system,
+             const Eigen::VectorXf& xI,
+             const Eigen::VectorXf& xB,
+             WeightImage::Pointer heat) //output
+{
+  int m = system.NumInterior;
+  int n = system.NumVoxels;
 
   //set the interior pixels by xI
   for(int i=0; i<m; ++i)
     {
-    Voxel voxel = imageIndex[i];
-    heat->SetPixel(voxel, xI[i]);
+    heat->SetPixel(system.ImageIndex[i], xI[i]);
     }
   //set the boundary pixels by xB
   for(int i=m; i<n; ++i)
     {
-    heat->SetPixel(imageIndex[i],xB[i-m]);
+    heat->SetPixel(system.ImageIndex[i],xB[i-m]);
     }
-
 }
 
 //-------------------------------------------------------------------------------
-int Expand(const std::vector<Voxel>& seeds,
-           CharImage::Pointer domain, int distance,
-           LabelImage::Pointer labelMap, unsigned short foreGroundMin,
-           unsigned char seedLabel,
-           unsigned char domainLabel)
+// Raster numbering of the voxels of a region padded by one voxel, so that the
+// 6 neighbors of any voxel of the region are at fixed offsets
+class VoxelGrid
 {
-  CharImage::RegionType allRegion = labelMap->GetLargestPossibleRegion();
-  Neighborhood<3> neighbors;
-  VoxelOffset* offsets = neighbors.Offsets ;
+public:
+  VoxelGrid()
+  {
+    std::fill(this->Offsets, this->Offsets+6, 0);
+  }
 
-  //grow by distance
-  typedef std::vector<Voxel> PixelVector;
-  PixelVector bd = seeds;
-  int regionSize(0);
-  for(PixelVector::iterator i = bd.begin(); i!=bd.end();++i)
-    {
-    if(labelMap->GetPixel(*i)>=foreGroundMin)
-      {
-      domain->SetPixel(*i,seedLabel);
-      ++regionSize;
-      }
-    }
-  for(int dist=2; dist<=distance; ++dist)
-    {
-    PixelVector newBd;
-    for(PixelVector::iterator i = bd.begin(); i!=bd.end();++i)
+  explicit VoxelGrid(const Region& region)
+    :Box(region)
+  {
+    this->Box.PadByRadius(1);
+    int sx = static_cast<int>(this->Box.GetSize()[0]);
+    int sxy = sx*static_cast<int>(this->Box.GetSize()[1]);
+    int offsets[6] = {-1, 1, -sx, sx, -sxy, sxy};
+    std::copy(offsets, offsets+6, this->Offsets);
+  }
+
+  int GetSize() const
+  {
+    return static_cast<int>(this->Box.GetNumberOfPixels());
+  }
+
+  int GetIndex(const Voxel& voxel) const
+  {
+    const Region::IndexType& start = this->Box.GetIndex();
+    const Region::SizeType& size = this->Box.GetSize();
+    return static_cast<int>((voxel[0]-start[0])
+      + size[0]*((voxel[1]-start[1]) + size[1]*(voxel[2]-start[2])));
+  }
+
+  Voxel GetVoxel(int index) const
+  {
+    int sx = static_cast<int>(this->Box.GetSize()[0]);
+    int sy = static_cast<int>(this->Box.GetSize()[1]);
+    Voxel voxel = this->Box.GetIndex();
+    voxel[0]+= index%sx;
+    voxel[1]+= (index/sx)%sy;
+    voxel[2]+= index/(sx*sy);
+    return voxel;
+  }
+
+  Region Box; //the padded region
+  int Offsets[6]; //index offsets of the 6 neighbors
+};
+
+//-------------------------------------------------------------------------------
+// Matrix free version of the interior block A of the heat diffusion system.
+// The voxels are numbered by a VoxelGrid over the bounding box of the
+// domain. The interior voxels that are consecutive along
+// x form runs: x is scattered into the grid run by run, and A x is computed
+// run by run from 7 contiguous vectors. Apply() uses a scratch grid and must
+// not be called concurrently.
+class StencilHeatDiffusion: public LinearOperator
+{
+public:
+  StencilHeatDiffusion(CharImage::Pointer domain, //a binary image that describes the domain
+                       LabelImage::Pointer sourceMap, //a label image that defines the heat sources
+                       int numThreads)
+    :Domain(domain),SourceMap(sourceMap),NumberOfThreads(std::max(numThreads,1))
+  {
+    Region imDomain = domain->GetLargestPossibleRegion();
+    this->Grid = VoxelGrid(imDomain);
+
+    Neighborhood<3> neighbors;
+    std::vector<float> diagonal;
+    itk::ImageRegionConstIteratorWithIndex<CharImage> it(domain,imDomain);
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
       {
-      Voxel pIndex = *i;
+      Voxel voxel = it.GetIndex();
+      if(it.Get()==0 || sourceMap->GetPixel(voxel)!=0)
+        {
+        continue;
+        }
+      int numNeighbors(0);
       for(int iOff=0; iOff<6; ++iOff)
         {
-        const VoxelOffset& offset = offsets[iOff];
-        Voxel qIndex = pIndex + offset;
-        if(      allRegion.IsInside(qIndex)
-              && labelMap->GetPixel(qIndex)>=foreGroundMin
-              && domain->GetPixel(qIndex)==0)
+        Voxel neighbor = voxel+neighbors.Offsets[iOff];
+        if(imDomain.IsInside(neighbor) && domain->GetPixel(neighbor)!=0)
           {
-          ++regionSize;
-          newBd.push_back(qIndex);
-          domain->SetPixel(qIndex,domainLabel);
+          ++numNeighbors;
           }
         }
+      diagonal.push_back(static_cast<float>(numNeighbors));
+
+      int g = this->Grid.GetIndex(voxel);
+      if(this->Runs.empty() || this->Runs.back().Start+this->Runs.back().Length!=g)
+        {
+        VoxelRun run;
+        run.Start = g;
+        run.Length = 0;
+        run.First = static_cast<int>(diagonal.size())-1;
+        this->Runs.push_back(run);
+        }
+      ++this->Runs.back().Length;
       }
-    bd = newBd;
-    }
-  return regionSize;
-}
 
-//-------------------------------------------------------------------------------
-int Expand(const LabelImage::Pointer labelMap,
-           LabelType label,
-           LabelType forGroundMin,
-           int distance, //input
-           CharImage::Pointer domain,  //output
-           unsigned char domainLabel)
-{
-  Region allRegion = labelMap->GetLargestPossibleRegion();
-  Neighborhood<3> neighbors;
-  VoxelOffset* offsets = neighbors.Offsets ;
+    this->Diagonal.resize(diagonal.size());
+    std::copy(diagonal.begin(), diagonal.end(), this->Diagonal.data());
+    this->X.setZero(this->Grid.GetSize());
+    if(this->NumberOfThreads>1)
+      {
+      this->Threader = itk::MultiThreader::New();
+      this->Threader->SetNumberOfThreads(this->NumberOfThreads);
+      }
+  }
 
-  //grow by distance
-  typedef std::vector<Voxel> PixelVector;
-  PixelVector bd;
-  int regionSize(0);
-  itk::ImageRegionIteratorWithIndex<LabelImage> it(labelMap,allRegion);
-  for(it.GoToBegin(); !it.IsAtEnd(); ++it)
-    {
-    Voxel p = it.GetIndex();
-    if(it.Get()==label)
+  virtual int GetSize() const
+  {
+    return static_cast<int>(this->Diagonal.size());
+  }
+
+  int GetNumberOfRuns() const
+  {
+    return static_cast<int>(this->Runs.size());
+  }
+
+  virtual void Apply(const Eigen::VectorXf& x, Eigen::VectorXf& y) const
+  {
+    y.resize(x.size());
+    ApplyData data;
+    data.Self = this;
+    data.Input = &x;
+    data.Output = &y;
+    if(this->NumberOfThreads==1)
+      {
+      this->Scatter(x, 0, this->Runs.size());
+      this->Multiply(x, y, 0, this->Runs.size());
+      return;
+      }
+    this->Threader->SetSingleMethod(StencilHeatDiffusion::ThreadedScatter, &data);
+    this->Threader->SingleMethodExecute();
+    this->Threader->SetSingleMethod(StencilHeatDiffusion::ThreadedMultiply, &data);
+    this->Threader->SingleMethodExecute();
+  }
+
+  virtual void GetDiagonal(Eigen::VectorXf& diagonal) const
+  {
+    diagonal = this->Diagonal;
+  }
+
+  // b = -B xB where xB is 1 on the hot source voxels and 0 on the other ones.
+  // Return the number of hot voxels.
+  int GetRightHandSide(LabelType hotSourceLabel, Eigen::VectorXf& b) const
+  {
+    Region imDomain = this->Domain->GetLargestPossibleRegion();
+    int numOnes(0);
+    this->X.setZero();
+    itk::ImageRegionConstIteratorWithIndex<CharImage> it(this->Domain,imDomain);
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
       {
-      bd.push_back(p);
-      if(domain->GetPixel(p)==0)
+      if(it.Get()!=0 && this->SourceMap->GetPixel(it.GetIndex())==hotSourceLabel)
         {
-        domain->SetPixel(it.GetIndex(),domainLabel);
-        regionSize++;
+        this->X[this->Grid.GetIndex(it.GetIndex())] = 1.0;
+        ++numOnes;
         }
       }
-    }
-  for(int dist=2; dist<=distance; ++dist)
-    {
-    PixelVector newBd;
-    for(PixelVector::iterator i = bd.begin(); i!=bd.end();++i)
+    b.resize(this->GetSize());
+    this->Multiply(this->X, b, 0, this->Runs.size(), true);
+    this->X.setZero();
+    return numOnes;
+  }
+
+  // Sample an image at the interior voxels, 0 outside of the image
+  void GetValues(WeightImage::Pointer image, Eigen::VectorXf& x) const
+  {
+    x.setZero(this->GetSize());
+    Region region = image->GetLargestPossibleRegion();
+    for(size_t r=0; r<this->Runs.size(); ++r)
       {
-      Voxel pIndex = *i;
-      for(int iOff=0; iOff<6; ++iOff)
+      const VoxelRun& run = this->Runs[r];
+      Voxel voxel = this->Grid.GetVoxel(run.Start);
+      for(int i=0; i<run.Length; ++i, ++voxel[0])
         {
-        const VoxelOffset& offset = offsets[iOff];
-        Voxel qIndex = pIndex + offset;
-        if(allRegion.IsInside(qIndex)
-           && labelMap->GetPixel(qIndex)>=forGroundMin
-           && domain->GetPixel(qIndex)==0)
+        if(region.IsInside(voxel))
           {
-          ++regionSize;
-          newBd.push_back(qIndex);
-          domain->SetPixel(qIndex,domainLabel);
+          x[run.First+i] = std::max(image->GetPixel(voxel), 0.0f);
           }
         }
       }
-    bd = newBd;
-    }
-  return regionSize;
-}
+  }
 
-//-------------------------------------------------------------------------------
-class ArmatureType
-{
-public:
-  enum
+  // Write the solution x at the interior voxels and the source values at
+  // the boundary voxels
+  void SetHeat(const Eigen::VectorXf& x, LabelType hotSourceLabel, WeightImage::Pointer heat) const
   {
-    DomainLabel = 1
+    for(size_t r=0; r<this->Runs.size(); ++r)
+      {
+      const VoxelRun& run = this->Runs[r];
+      Voxel voxel = this->Grid.GetVoxel(run.Start);
+      for(int i=0; i<run.Length; ++i, ++voxel[0])
+        {
+        heat->SetPixel(voxel, x[run.First+i]);
+        }
+      }
+    itk::ImageRegionConstIteratorWithIndex<CharImage> it(this->Domain,this->Domain->GetLargestPossibleRegion());
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      LabelType label = this->SourceMap->GetPixel(it.GetIndex());
+      if(it.Get()!=0 && label!=0)
+        {
+        heat->SetPixel(it.GetIndex(), label==hotSourceLabel? 1.0 : 0.0);
+        }
+      }
+  }
+
+private:
+  struct VoxelRun
+  {
+    int Start; //grid index of the first voxel
+    int Length;
+    int First; //unknown index of the first voxel
   };
 
-  ArmatureType(LabelImage::Pointer image): BodyMap(image)
+  struct ApplyData
   {
-    this->BodyPartition = LabelImage::New();
-    Allocate<LabelImage,LabelImage>(image, this->BodyPartition);
-  }
-  static CharType GetEdgeLabel(int i)
+    const StencilHeatDiffusion* Self;
+    const Eigen::VectorXf* Input;
+    Eigen::VectorXf* Output;
+  };
+
+  // Copy x into the grid for the runs [first,last)
+  void Scatter(const Eigen::VectorXf& x, size_t first, size_t last) const
   {
-    //0 is background, 1 is body interior so armature must start with 2
-    return static_cast<CharType>(i+2);
+    for(size_t r=first; r<last; ++r)
+      {
+      const VoxelRun& run = this->Runs[r];
+      this->X.segment(run.Start, run.Length) = x.segment(run.First, run.Length);
+      }
   }
 
-  CharType GetMaxEdgeLabel() const
+  // y = A x for the runs [first,last), where grid holds the scattered x. If
+  // neighborsOnly, only the sum of the neighbors is computed.
+  void Multiply(const Eigen::VectorXf& grid, Eigen::VectorXf& y,
+                size_t first, size_t last, bool neighborsOnly = false) const
   {
-    //return the last edge id
-    int lastEdge = this->GetNumberOfEdges()-1;
-    return static_cast<CharType>(ArmatureType::GetEdgeLabel(lastEdge));
+    const int* o = this->Grid.Offsets;
+    for(size_t r=first; r<last; ++r)
+      {
+      const VoxelRun& run = this->Runs[r];
+      int g = run.Start;
+      int n = run.Length;
+      Eigen::VectorBlock<Eigen::VectorXf> yRun = y.segment(run.First, n);
+      yRun = grid.segment(g+o[0],n) + grid.segment(g+o[1],n)
+        + grid.segment(g+o[2],n) + grid.segment(g+o[3],n)
+        + grid.segment(g+o[4],n) + grid.segment(g+o[5],n);
+      if(!neighborsOnly)
+        {
+        yRun = this->Diagonal.segment(run.First,n).cwiseProduct(grid.segment(g,n)) - yRun;
+        }
+      }
   }
 
-  LabelImage::Pointer BodyMap;
-  LabelImage::Pointer BodyPartition; //the partition of body by armature edges
-  LabelImage::Pointer BonePartition; //the partition of bones by armature edges
-
-  std::vector<std::vector<Voxel> > SkeletonVoxels;
-  int GetNumberOfEdges() const { return SkeletonVoxels.size(); }
-  std::vector<CharImage::Pointer> Domains;
-  std::vector<Voxel> Fixed;
-  std::vector<WeightImage::Pointer> Weights;
-
-  void Init(const char* fname, bool invertY)
+  static void GetThreadRuns(itk::MultiThreader::ThreadInfoStruct* info, size_t numRuns,
+                            size_t& first, size_t& last)
   {
-    vtkNew<vtkPolyDataReader> reader;
-    reader->SetFileName(fname);
-    reader->Update();
-    this->InitSkeleton(reader->GetOutput(), invertY);
+    size_t numThreads = info->NumberOfThreads;
+    first = numRuns*info->ThreadID/numThreads;
+    last = numRuns*(info->ThreadID+1)/numThreads;
+  }
 
-    this->InitBones();
+  static ITK_THREAD_RETURN_TYPE ThreadedScatter(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    ApplyData* data = static_cast<ApplyData*>(info->UserData);
+    size_t first, last;
+    GetThreadRuns(info, data->Self->Runs.size(), first, last);
+    data->Self->Scatter(*data->Input, first, last);
+    return ITK_THREAD_RETURN_VALUE;
   }
-private:
-  void InitSkeleton(vtkPolyData* armPoly, bool invertY)
+
+  static ITK_THREAD_RETURN_TYPE ThreadedMultiply(void* arg)
   {
-    vtkCellArray* armatureSegments = armPoly->GetLines();
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    ApplyData* data = static_cast<ApplyData*>(info->UserData);
+    size_t first, last;
+    GetThreadRuns(info, data->Self->Runs.size(), first, last);
+    data->Self->Multiply(data->Self->X, *data->Output, first, last);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  CharImage::Pointer Domain;
+  LabelImage::Pointer SourceMap;
+  int NumberOfThreads;
+  itk::MultiThreader::Pointer Threader; //created once, if NumberOfThreads>1
+  VoxelGrid Grid; //over the bounding box of the domain
+  std::vector<VoxelRun> Runs;
+  Eigen::VectorXf Diagonal;
+  mutable Eigen::VectorXf X; //scratch grid, 0 outside of the interior voxels
+};
+
+//-------------------------------------------------------------------------------
+// The domain of DiffuseHeat as a PixelShape: the voxels of the source map are
+// the boundary
+class HeatDiffusionRegion: public PixelShape<3>
+{
+public:
+  HeatDiffusionRegion(CharImage::Pointer domain, LabelImage::Pointer sourceMap)
+    :Domain(domain),SourceMap(sourceMap)
+  {
+    this->ImRegion = domain->GetLargestPossibleRegion();
+  }
+  bool IsMember(Voxel p) const
+  {
+    return this->ImRegion.IsInside(p) && this->Domain->GetPixel(p)>0;
+  }
+  virtual bool IsBoundary(Voxel p) const
+  {
+    return this->IsMember(p) && this->SourceMap->GetPixel(p)!=0;
+  }
+  virtual bool IsInterior(Voxel p) const
+  {
+    return this->IsMember(p) && this->SourceMap->GetPixel(p)==0;
+  }
+private:
+  CharImage::Pointer Domain;
+  LabelImage::Pointer SourceMap;
+  Region ImRegion;
+};
+
+//-------------------------------------------------------------------------------
+// Geometric multigrid for the heat diffusion over a PixelShape: the interior
+// voxels are the unknowns, the boundary voxels have fixed values and the
+// other voxels are insulating. Each coarse voxel covers 2x2x2 voxels of the
+// finer level; it is a boundary voxel if any of them is, and an interior
+// voxel otherwise if any of them is, so that the heat sources never vanish
+// from the coarse levels. The coarse operators use the same 6 neighbor
+// stencil. The correction is prolongated by trilinear interpolation between
+// the centers of the coarse voxels, the weights of the insulating coarse
+// voxels going to the parent voxel, and the residual is restricted by the
+// transpose. The smoother is a red-black Gauss-Seidel and the coarsest level
+// is solved by a Cholesky factorization: the V-cycle is symmetric and can
+// precondition the conjugate gradient.
+// The unknowns are numbered like the interior voxels of the region in raster
+// order, as in AssembleHeatDiffusion; the interior voxels without neighbors
+// keep their value. The levels hold the iterates: the methods must not be
+// called concurrently.
+class MultigridHeatDiffusion: public LinearPreconditioner
+{
+public:
+  MultigridHeatDiffusion(const PixelShape<3>& shape, const Region& region)
+    :NumberOfSmoothingSweeps(2),NumberOfCoarseSweeps(64)
+  {
+    //finest level
+    Region levelRegion = region;
+    VoxelGrid grid(region);
+    std::vector<unsigned char> types(grid.GetSize(), Outside);
+    for(int g=0; g<grid.GetSize(); ++g)
+      {
+      Voxel voxel = grid.GetVoxel(g);
+      if(!region.IsInside(voxel))
+        {
+        continue;
+        }
+      if(shape.IsInterior(voxel))
+        {
+        types[g] = Interior;
+        }
+      else if(shape.IsBoundary(voxel))
+        {
+        types[g] = Boundary;
+        }
+      }
+
+    const size_t minCoarseSize = 1000;
+    while(true)
+      {
+      this->Levels.push_back(Level());
+      Level& level = this->Levels.back();
+      level.Grid = grid;
+      level.Types.swap(types);
+      level.Diagonal.setZero(grid.GetSize());
+      for(int g=0; g<grid.GetSize(); ++g)
+        {
+        if(level.Types[g]!=Interior)
+          {
+          continue;
+          }
+        level.Interior.push_back(g);
+        int numNeighbors(0);
+        for(int iOff=0; iOff<6; ++iOff)
+          {
+          numNeighbors+= level.Types[g+grid.Offsets[iOff]]!=Outside;
+          }
+        if(numNeighbors==0)
+          {
+          continue; //isolated voxel, it keeps its value
+          }
+        level.Diagonal[g] = static_cast<float>(numNeighbors);
+        Voxel voxel = grid.GetVoxel(g);
+        ((voxel[0]+voxel[1]+voxel[2])%2==0 ? level.Red : level.Black).push_back(g);
+        }
+      level.X.setZero(grid.GetSize());
+      level.B.setZero(grid.GetSize());
+      level.R.setZero(grid.GetSize());
+
+      if(level.Interior.size()<minCoarseSize || this->Levels.size()>=16)
+        {
+        break;
+        }
+
+      //coarser level
+      Region coarseRegion;
+      Voxel lo = CoarseVoxel(levelRegion.GetIndex());
+      Voxel hi = CoarseVoxel(levelRegion.GetUpperIndex());
+      Region::SizeType coarseSize;
+      for(int i=0; i<3; ++i)
+        {
+        coarseSize[i] = hi[i]-lo[i]+1;
+        }
+      coarseRegion.SetIndex(lo);
+      coarseRegion.SetSize(coarseSize);
+      VoxelGrid coarseGrid(coarseRegion);
+      std::vector<unsigned char> coarseTypes(coarseGrid.GetSize(), Outside);
+      for(int g=0; g<grid.GetSize(); ++g)
+        {
+        if(level.Types[g]!=Outside)
+          {
+          int coarse = coarseGrid.GetIndex(CoarseVoxel(grid.GetVoxel(g)));
+          coarseTypes[coarse] = std::max(coarseTypes[coarse], level.Types[g]);
+          }
+        }
+      level.Parent.resize(level.Interior.size());
+      level.Octant.resize(level.Interior.size());
+      for(size_t i=0; i<level.Interior.size(); ++i)
+        {
+        Voxel voxel = grid.GetVoxel(level.Interior[i]);
+        Voxel parent = CoarseVoxel(voxel);
+        level.Parent[i] = coarseGrid.GetIndex(parent);
+        level.Octant[i] = 0;
+        for(int dim=0; dim<3; ++dim)
+          {
+          level.Octant[i]|= (voxel[dim]-2*parent[dim])<<dim;
+          }
+        }
+
+      levelRegion = coarseRegion;
+      grid = coarseGrid;
+      types.swap(coarseTypes);
+      }
+    this->FactorizeCoarsestLevel();
+  }
+
+  int GetSize() const
+  {
+    return static_cast<int>(this->Levels[0].Interior.size());
+  }
+
+  int GetNumberOfLevels() const
+  {
+    return static_cast<int>(this->Levels.size());
+  }
+
+  int GetCoarsestSize() const
+  {
+    return static_cast<int>(this->Levels.back().Interior.size());
+  }
+
+  // Solve in place: the boundary voxels of heat give the fixed values, its
+  // interior voxels the initial guess and, on output, the solution. Stop when
+  // the residual is below tolerance times the right hand side or after
+  // maxCycles V-cycles. Return the number of cycles.
+  int Solve(WeightImage::Pointer heat, float tolerance, int maxCycles, float& error) const
+  {
+    Level& fine = this->Levels[0];
+    const VoxelGrid& grid = fine.Grid;
+    Region region = heat->GetLargestPossibleRegion();
+
+    fine.X.setZero();
+    fine.B.setZero();
+    for(size_t i=0; i<fine.Interior.size(); ++i)
+      {
+      int g = fine.Interior[i];
+      Voxel voxel = grid.GetVoxel(g);
+      fine.X[g] = std::max(heat->GetPixel(voxel), 0.0f);
+      for(int iOff=0; iOff<6; ++iOff)
+        {
+        int neighbor = g+grid.Offsets[iOff];
+        if(fine.Types[neighbor]==Boundary)
+          {
+          Voxel q = grid.GetVoxel(neighbor);
+          fine.B[g]+= region.IsInside(q)? std::max(heat->GetPixel(q), 0.0f) : 0.0f;
+          }
+        }
+      }
+
+    float bNorm = Norm(fine, fine.B);
+    int cycle(0);
+    error = 0;
+    if(bNorm>0)
+      {
+      this->ComputeResidual(fine);
+      error = Norm(fine, fine.R)/bNorm;
+      while(cycle<maxCycles && error>tolerance)
+        {
+        this->VCycle(0);
+        ++cycle;
+        this->ComputeResidual(fine);
+        error = Norm(fine, fine.R)/bNorm;
+        }
+      }
+
+    for(size_t i=0; i<fine.Interior.size(); ++i)
+      {
+      int g = fine.Interior[i];
+      heat->SetPixel(grid.GetVoxel(g), fine.X[g]);
+      }
+    return cycle;
+  }
+
+  // One V-cycle from a zero initial guess
+  virtual void Apply(const Eigen::VectorXf& r, Eigen::VectorXf& z) const
+  {
+    Level& fine = this->Levels[0];
+    assert(static_cast<size_t>(r.size())==fine.Interior.size());
+    fine.X.setZero();
+    for(size_t i=0; i<fine.Interior.size(); ++i)
+      {
+      fine.B[fine.Interior[i]] = r[i];
+      }
+    this->VCycle(0);
+    z.resize(fine.Interior.size());
+    for(size_t i=0; i<fine.Interior.size(); ++i)
+      {
+      z[i] = fine.X[fine.Interior[i]];
+      }
+  }
+
+  int NumberOfSmoothingSweeps; //red-black sweeps before and after each coarse correction
+  int NumberOfCoarseSweeps; //red-black sweeps on the coarsest voxels that are not factored
+
+private:
+  enum VoxelType
+    {
+    Outside = 0,
+    Interior = 1,
+    Boundary = 2
+    };
+
+  struct Level
+  {
+    VoxelGrid Grid;
+    std::vector<unsigned char> Types; //VoxelType of the grid voxels
+    std::vector<int> Interior; //grid indices of the unknowns
+    std::vector<int> Red, Black; //the unknowns that are relaxed
+    std::vector<int> Parent; //grid index on the coarser level of each unknown
+    std::vector<unsigned char> Octant; //bit i is set if the unknown is in the upper half of its parent along i
+    Eigen::VectorXf Diagonal; //0 outside of the unknowns with neighbors
+    Eigen::VectorXf X, B, R; //iterate, right hand side and residual
+  };
+
+  static Voxel CoarseVoxel(Voxel voxel)
+  {
+    for(int i=0; i<3; ++i)
+      {
+      voxel[i] = voxel[i]>=0 ? voxel[i]/2 : -((1-voxel[i])/2);
+      }
+    return voxel;
+  }
+
+  static float Norm(const Level& level, const Eigen::VectorXf& v)
+  {
+    double sum(0);
+    for(size_t i=0; i<level.Interior.size(); ++i)
+      {
+      double vi = v[level.Interior[i]];
+      sum+= vi*vi;
+      }
+    return static_cast<float>(sqrt(sum));
+  }
+
+  // Trilinear interpolation weights of the coarse voxels around the i-th
+  // unknown of level. Return the number of coarse voxels, the parent first.
+  static int GetCoarseWeights(const Level& level, size_t i, const Level& coarse,
+                              int targets[8], float weights[8])
+  {
+    int steps[3];
+    for(int dim=0; dim<3; ++dim)
+      {
+      steps[dim] = coarse.Grid.Offsets[2*dim+((level.Octant[i]>>dim)&1)];
+      }
+    targets[0] = level.Parent[i];
+    weights[0] = 0.0f;
+    int n(1);
+    for(int corner=0; corner<8; ++corner)
+      {
+      int target = level.Parent[i];
+      float w(1.0f);
+      for(int dim=0; dim<3; ++dim)
+        {
+        bool neighbor = ((corner>>dim)&1)!=0;
+        target+= neighbor ? steps[dim] : 0;
+        w*= neighbor ? 0.25f : 0.75f;
+        }
+      if(corner==0 || coarse.Types[target]==Outside)
+        {
+        weights[0]+= w;
+        continue;
+        }
+      targets[n] = target;
+      weights[n] = w;
+      ++n;
+      }
+    return n;
+  }
+
+  // Factor the Laplacian of the coarsest unknowns that are connected to a
+  // boundary voxel. The other ones form singular systems and are relaxed.
+  void FactorizeCoarsestLevel()
+  {
+    Level& level = this->Levels.back();
+    const int* o = level.Grid.Offsets;
+    std::vector<int> index(level.Grid.GetSize(), -1);
+    std::vector<int> component;
+    for(size_t i=0; i<level.Interior.size(); ++i)
+      {
+      int seed = level.Interior[i];
+      if(index[seed]!=-1 || level.Diagonal[seed]==0)
+        {
+        continue;
+        }
+      //flood fill the unknowns connected to seed
+      bool grounded = false;
+      component.assign(1, seed);
+      index[seed] = -2;
+      for(size_t c=0; c<component.size(); ++c)
+        {
+        for(int iOff=0; iOff<6; ++iOff)
+          {
+          int neighbor = component[c]+o[iOff];
+          grounded = grounded || level.Types[neighbor]==Boundary;
+          if(level.Types[neighbor]==Interior && index[neighbor]==-1)
+            {
+            index[neighbor] = -2;
+            component.push_back(neighbor);
+            }
+          }
+        }
+      if(grounded)
+        {
+        for(size_t c=0; c<component.size(); ++c)
+          {
+          index[component[c]] = static_cast<int>(this->CoarseUnknowns.size());
+          this->CoarseUnknowns.push_back(component[c]);
+          }
+        }
+      }
+    if(this->CoarseUnknowns.empty())
+      {
+      return;
+      }
+
+    typedef Eigen::Triplet<float> SpMatEntry;
+    std::vector<SpMatEntry> entries;
+    int m = static_cast<int>(this->CoarseUnknowns.size());
+    for(int i=0; i<m; ++i)
+      {
+      int g = this->CoarseUnknowns[i];
+      entries.push_back(SpMatEntry(i, i, level.Diagonal[g]));
+      for(int iOff=0; iOff<6; ++iOff)
+        {
+        if(index[g+o[iOff]]>=0)
+          {
+          entries.push_back(SpMatEntry(i, index[g+o[iOff]], -1.0f));
+          }
+        }
+      }
+    SpMat A(m, m);
+    A.setFromTriplets(entries.begin(), entries.end());
+    if(!this->CoarseSolver.Factorize(A))
+      {
+      WriteLine(std::cerr, "Multigrid: factorization of the coarsest level failed, relax it instead");
+      this->CoarseUnknowns.clear();
+      return;
+      }
+
+    //only relax the unknowns that are not factored
+    for(int color=0; color<2; ++color)
+      {
+      std::vector<int>& voxels = color==0 ? level.Red : level.Black;
+      std::vector<int> relaxed;
+      for(size_t i=0; i<voxels.size(); ++i)
+        {
+        if(index[voxels[i]]<0)
+          {
+          relaxed.push_back(voxels[i]);
+          }
+        }
+      voxels.swap(relaxed);
+      }
+  }
+
+  static void Relax(Level& level, const std::vector<int>& voxels)
+  {
+    const int* o = level.Grid.Offsets;
+    float* x = level.X.data();
+    const float* b = level.B.data();
+    for(std::vector<int>::const_iterator it=voxels.begin(); it!=voxels.end(); ++it)
+      {
+      int g = *it;
+      x[g] = (b[g] + x[g+o[0]] + x[g+o[1]] + x[g+o[2]] + x[g+o[3]] + x[g+o[4]] + x[g+o[5]])
+        / level.Diagonal[g];
+      }
+  }
+
+  // reverse reverses the order of the colors so that the post smoothing is
+  // the adjoint of the pre smoothing
+  static void Smooth(Level& level, int numSweeps, bool reverse)
+  {
+    for(int i=0; i<numSweeps; ++i)
+      {
+      Relax(level, reverse? level.Black : level.Red);
+      Relax(level, reverse? level.Red : level.Black);
+      }
+  }
+
+  static void ComputeResidual(Level& level)
+  {
+    const int* o = level.Grid.Offsets;
+    const float* x = level.X.data();
+    for(size_t i=0; i<level.Interior.size(); ++i)
+      {
+      int g = level.Interior[i];
+      level.R[g] = level.B[g] - level.Diagonal[g]*x[g]
+        + x[g+o[0]] + x[g+o[1]] + x[g+o[2]] + x[g+o[3]] + x[g+o[4]] + x[g+o[5]];
+      }
+  }
+
+  void VCycle(size_t l) const
+  {
+    Level& level = this->Levels[l];
+    if(l+1==this->Levels.size())
+      {
+      if(!this->CoarseUnknowns.empty())
+        {
+        Eigen::VectorXf b(this->CoarseUnknowns.size());
+        for(size_t i=0; i<this->CoarseUnknowns.size(); ++i)
+          {
+          b[i] = level.B[this->CoarseUnknowns[i]];
+          }
+        Eigen::VectorXf x = this->CoarseSolver.Solve(b);
+        for(size_t i=0; i<this->CoarseUnknowns.size(); ++i)
+          {
+          level.X[this->CoarseUnknowns[i]] = x[i];
+          }
+        }
+      Smooth(level, this->NumberOfCoarseSweeps/2, false);
+      Smooth(level, this->NumberOfCoarseSweeps/2, true);
+      return;
+      }
+
+    Smooth(level, this->NumberOfSmoothingSweeps, false);
+    ComputeResidual(level);
+
+    //the coarse stencil spans twice the distance: the fine residual
+    //restricted over 8 voxels is scaled by (2h)^2/8h^2
+    Level& coarse = this->Levels[l+1];
+    coarse.B.setZero();
+    coarse.X.setZero();
+    int targets[8];
+    float weights[8];
+    for(size_t i=0; i<level.Interior.size(); ++i)
+      {
+      int g = level.Interior[i];
+      if(level.Diagonal[g]==0)
+        {
+        continue;
+        }
+      float r = 0.5f*level.R[g];
+      int n = GetCoarseWeights(level, i, coarse, targets, weights);
+      for(int k=0; k<n; ++k)
+        {
+        coarse.B[targets[k]]+= weights[k]*r;
+        }
+      }
+    this->VCycle(l+1);
+    for(size_t i=0; i<level.Interior.size(); ++i)
+      {
+      int g = level.Interior[i];
+      if(level.Diagonal[g]==0)
+        {
+        continue;
+        }
+      int n = GetCoarseWeights(level, i, coarse, targets, weights);
+      float correction(0);
+      for(int k=0; k<n; ++k)
+        {
+        correction+= weights[k]*coarse.X[targets[k]];
+        }
+      level.X[g]+= correction;
+      }
+
+    Smooth(level, this->NumberOfSmoothingSweeps, true);
+  }
+
+  mutable std::vector<Level> Levels;
+  std::vector<int> CoarseUnknowns; //grid indices of the factored unknowns of the coarsest level
+  CholeskySolver CoarseSolver;
+};
+
+//-------------------------------------------------------------------------------
+// Gauss-Seidel smoothing of the heat over a PixelShape: each interior voxel
+// gets the average of its member neighbors, the boundary voxels keep their
+// values. The voxels are visited in red-black order: the voxels of one color
+// only depend on the voxels of the other color, so that each half sweep is
+// split between threads by slabs. The voxels of one color that are
+// consecutive along x form strided runs, and their number of member
+// neighbors is precomputed.
+class RedBlackHeatSmoother
+{
+public:
+  RedBlackHeatSmoother(const PixelShape<3>& shape, const Region& region, int numThreads)
+    :Grid(region),NumberOfThreads(std::max(numThreads,1))
+  {
+    std::vector<unsigned char> member(this->Grid.GetSize(), 0);
+    std::vector<unsigned char> interior(this->Grid.GetSize(), 0);
+    for(int g=0; g<this->Grid.GetSize(); ++g)
+      {
+      Voxel voxel = this->Grid.GetVoxel(g);
+      if(region.IsInside(voxel) && shape.IsMember(voxel))
+        {
+        member[g] = 1;
+        interior[g] = shape.IsInterior(voxel);
+        this->Members.push_back(g);
+        }
+      }
+
+    this->NumNeighbors.resize(this->Grid.GetSize(), 0);
+    for(size_t i=0; i<this->Members.size(); ++i)
+      {
+      int g = this->Members[i];
+      if(!interior[g])
+        {
+        continue;
+        }
+      for(int iOff=0; iOff<6; ++iOff)
+        {
+        this->NumNeighbors[g]+= member[g+this->Grid.Offsets[iOff]];
+        }
+      if(this->NumNeighbors[g]==0)
+        {
+        std::stringstream message;
+        message<<this->Grid.GetVoxel(g)<<" has no neighbor";
+        WriteLine(std::cerr, message.str());
+        continue;
+        }
+
+      //voxels alternate colors along x: extend the run two voxels back
+      Voxel voxel = this->Grid.GetVoxel(g);
+      std::vector<VoxelRun>& runs = this->Runs[(voxel[0]+voxel[1]+voxel[2])%2];
+      if(runs.empty() || runs.back().Start+2*runs.back().Length!=g)
+        {
+        VoxelRun run;
+        run.Start = g;
+        run.Length = 0;
+        runs.push_back(run);
+        }
+      ++runs.back().Length;
+      }
+
+    for(int d=0; d<7; ++d)
+      {
+      this->InverseNumNeighbors[d] = d>0 ? 1.0f/d : 0.0f;
+      }
+
+    if(this->NumberOfThreads>1)
+      {
+      this->Threader = itk::MultiThreader::New();
+      this->Threader->SetNumberOfThreads(this->NumberOfThreads);
+      }
+  }
+
+  // Smooth heat in place with at most maxIterations sweeps. If tolerance is
+  // positive, stop as soon as the residual is below tolerance times the
+  // residual of the first sweep. Return the number of sweeps.
+  int Smooth(WeightImage::Pointer heat, int maxIterations, float tolerance)
+  {
+    this->X.setZero(this->Grid.GetSize());
+    for(size_t i=0; i<this->Members.size(); ++i)
+      {
+      int g = this->Members[i];
+      this->X[g] = std::max(heat->GetPixel(this->Grid.GetVoxel(g)), 0.0f);
+      }
+
+    int iteration(0);
+    double firstResidual(0);
+    while(iteration<maxIterations)
+      {
+      double residual = this->Sweep(0) + this->Sweep(1);
+      ++iteration;
+      if(iteration==1)
+        {
+        firstResidual = residual;
+        }
+      if(tolerance>0 && residual<=tolerance*tolerance*firstResidual)
+        {
+        break;
+        }
+      }
+
+    for(int color=0; color<2; ++color)
+      {
+      const std::vector<VoxelRun>& runs = this->Runs[color];
+      for(size_t r=0; r<runs.size(); ++r)
+        {
+        int g = runs[r].Start;
+        Voxel voxel = this->Grid.GetVoxel(g);
+        for(int i=0; i<runs[r].Length; ++i, voxel[0]+=2, g+=2)
+          {
+          heat->SetPixel(voxel, this->X[g]);
+          }
+        }
+      }
+    return iteration;
+  }
+
+private:
+  struct VoxelRun
+  {
+    int Start; //grid index of the first voxel
+    int Length; //number of voxels, every other grid voxel along x
+  };
+
+  struct SweepData
+  {
+    RedBlackHeatSmoother* Self;
+    int Color;
+    std::vector<double> Residuals; //per thread
+  };
+
+  // Relax the runs [first,last) of a color. Return the squared norm of the
+  // residual before the update.
+  double Relax(int color, size_t first, size_t last)
+  {
+    const std::vector<VoxelRun>& runs = this->Runs[color];
+    const int* o = this->Grid.Offsets;
+    const unsigned char* numNeighbors = &this->NumNeighbors[0];
+    float* x = this->X.data();
+    double residual(0);
+    for(size_t r=first; r<last; ++r)
+      {
+      int g = runs[r].Start;
+      int end = g+2*runs[r].Length;
+      for(; g<end; g+=2)
+        {
+        float sum = x[g+o[0]] + x[g+o[1]] + x[g+o[2]] + x[g+o[3]] + x[g+o[4]] + x[g+o[5]];
+        int d = numNeighbors[g];
+        float rg = sum - d*x[g];
+        residual+= rg*rg;
+        x[g] = sum*this->InverseNumNeighbors[d];
+        }
+      }
+    return residual;
+  }
+
+  double Sweep(int color)
+  {
+    if(this->NumberOfThreads==1)
+      {
+      return this->Relax(color, 0, this->Runs[color].size());
+      }
+    SweepData data;
+    data.Self = this;
+    data.Color = color;
+    data.Residuals.resize(this->NumberOfThreads, 0.0);
+    this->Threader->SetSingleMethod(RedBlackHeatSmoother::ThreadedSweep, &data);
+    this->Threader->SingleMethodExecute();
+    double residual(0);
+    for(size_t i=0; i<data.Residuals.size(); ++i)
+      {
+      residual+= data.Residuals[i];
+      }
+    return residual;
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreadedSweep(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    SweepData* data = static_cast<SweepData*>(info->UserData);
+    size_t numRuns = data->Self->Runs[data->Color].size();
+    size_t numThreads = info->NumberOfThreads;
+    size_t first = numRuns*info->ThreadID/numThreads;
+    size_t last = numRuns*(info->ThreadID+1)/numThreads;
+    data->Residuals[info->ThreadID] = data->Self->Relax(data->Color, first, last);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  VoxelGrid Grid;
+  int NumberOfThreads;
+  itk::MultiThreader::Pointer Threader; //created once, if NumberOfThreads>1
+  std::vector<int> Members; //grid indices of the interior and boundary voxels
+  std::vector<unsigned char> NumNeighbors; //0 outside of the interior voxels
+  std::vector<VoxelRun> Runs[2]; //red and black
+  float InverseNumNeighbors[7];
+  Eigen::VectorXf X; //0 outside of the members
+};
+
+//-------------------------------------------------------------------------------
+// How the heat diffusion of an armature edge is solved
+struct SolverSettings
+{
+  enum SolverType
+    {
+    Cholesky,
+    ConjugateGradient,
+    MatrixFree, //conjugate gradient on a StencilHeatDiffusion
+    Multigrid //V-cycles of a MultigridHeatDiffusion
+    };
+  enum PreconditionerType
+    {
+    Jacobi,
+    IncompleteCholesky,
+    MultigridPreconditioner
+    };
+  enum InitialGuessType
+    {
+    NoGuess,
+    VoronoiGuess, //1 over the Voronoi region of the edge, 0 elsewhere
+    PreviousGuess //weight of the edge previously solved by the same thread
+    };
+
+  SolverSettings()
+    :Solver(Cholesky),Preconditioner(IncompleteCholesky),
+     Tolerance(1e-5f),MaxIterations(1000),InitialGuess(NoGuess),NumberOfThreads(1),
+     SmoothingTolerance(0.0f)
+  {
+  }
+
+  SolverType Solver;
+  PreconditionerType Preconditioner;
+  float Tolerance;
+  int MaxIterations;
+  InitialGuessType InitialGuess;
+  int NumberOfThreads; //threads of the matrix free operator and the smoother
+  float SmoothingTolerance; //0 means always run all the smoothing iterations
+  std::string MessagePrefix; //starts the solver messages, e.g. with the edge id
+};
+
+//-------------------------------------------------------------------------------
+void WriteMultigridLevels(const MultigridHeatDiffusion& multigrid, const std::string& prefix)
+{
+  std::stringstream message;
+  message << prefix << "Multigrid: "<<multigrid.GetNumberOfLevels()<<" levels, coarsest size: "
+          <<multigrid.GetCoarsestSize();
+  WriteLine(std::cout, message.str());
+}
+
+//-------------------------------------------------------------------------------
+// Solve with the conjugate gradient and report the convergence. The multigrid
+// preconditioner is built over the domain of the heat diffusion.
+void SolveConjugateGradient(const LinearOperator& A, const Eigen::VectorXf& b,
+                            CharImage::Pointer domain, LabelImage::Pointer sourceMap,
+                            const SolverSettings& settings,
+                            Eigen::VectorXf& x) //input: initial guess, output: solution
+{
+  ConjugateGradientSolver solver;
+  solver.SetPreconditioner(settings.Preconditioner==SolverSettings::Jacobi ?
+    ConjugateGradientSolver::Jacobi : ConjugateGradientSolver::IncompleteCholesky);
+  MultigridHeatDiffusion* multigrid = 0;
+  if(settings.Preconditioner==SolverSettings::MultigridPreconditioner)
+    {
+    HeatDiffusionRegion region(domain, sourceMap);
+    multigrid = new MultigridHeatDiffusion(region, domain->GetLargestPossibleRegion());
+    WriteMultigridLevels(*multigrid, settings.MessagePrefix);
+    solver.SetPreconditioner(multigrid);
+    }
+  solver.SetTolerance(settings.Tolerance);
+  solver.SetMaxIterations(settings.MaxIterations);
+  solver.Compute(A);
+  float error;
+  int iterations = solver.Solve(b, x, error);
+  std::stringstream message;
+  message << settings.MessagePrefix << "Conjugate gradient: "<<iterations<<" iterations, relative residual: "<<error;
+  WriteLine(std::cout, message.str());
+  if(error>settings.Tolerance)
+    {
+    std::stringstream warning;
+    warning << settings.MessagePrefix << "Warning: conjugate gradient did not converge in "<<iterations<<" iterations";
+    WriteLine(std::cerr, warning.str());
+    }
+  delete multigrid;
+}
+
+//-------------------------------------------------------------------------------
+void DiffuseHeat(CharImage::Pointer domain, //a binary image that describes the domain
+                 LabelImage::Pointer sourceMap, //a label image that defines the heat sources
+                 LabelType hotSourceLabel, //any source voxel with this label will be assigned weight 1
+                                          //other source voxels are assigned weight 0
+                 const SolverSettings& settings,
+                 WeightImage::Pointer guess, //initial guess of the iterative solvers, can be null
+                 WeightImage::Pointer heat)  ////output
+{
+  if(settings.Solver==SolverSettings::Multigrid)
+    {
+    vtkNew<vtkTimerLog> timer;
+    timer->StartTimer();
+    HeatDiffusionRegion region(domain, sourceMap);
+    Region imDomain = domain->GetLargestPossibleRegion();
+    MultigridHeatDiffusion multigrid(region, imDomain);
+    WriteMultigridLevels(multigrid, settings.MessagePrefix);
+
+    //the boundary values and the initial guess
+    Region guessRegion = guess ? guess->GetLargestPossibleRegion() : Region();
+    int numHotSource(0);
+    itk::ImageRegionConstIteratorWithIndex<CharImage> it(domain,imDomain);
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      Voxel voxel = it.GetIndex();
+      if(it.Get()==0)
+        {
+        continue;
+        }
+      LabelType label = sourceMap->GetPixel(voxel);
+      float value(0);
+      if(label!=0)
+        {
+        value = label==hotSourceLabel? 1.0 : 0.0;
+        numHotSource+= label==hotSourceLabel;
+        }
+      else if(guess && guessRegion.IsInside(voxel))
+        {
+        value = std::max(guess->GetPixel(voxel), 0.0f);
+        }
+      heat->SetPixel(voxel, value);
+      }
+    std::stringstream message;
+    message << settings.MessagePrefix << "num hot: "<<numHotSource;
+    WriteLine(std::cout, message.str());
+
+    float error;
+    int cycles = multigrid.Solve(heat, settings.Tolerance, settings.MaxIterations, error);
+    message.str("");
+    message << settings.MessagePrefix << "Multigrid: "<<cycles<<" V-cycles, relative residual: "<<error;
+    WriteLine(std::cout, message.str());
+    if(error>settings.Tolerance)
+      {
+      message.str("");
+      message << settings.MessagePrefix << "Warning: multigrid did not converge in "<<cycles<<" V-cycles";
+      WriteLine(std::cerr, message.str());
+      }
+    timer->StopTimer();
+    message.str("");
+    message << settings.MessagePrefix << "Simple heat diffusion of size "<<multigrid.GetSize()
+            <<", solve time: " << timer->GetElapsedTime();
+    WriteLine(std::cout, message.str());
+    return;
+    }
+
+  if(settings.Solver==SolverSettings::MatrixFree)
+    {
+    vtkNew<vtkTimerLog> timer;
+    timer->StartTimer();
+    StencilHeatDiffusion A(domain, sourceMap, settings.NumberOfThreads);
+    Eigen::VectorXf b;
+    int numHotSource = A.GetRightHandSide(hotSourceLabel, b);
+    std::stringstream message;
+    message << settings.MessagePrefix << "Problem dimension: "<<A.GetSize()<<" in "<<A.GetNumberOfRuns()<<" runs";
+    WriteLine(std::cout, message.str());
+    message.str("");
+    message << settings.MessagePrefix << "num hot: "<<numHotSource;
+    WriteLine(std::cout, message.str());
+
+    Eigen::VectorXf xI;
+    if(guess)
+      {
+      A.GetValues(guess, xI);
+      }
+    else
+      {
+      xI.setZero(A.GetSize());
+      }
+    SolveConjugateGradient(A, b, domain, sourceMap, settings, xI);
+    timer->StopTimer();
+    message.str("");
+    message << settings.MessagePrefix << "Simple heat diffusion of size "<<A.GetSize()
+            <<", solve time: " << timer->GetElapsedTime();
+    WriteLine(std::cout, message.str());
+
+    A.SetHeat(xI, hotSourceLabel, heat);
+    return;
+    }
+
+  HeatDiffusionSystem system;
+  AssembleHeatDiffusion(domain, sourceMap, system);
+  int m = system.NumInterior;
+
+  Eigen::VectorXf xB;
+  int numHotSource = GetHeatSourceValues(system, sourceMap, hotSourceLabel, xB);
+  std::stringstream message;
+  message << settings.MessagePrefix << "Problem dimension: "<<m<<" x "<<system.NumVoxels;
+  WriteLine(std::cout, message.str());
+  message.str("");
+  message << settings.MessagePrefix << "num hot: "<<numHotSource;
+  WriteLine(std::cout, message.str());
+
+  Eigen::VectorXf b(m);
+    {
+    b = system.B*xB;
+    b*=-1.0;
+    }
+
+  // Solving:
+  Eigen::VectorXf xI(m);
+  vtkNew<vtkTimerLog> timer;
+  timer->StartTimer();
+
+  if(settings.Solver==SolverSettings::ConjugateGradient)
+    {
+    xI.setZero();
+    if(guess)
+      {
+      Region guessRegion = guess->GetLargestPossibleRegion();
+      for(int i=0; i<m; ++i)
+        {
+        const Voxel& voxel = system.ImageIndex[i];
+        if(guessRegion.IsInside(voxel))
+          {
+          xI[i] = std::max(guess->GetPixel(voxel), 0.0f);
+          }
+        }
+      }
+
+    SparseMatrixOperator A;
+    A.SetMatrix(&system.A);
+    SolveConjugateGradient(A, b, domain, sourceMap, settings, xI);
+    }
+  else
+    {
+    try
+      {
+      xI = Solve(system.A,b);
+      }
+    catch(std::bad_alloc)
+      {
+      WriteLine(std::cout, settings.MessagePrefix+"Cholesky runs out of memory, switch to conjugate gradient instead");
+      Eigen::ConjugateGradient<SpMat> solver(system.A);
+      xI= solver.solve(b);
+      }
+    }
+
+  timer->StopTimer();
+  message.str("");
+  message << settings.MessagePrefix << "Simple heat diffusion of size "<<m<<", solve time: " << timer->GetElapsedTime();
+  WriteLine(std::cout, message.str());
+
+  SetHeat(system, xI, xB, heat);
+}
+
+//-------------------------------------------------------------------------------
+class ArmatureType
+{
+public:
+  enum
+  {
+    DomainLabel = 1
+  };
+
+  enum PartitionType
+  {
+    ManhattanPartition,
+    EuclideanPartition
+  };
+
+  ArmatureType(LabelImage::Pointer image)
+    :Partition(ManhattanPartition),NumberOfThreads(1),BodyMap(image)
+  {
+    this->BodyPartition = LabelImage::New();
+    Allocate<LabelImage,LabelImage>(image, this->BodyPartition);
+  }
+  static CharType GetEdgeLabel(int i)
+  {
+    //0 is background, 1 is body interior so armature must start with 2
+    return static_cast<CharType>(i+2);
+  }
+
+  CharType GetMaxEdgeLabel() const
+  {
+    //return the last edge id
+    int lastEdge = this->GetNumberOfEdges()-1;
+    return static_cast<CharType>(ArmatureType::GetEdgeLabel(lastEdge));
+  }
+
+  PartitionType Partition; //how the body is partitioned by the edges
+  int NumberOfThreads; //of the partition
+
+  LabelImage::Pointer BodyMap;
+  LabelImage::Pointer BodyPartition; //the partition of body by armature edges
+  LabelImage::Pointer BonePartition; //the partition of bones by armature edges
+
+  std::vector<std::vector<Voxel> > SkeletonVoxels;
+  int GetNumberOfEdges() const { return SkeletonVoxels.size(); }
+  std::vector<CharImage::Pointer> Domains;
+  std::vector<Voxel> Fixed;
+  std::vector<WeightImage::Pointer> Weights;
+
+  //regionSizes[label] gives the # of body voxels in the Voronoi region of
+  //the armature edge with that label
+  void GetRegionSizes(std::vector<size_t>& regionSizes) const
+  {
+    regionSizes.assign(static_cast<size_t>(this->GetMaxEdgeLabel())+1,0);
+    itk::ImageRegionConstIterator<LabelImage> it(this->BodyPartition,
+      this->BodyPartition->GetLargestPossibleRegion());
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      size_t label = static_cast<size_t>(it.Get());
+      if(label<regionSizes.size())
+        {
+        regionSizes[label]++;
+        }
+      }
+  }
+
+  void Init(const char* fname, bool invertY)
+  {
+    vtkNew<vtkPolyDataReader> reader;
+    reader->SetFileName(fname);
+    reader->Update();
+    this->InitSkeleton(reader->GetOutput(), invertY);
+
+    this->InitBones();
+  }
+private:
+  void InitSkeleton(vtkPolyData* armPoly, bool invertY)
+  {
+    vtkCellArray* armatureSegments = armPoly->GetLines();
 
     //iterate over the edges of the armature and rasterize them
     vtkNew<vtkIdList> cell;
@@ -772,13 +2057,86 @@ private:
       }
 
     //Step 2:
-    ComputeManhattanVoronoi<LabelImage>(this->BodyPartition,0,unknown);
+    if(this->Partition==EuclideanPartition)
+      {
+      ComputeEuclideanVoronoi<LabelImage>(this->BodyPartition,0,unknown,this->NumberOfThreads);
+      this->RemoveDetachedPieces();
+      }
+    else
+      {
+      ComputeManhattanVoronoi<LabelImage>(this->BodyPartition,0,unknown);
+      }
     if(DumpSegmentationImages)
       {
       WriteImage<LabelImage>(this->BodyPartition,"./bodypartition.mha");
       }
   }
 
+  // A Euclidean Voronoi cell can be split by the concavities of the body.
+  // Keep the piece of each cell that holds the voxels of its armature edge
+  // and give the other pieces to the neighboring cells.
+  void RemoveDetachedPieces()
+  {
+    Region imDomain = this->BodyPartition->GetLargestPossibleRegion();
+    Neighborhood<3> neighbors;
+    const VoxelOffset* offsets = neighbors.Offsets;
+
+    CharImage::Pointer attached = CharImage::New();
+    Allocate<LabelImage,CharImage>(this->BodyPartition, attached);
+    attached->FillBuffer(0);
+    std::vector<bool> hasEdgeVoxels(static_cast<size_t>(this->GetMaxEdgeLabel())+1, false);
+    for(int edgeId=0; edgeId<this->GetNumberOfEdges(); ++edgeId)
+      {
+      LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+      std::vector<Voxel> bd;
+      const std::vector<Voxel>& edgeVoxels = this->SkeletonVoxels[edgeId];
+      for(std::vector<Voxel>::const_iterator vi=edgeVoxels.begin(); vi!=edgeVoxels.end(); ++vi)
+        {
+        if(this->BodyPartition->GetPixel(*vi)==label && attached->GetPixel(*vi)==0)
+          {
+          attached->SetPixel(*vi, 1);
+          bd.push_back(*vi);
+          }
+        }
+      hasEdgeVoxels[label] = !bd.empty();
+      while(!bd.empty())
+        {
+        Voxel p = bd.back();
+        bd.pop_back();
+        for(int iOff=0; iOff<6; ++iOff)
+          {
+          Voxel q = p + offsets[iOff];
+          if(imDomain.IsInside(q) && attached->GetPixel(q)==0
+             && this->BodyPartition->GetPixel(q)==label)
+            {
+            attached->SetPixel(q, 1);
+            bd.push_back(q);
+            }
+          }
+        }
+      }
+
+    //the cells of the edges without voxels in the body are kept whole
+    LabelType unknown = ArmatureType::GetEdgeLabel(-1);
+    int numDetached(0);
+    itk::ImageRegionIteratorWithIndex<LabelImage> it(this->BodyPartition, imDomain);
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      size_t label = static_cast<size_t>(it.Get());
+      if(label<hasEdgeVoxels.size() && hasEdgeVoxels[label] && attached->GetPixel(it.GetIndex())==0)
+        {
+        it.Set(unknown);
+        ++numDetached;
+        }
+      }
+    attached = 0;
+    if(numDetached>0)
+      {
+      std::cout << "Give "<<numDetached<<" voxels of detached Voronoi pieces to their neighbors" << std::endl;
+      ComputeManhattanVoronoi<LabelImage>(this->BodyPartition,0,unknown);
+      }
+  }
+
   void InitBones()
   {
     Region imDomain = this->BodyMap->GetLargestPossibleRegion();
@@ -964,101 +2322,394 @@ private:
 
 
 //-------------------------------------------------------------------------------
-class ArmatureEdge
+// Allocate a weight image over the given region that is 0 over the body and
+// -1 over the background
+WeightImage::Pointer NewWeightImage(LabelImage::Pointer bodyMap, const Region& region)
+{
+  WeightImage::Pointer weight = WeightImage::New();
+  Allocate<LabelImage,WeightImage>(bodyMap, weight, region);
+
+  int numBackground(0);
+  for(itk::ImageRegionIteratorWithIndex<LabelImage> it(bodyMap,region);
+      !it.IsAtEnd(); ++it)
+    {
+    if(it.Get()>0)
+      {
+      weight->SetPixel(it.GetIndex(),0.0);
+      }
+    else
+      {
+      weight->SetPixel(it.GetIndex(),-1.0f);
+      ++numBackground;
+      }
+    }
+  std::cout << numBackground<<" background voxel" << std::endl;
+  return weight;
+}
+
+//-------------------------------------------------------------------------------
+// Paste a cropped weight image into a weight image of the whole body map
+WeightImage::Pointer UncropWeight(WeightImage::Pointer weight, LabelImage::Pointer bodyMap)
+{
+  Region allRegion = bodyMap->GetLargestPossibleRegion();
+  Region region = weight->GetLargestPossibleRegion();
+  if(region==allRegion)
+    {
+    return weight;
+    }
+  WeightImage::Pointer fullWeight = NewWeightImage(bodyMap, allRegion);
+  itk::ImageRegionIteratorWithIndex<WeightImage> it(weight,region);
+  for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+    {
+    fullWeight->SetPixel(it.GetIndex(), it.Get());
+    }
+  return fullWeight;
+}
+
+//-------------------------------------------------------------------------------
+// The domains of a set of armature edges, grown at once: the domain of an edge
+// is the set of body voxels within expansionDistance-1 steps of its Voronoi
+// region. The expansion is a breadth first search where each voxel records
+// the edges that already reached it, in a few slots per voxel of the body
+// bounding box plus an overflow map for the voxels reached by many edges.
+// Each domain is kept as the list of its voxels and its bounding box. The
+// voxels are offsets in the body bounding box, stored on 32 bits unless the
+// box has too many voxels.
+class EdgeDomains
 {
 public:
-  ArmatureEdge(ArmatureType& armature, int id): Armature(armature),Id(id)
+  EdgeDomains(const ArmatureType& armature, const std::vector<int>& edges, int expansionDistance)
+    :Armature(armature),Memory(0)
   {
-    this->Domain = CharImage::New();
-    Allocate<LabelImage,CharImage>(armature.BodyMap, this->Domain);
-    this->Domain->FillBuffer(0);
+    LabelImage::Pointer partition = armature.BodyPartition;
+    Region imDomain = partition->GetLargestPossibleRegion();
+    for(int i=0; i<3; ++i)
+      {
+      this->Size[i] = imDomain.GetSize()[i];
+      }
+    size_t numVoxels = imDomain.GetNumberOfPixels();
+    const LabelType* labels = partition->GetBufferPointer();
+
+    //the bounding box of the body, which contains all the domains
+    LabelType unknown = ArmatureType::GetEdgeLabel(-1);
+    size_t bodyMin[3] = {this->Size[0], this->Size[1], this->Size[2]};
+    size_t bodyMax[3] = {0, 0, 0};
+    for(size_t i=0; i<numVoxels; ++i)
+      {
+      if(labels[i]>=unknown)
+        {
+        size_t coords[3] = {i%this->Size[0], (i/this->Size[0])%this->Size[1], i/(this->Size[0]*this->Size[1])};
+        for(int dim=0; dim<3; ++dim)
+          {
+          bodyMin[dim] = std::min(bodyMin[dim], coords[dim]);
+          bodyMax[dim] = std::max(bodyMax[dim], coords[dim]);
+          }
+        }
+      }
+    itk::uint64_t numBodyBoxVoxels(1);
+    for(int dim=0; dim<3; ++dim)
+      {
+      this->BodyBoxMin[dim] = bodyMin[dim];
+      this->BodyBoxSize[dim] = bodyMax[dim]>=bodyMin[dim] ? bodyMax[dim]-bodyMin[dim]+1 : 0;
+      numBodyBoxVoxels*= this->BodyBoxSize[dim];
+      }
+    this->WideOffsets = numBodyBoxVoxels>std::numeric_limits<itk::uint32_t>::max();
+
+    size_t numLabels = static_cast<size_t>(armature.GetMaxEdgeLabel())+1;
+    if(this->WideOffsets)
+      {
+      this->WideVoxels.resize(numLabels);
+      }
+    else
+      {
+      this->Voxels.resize(numLabels);
+      }
+    this->BoxMin.resize(numLabels);
+    this->BoxMax.resize(numLabels);
+    std::vector<bool> selected(numLabels,false);
+    for(size_t i=0; i<edges.size(); ++i)
+      {
+      selected[ArmatureType::GetEdgeLabel(edges[i])] = true;
+      }
+
+    //the Voronoi regions
+    typedef std::vector<std::pair<size_t,LabelType> > Frontier;
+    Frontier frontier;
+    for(size_t i=0; i<numVoxels; ++i)
+      {
+      LabelType label = labels[i];
+      if(label<numLabels && selected[label])
+        {
+        this->Add(i,label);
+        frontier.push_back(std::make_pair(i,label));
+        }
+      }
+
+    //grow by distance, the slots and the overflow are only needed meanwhile
+    std::vector<LabelType> slots;
+    Overflow overflow;
+    if(expansionDistance>1)
+      {
+      slots.resize(NumberOfSlots*numBodyBoxVoxels, 0);
+      }
+    size_t strides[3] = {1, this->Size[0], this->Size[0]*this->Size[1]};
+    for(int dist=2; dist<=expansionDistance; ++dist)
+      {
+      Frontier newFrontier;
+      for(Frontier::const_iterator it=frontier.begin(); it!=frontier.end(); ++it)
+        {
+        size_t p = it->first;
+        LabelType label = it->second;
+        size_t coords[3] = {p%this->Size[0], (p/this->Size[0])%this->Size[1], p/strides[2]};
+        for(int i=0; i<3; ++i)
+          {
+          for(int side=0; side<2; ++side)
+            {
+            if(side==0 ? coords[i]==0 : coords[i]+1==this->Size[i])
+              {
+              continue;
+              }
+            size_t q = side==0 ? p-strides[i] : p+strides[i];
+            if(labels[q]>=unknown && labels[q]!=label && this->Mark(slots, overflow, q, label))
+              {
+              this->Add(q,label);
+              newFrontier.push_back(std::make_pair(q,label));
+              }
+            }
+          }
+        }
+      frontier.swap(newFrontier);
+      }
+    std::stringstream message;
+    message << "Edge domains: "<<overflow.size()<<" voxels in more than "
+            <<static_cast<int>(NumberOfSlots)<<" expanded domains";
+    WriteLine(std::cout, message.str());
+
+    //the lists grew by doubling, keep what they use only
+    for(size_t label=0; label<numLabels; ++label)
+      {
+      if(this->WideOffsets)
+        {
+        std::vector<itk::uint64_t>(this->WideVoxels[label]).swap(this->WideVoxels[label]);
+        }
+      else
+        {
+        std::vector<itk::uint32_t>(this->Voxels[label]).swap(this->Voxels[label]);
+        }
+      this->Memory+= this->GetListMemory(static_cast<LabelType>(label));
+      }
+  }
+
+  size_t GetNumberOfVoxels(int edgeId) const
+  {
+    LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+    return this->WideOffsets ? this->WideVoxels[label].size() : this->Voxels[label].size();
+  }
+
+  // The k-th voxel of the domain of an edge
+  Voxel GetVoxel(int edgeId, size_t k) const
+  {
+    LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+    itk::uint64_t offset = this->WideOffsets ? this->WideVoxels[label][k] : this->Voxels[label][k];
+    Voxel voxel = this->Armature.BodyMap->GetLargestPossibleRegion().GetIndex();
+    voxel[0]+= this->BodyBoxMin[0] + offset%this->BodyBoxSize[0];
+    voxel[1]+= this->BodyBoxMin[1] + (offset/this->BodyBoxSize[0])%this->BodyBoxSize[1];
+    voxel[2]+= this->BodyBoxMin[2] + offset/(this->BodyBoxSize[0]*this->BodyBoxSize[1]);
+    return voxel;
+  }
+
+  Region GetBoundingBox(int edgeId) const
+  {
+    LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+    Region box;
+    if(this->GetNumberOfVoxels(edgeId)==0)
+      {
+      return box;
+      }
+    Voxel start = this->Armature.BodyMap->GetLargestPossibleRegion().GetIndex();
+    Region::SizeType size;
+    for(int i=0; i<3; ++i)
+      {
+      size[i] = this->BoxMax[label][i]-this->BoxMin[label][i]+1;
+      start[i]+= this->BoxMin[label][i];
+      }
+    box.SetIndex(start);
+    box.SetSize(size);
+    return box;
+  }
+
+  // Memory (in bytes) held by the voxel list of an edge, until it is released
+  itk::uint64_t GetMemory(int edgeId) const
+  {
+    return this->GetListMemory(ArmatureType::GetEdgeLabel(edgeId));
+  }
+
+  // Memory (in bytes) held by the voxel lists after the construction
+  itk::uint64_t GetMemory() const
+  {
+    return this->Memory;
+  }
+
+  // Free the voxel list of an edge. Different edges can be released
+  // concurrently.
+  void Release(int edgeId)
+  {
+    LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+    if(this->WideOffsets)
+      {
+      std::vector<itk::uint64_t>().swap(this->WideVoxels[label]);
+      }
+    else
+      {
+      std::vector<itk::uint32_t>().swap(this->Voxels[label]);
+      }
+  }
+
+private:
+  enum
+  {
+    NumberOfSlots = 4
   };
+  typedef std::map<itk::uint64_t, std::vector<LabelType> > Overflow; //labels that do not fit in the slots
 
-  void Initialize(int expansionDistance)
+  // Offset of voxel p, an offset in the body map buffer, in the body
+  // bounding box
+  itk::uint64_t GetBodyBoxOffset(size_t p) const
   {
-    Region imDomain = Armature.BodyMap->GetLargestPossibleRegion();
+    itk::uint64_t x = p%this->Size[0] - this->BodyBoxMin[0];
+    itk::uint64_t y = (p/this->Size[0])%this->Size[1] - this->BodyBoxMin[1];
+    itk::uint64_t z = p/(this->Size[0]*this->Size[1]) - this->BodyBoxMin[2];
+    return x + this->BodyBoxSize[0]*(y + this->BodyBoxSize[1]*z);
+  }
 
-    //Compute the "domain" of the armature edge
-    // by expanding fixed distance around the Voronoi region
-    itk::ImageRegionIteratorWithIndex<CharImage> it(this->Domain,imDomain);
-    int regionSize = 0;
+  itk::uint64_t GetListMemory(LabelType label) const
+  {
+    return this->WideOffsets ? 8*static_cast<itk::uint64_t>(this->WideVoxels[label].capacity())
+      : 4*static_cast<itk::uint64_t>(this->Voxels[label].capacity());
+  }
 
-    //start with the Vorononi region
-    CharType label = this->GetLabel();
-    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+  // Record that label reached voxel q, a body voxel. Return false if it
+  // already had.
+  bool Mark(std::vector<LabelType>& slots, Overflow& overflow, size_t q, LabelType label)
+  {
+    itk::uint64_t slot = this->GetBodyBoxOffset(q);
+    LabelType* voxelSlots = &slots[NumberOfSlots*slot];
+    for(int i=0; i<NumberOfSlots; ++i)
       {
-      if(this->Armature.BodyPartition->GetPixel(it.GetIndex())==label)
+      if(voxelSlots[i]==label)
+        {
+        return false;
+        }
+      if(voxelSlots[i]==0)
         {
-        it.Set(ArmatureType::DomainLabel);
-        ++regionSize;
+        voxelSlots[i] = label;
+        return true;
         }
       }
-    std::cout << "Voronoi region size: "<<regionSize << std::endl;
-    assert(NumConnectedComponents<CharImage>(this->Domain)==1);
+    std::vector<LabelType>& labels = overflow[slot];
+    if(std::find(labels.begin(), labels.end(), label)!=labels.end())
+      {
+      return false;
+      }
+    labels.push_back(label);
+    return true;
+  }
 
-    LabelType unknown = ArmatureType::GetEdgeLabel(-1);
-    regionSize+=Expand(this->Armature.BodyPartition, this->GetLabel(), unknown, expansionDistance,
-                       this->Domain,ArmatureType::DomainLabel);
+  void Add(size_t p, LabelType label)
+  {
+    size_t coords[3] = {p%this->Size[0], (p/this->Size[0])%this->Size[1], p/(this->Size[0]*this->Size[1])};
+    bool empty = this->WideOffsets ? this->WideVoxels[label].empty() : this->Voxels[label].empty();
+    for(int i=0; i<3; ++i)
+      {
+      this->BoxMin[label][i] = empty ? coords[i] : std::min(this->BoxMin[label][i], coords[i]);
+      this->BoxMax[label][i] = empty ? coords[i] : std::max(this->BoxMax[label][i], coords[i]);
+      }
+    itk::uint64_t offset = this->GetBodyBoxOffset(p);
+    if(this->WideOffsets)
+      {
+      this->WideVoxels[label].push_back(offset);
+      }
+    else
+      {
+      this->Voxels[label].push_back(static_cast<itk::uint32_t>(offset));
+      }
+  }
+
+  struct Coordinates
+  {
+    size_t Value[3];
+    size_t& operator[](int i){ return this->Value[i];}
+    size_t operator[](int i) const { return this->Value[i];}
+  };
+
+  const ArmatureType& Armature;
+  size_t Size[3];
+  size_t BodyBoxMin[3], BodyBoxSize[3]; //bounding box of the body voxels
+  bool WideOffsets; //the body box has more than 2^32-1 voxels
+  std::vector<std::vector<itk::uint32_t> > Voxels; //by edge label, unless WideOffsets
+  std::vector<std::vector<itk::uint64_t> > WideVoxels; //by edge label, if WideOffsets
+  std::vector<Coordinates> BoxMin, BoxMax; //by edge label
+  itk::uint64_t Memory;
+};
+
+//-------------------------------------------------------------------------------
+// Region of the weight of an edge whose domain has the bounding box roi. A
+// red-black sweep moves the heat by 2 voxels at most, so the smoothing
+// iterations never reach the border of the region, whose voxels miss
+// neighbors: the weights are the ones of a smoothing over the whole body,
+// cropped or not. The multigrid V-cycles reach any voxel of the region, the
+// region bounds their smoothing instead.
+Region GetWeightRegion(const Region& roi, bool binaryWeight, int smoothingIterations, const Region& bounds)
+{
+  return PadRegion(roi, binaryWeight? 0 : 2*smoothingIterations+1, bounds);
+}
 
-    typedef itk::ImageFileWriter<CharImage> WriterType;
-    WriterType::Pointer writer = WriterType::New();
-    writer->SetFileName( "./region.mha");
-    writer->SetInput(this->Domain);
-    writer->SetUseCompression(1);
-    writer->Update();
+//-------------------------------------------------------------------------------
+class ArmatureEdge
+{
+public:
+  ArmatureEdge(const ArmatureType& armature, int id): Armature(armature),Id(id),DomainSize(0)
+  {
+  };
 
-    //Debug
-    std::cout << "Region size after expanding "<<expansionDistance<<" : "<<regionSize << std::endl;
+  void Initialize(const EdgeDomains& domains)
+  {
+    this->DomainSize = static_cast<int>(domains.GetNumberOfVoxels(this->Id));
+    std::stringstream message;
+    message << this->GetMessagePrefix() << "Domain size: "<<this->DomainSize;
+    WriteLine(std::cout, message.str());
 
-    Voxel bbMin, bbMax;
-    for(int i=0; i<3; ++i)
+    this->ROI = domains.GetBoundingBox(this->Id);
+    this->Domain = CharImage::New();
+    Allocate<LabelImage,CharImage>(this->Armature.BodyMap, this->Domain, this->ROI);
+    this->Domain->FillBuffer(0);
+    for(int k=0; k<this->DomainSize; ++k)
       {
-      bbMin[i] = imDomain.GetSize()[i]-1;
-      bbMax[i] = 0;
+      this->Domain->SetPixel(domains.GetVoxel(this->Id, k), ArmatureType::DomainLabel);
       }
-    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+    message.str("");
+    message << this->GetMessagePrefix() << "Domain bounding box: "<<this->ROI.GetIndex()<<" "<<this->ROI.GetUpperIndex();
+    WriteLine(std::cout, message.str());
+
+    if(DumpSegmentationImages)
       {
-      Voxel p  = it.GetIndex();
-      if(it.Get()==0)
-        {
-        continue;
-        }
-      for(int i=0; i<3; ++i)
-        {
-        if(p[i]<bbMin[i])
-          {
-          bbMin[i] = p[i];
-          }
-        if(p[i]>bbMax[i])
-          {
-          bbMax[i] = p[i];
-          }
-        }
+      std::stringstream filename;
+      filename<<"./region_"<<this->Id<<".mha";
+      WriteImage<CharImage>(this->Domain,filename.str().c_str());
       }
-    std::cout << "Domain bounding box: "<<bbMin<<" "<<bbMax << std::endl;
   }
 
-  WeightImage::Pointer ComputeWeight(bool binaryWeight, int smoothingIterations)
+  // The returned weight image only covers the region of GetWeightRegion()
+  WeightImage::Pointer ComputeWeight(bool binaryWeight, int smoothingIterations,
+                                     const SolverSettings& settings,
+                                     WeightImage::Pointer previousWeight)
   {
-    std::cout << "Compute weight for edge "<<this->Id<<" with label "<<(int)this->GetLabel() << std::endl;
-    WeightImage::Pointer weight = WeightImage::New();
-    Allocate<LabelImage,WeightImage>(this->Armature.BodyMap, weight);
-
-    int numBackground(0);
-    for(itk::ImageRegionIteratorWithIndex<LabelImage> it(this->Armature.BodyMap,this->Armature.BodyMap->GetLargestPossibleRegion());
-        !it.IsAtEnd(); ++it)
-      {
-      if(it.Get()>0)
-        {
-        weight->SetPixel(it.GetIndex(),0.0);
-        }
-      else
-        {
-        weight->SetPixel(it.GetIndex(),-1.0f);
-        ++numBackground;
-        }
-      }
-    std::cout << numBackground<<" background voxel" << std::endl;
+    std::stringstream message;
+    message << this->GetMessagePrefix() << "Compute weight with label "<<(int)this->GetLabel();
+    WriteLine(std::cout, message.str());
+    Region imDomain = this->Armature.BodyMap->GetLargestPossibleRegion();
+    Region weightRegion = GetWeightRegion(this->ROI, binaryWeight, smoothingIterations, imDomain);
+    WeightImage::Pointer weight = NewWeightImage(this->Armature.BodyMap, weightRegion);
 
     if(binaryWeight)
       {
@@ -1073,19 +2724,145 @@ public:
       }
     else
       {
-      DiffuseHeat(this->Domain, this->Armature.BonePartition, this->GetLabel(), weight);
-      BodyDiffusionRegion diffusionRegion(this->Armature.BodyMap,this->Armature.BonePartition);
-      DiffuseHeatIteratively<WeightImage>(weight,diffusionRegion, smoothingIterations);
+      SolverSettings edgeSettings = settings;
+      edgeSettings.MessagePrefix = this->GetMessagePrefix();
+      WeightImage::Pointer guess;
+      if(settings.InitialGuess==SolverSettings::VoronoiGuess)
+        {
+        guess = this->NewVoronoiWeight();
+        }
+      else if(settings.InitialGuess==SolverSettings::PreviousGuess)
+        {
+        guess = previousWeight;
+        }
+      DiffuseHeat(this->Domain, this->Armature.BonePartition, this->GetLabel(),
+                  edgeSettings, guess, weight);
+      guess = 0;
+      BodyDiffusionRegion diffusionRegion(this->Armature.BodyMap,this->Armature.BonePartition, weightRegion);
+      if(settings.Solver==SolverSettings::Multigrid)
+        {
+        //each V-cycle smooths the whole region instead of a few voxels
+        MultigridHeatDiffusion multigrid(diffusionRegion, weightRegion);
+        WriteMultigridLevels(multigrid, edgeSettings.MessagePrefix);
+        float error;
+        int cycles = multigrid.Solve(weight, 0.0f, smoothingIterations, error);
+        message.str("");
+        message << edgeSettings.MessagePrefix << "Smooth with "<<cycles<<" V-cycles, relative residual: "<<error;
+        WriteLine(std::cout, message.str());
+        }
+      else
+        {
+        RedBlackHeatSmoother smoother(diffusionRegion, weightRegion, settings.NumberOfThreads);
+        int sweeps = smoother.Smooth(weight, smoothingIterations, settings.SmoothingTolerance);
+        message.str("");
+        message << edgeSettings.MessagePrefix << "Smooth with "<<sweeps<<" red-black sweeps";
+        WriteLine(std::cout, message.str());
+        }
       }
 
     return weight;
   }
   CharType GetLabel() const{ return this->Armature.GetEdgeLabel(this->Id);}
+  int GetDomainSize() const{ return this->DomainSize;}
+  const Region& GetRegion() const{ return this->ROI;}
+
+  // Starts the messages about the edge, which can be mixed with the ones of
+  // the edges processed by other threads
+  std::string GetMessagePrefix() const
+  {
+    std::stringstream prefix;
+    prefix<<"Edge "<<this->Id<<": ";
+    return prefix.str();
+  }
 private:
+  // Binary weight of the Voronoi region over the domain bounding box
+  WeightImage::Pointer NewVoronoiWeight() const
+  {
+    WeightImage::Pointer voronoi = WeightImage::New();
+    Allocate<CharImage,WeightImage>(this->Domain, voronoi, this->ROI);
+    CharType label = this->GetLabel();
+    itk::ImageRegionIteratorWithIndex<WeightImage> it(voronoi,this->ROI);
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      it.Set(this->Armature.BodyPartition->GetPixel(it.GetIndex())==label? 1.0 : 0.0);
+      }
+    return voronoi;
+  }
+
   const ArmatureType& Armature;
   int Id;
   CharImage::Pointer Domain;
   Region ROI;
+  int DomainSize;
+};
+
+//-------------------------------------------------------------------------------
+// Heat diffusion of all the armature edges over the whole body. The Laplacian
+// is assembled and factored once; the weight of each edge is one right hand
+// side of the same system. Because the boundary values of the edges sum to 1
+// on every bone voxel, the weights are a partition of unity.
+class GlobalHeatDiffusion
+{
+public:
+  GlobalHeatDiffusion(const ArmatureType& armature): Armature(armature),Factorized(false)
+  {
+    //The domain is the part of the body reached by the Voronoi partition,
+    //i.e. connected to the armature
+    CharImage::Pointer domain = CharImage::New();
+    Allocate<LabelImage,CharImage>(armature.BodyMap, domain);
+    LabelType minLabel = ArmatureType::GetEdgeLabel(0);
+    itk::ImageRegionIteratorWithIndex<CharImage> it(domain,domain->GetLargestPossibleRegion());
+    for(it.GoToBegin(); !it.IsAtEnd(); ++it)
+      {
+      bool inside = armature.BodyPartition->GetPixel(it.GetIndex())>=minLabel;
+      it.Set(inside? ArmatureType::DomainLabel : 0);
+      }
+
+    AssembleHeatDiffusion(domain, armature.BonePartition, this->System);
+
+    vtkNew<vtkTimerLog> timer;
+    timer->StartTimer();
+    this->Factorized = this->Solver.Factorize(this->System.A);
+    timer->StopTimer();
+    std::cout << "Global heat diffusion of size "<<this->System.NumInterior
+              <<", factorization time: " << timer->GetElapsedTime() << std::endl;
+  }
+
+  WeightImage::Pointer ComputeWeight(int edgeId) const
+  {
+    LabelType label = ArmatureType::GetEdgeLabel(edgeId);
+    std::stringstream message;
+    message << "Edge "<<edgeId<<": Compute global weight with label "<<(int)label;
+    WriteLine(std::cout, message.str());
+
+    Eigen::VectorXf xB;
+    GetHeatSourceValues(this->System, this->Armature.BonePartition, label, xB);
+    Eigen::VectorXf b = this->System.B*xB;
+    b*=-1.0;
+    Eigen::VectorXf xI = this->Solver.Solve(b);
+
+    WeightImage::Pointer weight = NewWeightImage(this->Armature.BodyMap,
+                                                 this->Armature.BodyMap->GetLargestPossibleRegion());
+    SetHeat(this->System, xI, xB, weight);
+    return weight;
+  }
+
+  // False if the Laplacian could not be factored, ComputeWeight() must not
+  // be called then
+  bool IsFactorized() const { return this->Factorized;}
+
+  // Memory (in bytes) needed by ComputeWeight()
+  itk::uint64_t EstimateEdgeMemory() const
+  {
+    return 4*static_cast<itk::uint64_t>(this->Armature.BodyMap->GetLargestPossibleRegion().GetNumberOfPixels())
+      + 12*static_cast<itk::uint64_t>(this->System.NumVoxels);
+  }
+
+private:
+  const ArmatureType& Armature;
+  HeatDiffusionSystem System;
+  CholeskySolver Solver;
+  bool Factorized;
 };
 
 //-------------------------------------------------------------------------------
@@ -1131,6 +2908,399 @@ void RemoveSingleVoxelIsland(LabelImage::Pointer labelMap)
     }
 }
 
+//-------------------------------------------------------------------------------
+// Rough upper bound (in bytes) of the memory used to compute the weight of an
+// armature edge whose domain has domainSize voxels within a box of numVoxels,
+// rounded up to whole bytes
+itk::uint64_t EstimateEdgeMemory(size_t numVoxels, size_t domainSize, const SolverSettings& settings)
+{
+  double n = static_cast<double>(domainSize);
+  double memory = 9.0*numVoxels; //domain, weight and matrix index images
+  memory+= 24.0*numVoxels; //interior voxels of the smoothing pass
+  if(settings.Solver==SolverSettings::Multigrid
+     || settings.Preconditioner==SolverSettings::MultigridPreconditioner)
+    {
+    memory+= 24.0*numVoxels; //grids of all the levels
+    }
+  if(settings.Solver==SolverSettings::MatrixFree)
+    {
+    memory+= 8.0*numVoxels; //scratch grid and initial guess
+    memory+= 40.0*n; //diagonal, runs and conjugate gradient vectors
+    }
+  else if(settings.Solver!=SolverSettings::Multigrid)
+    {
+    memory+= 200.0*n; //triplets, sparse matrices and right hand sides
+    if(settings.Solver==SolverSettings::Cholesky)
+      {
+      memory+= 8.0*pow(n,4.0/3.0); //fill-in of the Cholesky factor on a 3D grid
+      }
+    else
+      {
+      memory+= 4.0*numVoxels; //initial guess
+      }
+    }
+  return static_cast<itk::uint64_t>(ceil(memory));
+}
+
+//-------------------------------------------------------------------------------
+// The body voxels of the 2x2x2 cells around the vertices of a surface, which
+// are the voxels PoseBody and EvalWeight interpolate the vertex weights from,
+// dilated by a radius. The weights of the edges are only kept on these voxels
+// and written at once to a weight map file. The weights of an edge are set by
+// a single thread.
+class SurfaceBand
+{
+public:
+  SurfaceBand(LabelImage::Pointer bodyMap, vtkPoints* points, bool invertY, int radius, int numEdges)
+    :Weights(numEdges)
+  {
+    Region region = bodyMap->GetLargestPossibleRegion();
+    CharImage::Pointer band = CharImage::New();
+    Allocate<LabelImage,CharImage>(bodyMap, band);
+    band->FillBuffer(0);
+
+    Region::SizeType cellSize;
+    cellSize.Fill(2);
+    for(vtkIdType pi=0; pi<points->GetNumberOfPoints(); ++pi)
+      {
+      double xraw[3];
+      points->GetPoint(pi,xraw);
+      if(invertY)
+        {
+        xraw[1]*=-1;
+        }
+      itk::Point<double,3> x(xraw);
+      itk::ContinuousIndex<double,3> coord;
+      bodyMap->TransformPhysicalPointToContinuousIndex(x, coord);
+      Voxel p;
+      p.CopyWithCast(coord);
+
+      Region cell(p, cellSize);
+      cell.PadByRadius(radius);
+      if(!cell.Crop(region))
+        {
+        continue;
+        }
+      for(itk::ImageRegionIteratorWithIndex<CharImage> it(band,cell); !it.IsAtEnd(); ++it)
+        {
+        it.Set(bodyMap->GetPixel(it.GetIndex())>0);
+        }
+      }
+    for(itk::ImageRegionIteratorWithIndex<CharImage> it(band,region); !it.IsAtEnd(); ++it)
+      {
+      if(it.Get())
+        {
+        this->Voxels.push_back(it.GetIndex());
+        }
+      }
+
+    //the geometry of the weight images, see Allocate()
+    this->Geometry = WeightImage::New();
+    this->Geometry->SetOrigin(bodyMap->GetOrigin());
+    this->Geometry->SetSpacing(bodyMap->GetSpacing());
+    this->Geometry->SetRegions(region);
+  }
+
+  size_t GetNumberOfVoxels() const
+  {
+    return this->Voxels.size();
+  }
+
+  // Keep the non zero weights of an edge on the band, the weight image can
+  // be cropped
+  void SetWeight(int edgeId, WeightImage::Pointer weight)
+  {
+    Region region = weight->GetLargestPossibleRegion();
+    BandWeights& weights = this->Weights[edgeId];
+    weights.clear();
+    for(size_t j=0; j<this->Voxels.size(); ++j)
+      {
+      if(region.IsInside(this->Voxels[j]))
+        {
+        float value = weight->GetPixel(this->Voxels[j]);
+        if(value>0)
+          {
+          weights.push_back(std::make_pair(j, value));
+          }
+        }
+      }
+    BandWeights(weights).swap(weights);
+  }
+
+  // Write the weights of all the edges, edge i is the site i of the map
+  bool Write(const std::string& fname, bender::WeightValueType valueType) const
+  {
+    int numSites = static_cast<int>(this->Weights.size());
+    size_t siteIndexSize = bender::GetSiteIndexSize(numSites);
+    if(siteIndexSize==0)
+      {
+      std::cerr << "Too many edges for a weight map: " << numSites << std::endl;
+      return false;
+      }
+    WriteWeights write;
+    write.Band = this;
+    write.Domain = bender::DomainMask::New();
+    write.Domain->Init(this->Geometry, this->Voxels);
+    write.FileName = fname;
+    return bender::DispatchWeightMap(siteIndexSize, valueType, write);
+  }
+
+private:
+  typedef std::vector<std::pair<size_t,float> > BandWeights; //voxel and weight
+
+  // Fill a weight map of the type chosen at run time and write it
+  struct WriteWeights
+  {
+    const SurfaceBand* Band;
+    bender::DomainMask::Pointer Domain;
+    std::string FileName;
+
+    template<class WeightMapType>
+    bool operator()(WeightMapType& weightMap)
+    {
+      const std::vector<Voxel>& voxels = this->Band->Voxels;
+      weightMap.Init(voxels, this->Band->Geometry->GetLargestPossibleRegion());
+      for(size_t i=0; i<this->Band->Weights.size(); ++i)
+        {
+        typename WeightMapType::SiteIndex site = static_cast<typename WeightMapType::SiteIndex>(i);
+        const BandWeights& weights = this->Band->Weights[i];
+        for(size_t k=0; k<weights.size(); ++k)
+          {
+          weightMap.Insert(voxels[weights[k].first], site, weights[k].second);
+          }
+        }
+      weightMap.Finalize();
+      std::cout << "Write the weights of "<<voxels.size()<<" band voxels to "<<this->FileName << std::endl;
+      return bender::WriteWeightMap(this->FileName, weightMap, this->Domain.GetPointer(),
+                                    static_cast<int>(this->Band->Weights.size()));
+    }
+  };
+
+  std::vector<Voxel> Voxels;
+  WeightImage::Pointer Geometry; //not allocated
+  std::vector<BandWeights> Weights; //of each edge
+};
+
+//-------------------------------------------------------------------------------
+// Compute the weights of a set of armature edges on a pool of threads.
+// The edges are processed in decreasing order of their Voronoi region size so
+// that the largest problems start first and the small ones fill the gaps at
+// the end. Each thread works on its own ArmatureEdge (and therefore on its
+// own images) and reserves the estimated memory of the edge before allocating
+// them: it waits while other edges run and the reservation would exceed
+// MaximumMemory. The voxel lists of the edge domains not processed yet count
+// against MaximumMemory too. With a surface band, the weights are kept on the
+// band instead of being written to the weight directory.
+class EdgeScheduler
+{
+public:
+  EdgeScheduler(const ArmatureType& armature, const std::vector<int>& edges)
+    :MaximumMemory(0),BinaryWeight(false),SmoothingIteration(0),
+     CropWeights(false),NumDigits(1),GlobalDiffusion(0),Domains(0),Band(0),Armature(armature),Edges(edges),NextEdge(0),
+     ReservedMemory(0),DomainsMemory(0),RunningEdges(0),NumberOfFailures(0)
+  {
+    Region region = armature.BodyMap->GetLargestPossibleRegion();
+    this->NumberOfVoxels = region.GetNumberOfPixels();
+
+    std::vector<size_t> regionSizes;
+    armature.GetRegionSizes(regionSizes);
+
+    //biggest domains first
+    std::vector<std::pair<size_t,int> > order;
+    for(size_t i=0; i<this->Edges.size(); ++i)
+      {
+      size_t label = static_cast<size_t>(ArmatureType::GetEdgeLabel(this->Edges[i]));
+      order.push_back(std::make_pair(regionSizes[label], this->Edges[i]));
+      }
+    std::stable_sort(order.begin(), order.end(), GreaterRegionSize);
+    for(size_t i=0; i<order.size(); ++i)
+      {
+      this->Edges[i] = order[i].second;
+      }
+
+    this->MemoryAvailable = itk::ConditionVariable::New();
+  }
+
+  // Process all the edges with numThreads threads
+  void Execute(int numThreads)
+  {
+    this->DomainsMemory = this->Domains ? this->Domains->GetMemory() : 0;
+    numThreads = std::min(numThreads, static_cast<int>(this->Edges.size()));
+    numThreads = std::min(numThreads,
+      static_cast<int>(itk::MultiThreader::GetGlobalMaximumNumberOfThreads()));
+    if(numThreads<=1)
+      {
+      this->Run();
+      return;
+      }
+    std::cout << "Process "<<this->Edges.size()<<" edges with "<<numThreads<<" threads" << std::endl;
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numThreads);
+    threader->SetSingleMethod(EdgeScheduler::ThreadedRun, this);
+    threader->SingleMethodExecute();
+  }
+
+  int GetNumberOfFailures() const {return this->NumberOfFailures;}
+
+  itk::uint64_t MaximumMemory; //in bytes, 0 means no limit
+  bool BinaryWeight;
+  int SmoothingIteration;
+  bool CropWeights; //write the weights over the edge region only
+  std::string WeightDirectory;
+  int NumDigits;
+  const GlobalHeatDiffusion* GlobalDiffusion; //if set, the edges are solved with it
+  EdgeDomains* Domains; //of the edges, when not solved with GlobalDiffusion
+  SurfaceBand* Band; //if set, the weights are only kept there
+  SolverSettings Solver;
+
+private:
+  static bool GreaterRegionSize(const std::pair<size_t,int>& a, const std::pair<size_t,int>& b)
+  {
+    return a.first>b.first;
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreadedRun(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    static_cast<EdgeScheduler*>(info->UserData)->Run();
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  bool PopEdge(int& edgeId)
+  {
+    this->Lock.Lock();
+    bool hasEdge = this->NextEdge<this->Edges.size();
+    if(hasEdge)
+      {
+      edgeId = this->Edges[this->NextEdge++];
+      }
+    this->Lock.Unlock();
+    return hasEdge;
+  }
+
+  void Reserve(itk::uint64_t memory)
+  {
+    this->Lock.Lock();
+    //always let a single edge run, even if it is over the limit
+    while(this->MaximumMemory>0 && this->RunningEdges>0
+          && this->DomainsMemory+this->ReservedMemory+memory>this->MaximumMemory)
+      {
+      this->MemoryAvailable->Wait(&this->Lock);
+      }
+    this->ReservedMemory+=memory;
+    ++this->RunningEdges;
+    this->Lock.Unlock();
+  }
+
+  void Release(itk::uint64_t memory)
+  {
+    this->Lock.Lock();
+    this->ReservedMemory-=memory;
+    --this->RunningEdges;
+    this->MemoryAvailable->Broadcast();
+    this->Lock.Unlock();
+  }
+
+  // Free the voxel list of the domain of an edge
+  void ReleaseDomain(int edgeId)
+  {
+    itk::uint64_t memory = this->Domains->GetMemory(edgeId);
+    this->Domains->Release(edgeId);
+    this->Lock.Lock();
+    this->DomainsMemory-=memory;
+    this->MemoryAvailable->Broadcast();
+    this->Lock.Unlock();
+  }
+
+  void Run()
+  {
+    WeightImage::Pointer previousWeight;
+    int i;
+    while(this->PopEdge(i))
+      {
+      itk::uint64_t memory = 0;
+      bool reserved = false;
+      try
+        {
+        WeightImage::Pointer weight;
+        if(this->GlobalDiffusion)
+          {
+          memory = this->GlobalDiffusion->EstimateEdgeMemory();
+          this->Reserve(memory);
+          reserved = true;
+          weight = this->GlobalDiffusion->ComputeWeight(i);
+          }
+        else
+          {
+          //the domain image allocated by Initialize() is part of the estimate
+          Region weightRegion = GetWeightRegion(this->Domains->GetBoundingBox(i), this->BinaryWeight,
+                                                this->SmoothingIteration,
+                                                this->Armature.BodyMap->GetLargestPossibleRegion());
+          memory = EstimateEdgeMemory(weightRegion.GetNumberOfPixels(),
+                                      this->Domains->GetNumberOfVoxels(i), this->Solver);
+          if(!this->CropWeights && !this->Band)
+            {
+            memory+= 4*static_cast<itk::uint64_t>(this->NumberOfVoxels);
+            }
+          this->Reserve(memory);
+          reserved = true;
+
+          ArmatureEdge edge(this->Armature,i);
+          WriteLine(std::cout, edge.GetMessagePrefix()+"Process armature edge");
+          edge.Initialize(*this->Domains);
+          this->ReleaseDomain(i);
+
+          weight = edge.ComputeWeight(this->BinaryWeight,this->SmoothingIteration,
+                                      this->Solver, previousWeight);
+          if(this->Solver.InitialGuess==SolverSettings::PreviousGuess)
+            {
+            previousWeight = weight;
+            }
+          if(!this->CropWeights && !this->Band)
+            {
+            weight = UncropWeight(weight, this->Armature.BodyMap);
+            }
+          }
+        if(this->Band)
+          {
+          this->Band->SetWeight(i, weight);
+          }
+        else
+          {
+          std::stringstream filename;
+          filename<<this->WeightDirectory<<"/weight_"<<setfill('0')<<setw(this->NumDigits)<<i<<".mha";
+          WriteImage<WeightImage>(weight,filename.str().c_str());
+          }
+        }
+      catch(std::exception& e)
+        {
+        std::stringstream message;
+        message << "Failed to process armature edge "<<i<<": "<<e.what();
+        WriteLine(std::cerr, message.str());
+        this->Lock.Lock();
+        ++this->NumberOfFailures;
+        this->Lock.Unlock();
+        }
+      if(reserved)
+        {
+        this->Release(memory);
+        }
+      }
+  }
+
+  const ArmatureType& Armature;
+  std::vector<int> Edges;
+  size_t NextEdge;
+  size_t NumberOfVoxels;
+  itk::uint64_t ReservedMemory;
+  itk::uint64_t DomainsMemory; //of the domains not released yet
+  int RunningEdges; //that reserved their memory
+  int NumberOfFailures;
+  itk::SimpleMutexLock Lock;
+  itk::ConditionVariable::Pointer MemoryAvailable;
+};
+
 //-------------------------------------------------------------------------------
 int main( int argc, char * argv[] )
 {
@@ -1197,7 +3367,14 @@ int main( int argc, char * argv[] )
   //----------------------------
   // Read armature information
   //----------------------------
+  int numCores = static_cast<int>(itk::MultiThreader::GetGlobalDefaultNumberOfThreads());
+  int numThreads = NumberOfThreads>0 ? NumberOfThreads : numCores;
   ArmatureType armature(labelMap);
+  if(Partition=="Euclidean")
+    {
+    armature.Partition = ArmatureType::EuclideanPartition;
+    }
+  armature.NumberOfThreads = numThreads;
   armature.Init(ArmaturePoly.c_str(),InvertY);
 
   if (LastEdge<0)
@@ -1209,17 +3386,120 @@ int main( int argc, char * argv[] )
   //--------------------------------------------
   // Compute the domain of reach armature part
   //--------------------------------------------
-  int numDigits = NumDigits(armature.GetNumberOfEdges());
+  std::vector<int> edges;
   for(int i=FirstEdge; i<=LastEdge; ++i)
     {
-    ArmatureEdge edge(armature,i);
-    std::cout << "Process armature edge "<<i<<" with label "<<(int)edge.GetLabel() << std::endl;
-    edge.Initialize(BinaryWeight? 0 : ExpansionDistance);
-    WeightImage::Pointer weight = edge.ComputeWeight(BinaryWeight,SmoothingIteration);
-    std::stringstream filename;
-    filename<<WeightDirectory<<"/weight_"<<setfill('0')<<setw(numDigits)<<i<<".mha";
-    WriteImage<WeightImage>(weight,filename.str().c_str());
+    edges.push_back(i);
+    }
+
+  //--------------------------------------------
+  // Keep the weights on a band around a surface
+  //--------------------------------------------
+  SurfaceBand* band = 0;
+  bender::WeightValueType valueType(bender::FloatWeight);
+  if(!SurfaceInput.empty())
+    {
+    if(FirstEdge!=0 || LastEdge!=armature.GetNumberOfEdges()-1)
+      {
+      std::cerr << "The weight map of a surface needs the weights of all the edges" << std::endl;
+      return EXIT_FAILURE;
+      }
+    if(OutputWeightMap.empty())
+      {
+      std::cerr << "The weights of a surface need a weight map file" << std::endl;
+      return EXIT_FAILURE;
+      }
+    if(!bender::GetWeightValueType(WeightPrecision,valueType))
+      {
+      std::cerr << "Unknown weight precision " << WeightPrecision << std::endl;
+      return EXIT_FAILURE;
+      }
+    vtkNew<vtkPolyDataReader> reader;
+    reader->SetFileName(SurfaceInput.c_str());
+    reader->Update();
+    vtkPoints* points = reader->GetOutput()->GetPoints();
+    if(!points)
+      {
+      std::cerr << "Failed to read surface " << SurfaceInput << std::endl;
+      return EXIT_FAILURE;
+      }
+    band = new SurfaceBand(armature.BodyMap, points, InvertY, std::max(0, BandRadius),
+                           armature.GetNumberOfEdges());
+    std::cout << "Keep the weights of " << band->GetNumberOfVoxels()
+              << " voxels around the surface" << std::endl;
+    }
+
+  EdgeScheduler scheduler(armature, edges);
+  scheduler.BinaryWeight = BinaryWeight;
+  scheduler.SmoothingIteration = SmoothingIteration;
+  scheduler.CropWeights = CropWeights;
+  scheduler.WeightDirectory = WeightDirectory;
+  scheduler.NumDigits = NumDigits(armature.GetNumberOfEdges());
+  scheduler.MaximumMemory = 1024*1024*static_cast<itk::uint64_t>(std::max(0, MaximumMemory));
+  scheduler.Band = band;
+
+  if(Solver=="ConjugateGradient")
+    {
+    scheduler.Solver.Solver = SolverSettings::ConjugateGradient;
+    }
+  else if(Solver=="MatrixFree")
+    {
+    scheduler.Solver.Solver = SolverSettings::MatrixFree;
+    }
+  else if(Solver=="Multigrid")
+    {
+    scheduler.Solver.Solver = SolverSettings::Multigrid;
+    }
+  if(Preconditioner=="Jacobi")
+    {
+    scheduler.Solver.Preconditioner = SolverSettings::Jacobi;
     }
+  else if(Preconditioner=="Multigrid")
+    {
+    scheduler.Solver.Preconditioner = SolverSettings::MultigridPreconditioner;
+    }
+  scheduler.Solver.Tolerance = SolverTolerance;
+  scheduler.Solver.SmoothingTolerance = SmoothingTolerance;
+  scheduler.Solver.MaxIterations = MaximumIterations;
+  if(InitialGuess=="Voronoi")
+    {
+    scheduler.Solver.InitialGuess = SolverSettings::VoronoiGuess;
+    }
+  else if(InitialGuess=="Previous")
+    {
+    scheduler.Solver.InitialGuess = SolverSettings::PreviousGuess;
+    }
+
+  GlobalHeatDiffusion* globalDiffusion = 0;
+  if(GlobalSolve && !BinaryWeight)
+    {
+    std::cout << "Solve the heat diffusion of all edges over the whole body" << std::endl;
+    globalDiffusion = new GlobalHeatDiffusion(armature);
+    if(!globalDiffusion->IsFactorized())
+      {
+      std::cerr << "Factorization of the global heat diffusion failed" << std::endl;
+      delete globalDiffusion;
+      return EXIT_FAILURE;
+      }
+    scheduler.GlobalDiffusion = globalDiffusion;
+    }
+
+  EdgeDomains* domains = 0;
+  if(!globalDiffusion)
+    {
+    domains = new EdgeDomains(armature, edges, BinaryWeight? 0 : ExpansionDistance);
+    scheduler.Domains = domains;
+    }
+
+  //the cores left by the edge threads go to the matrix free operator
+  scheduler.Solver.NumberOfThreads = std::max(1, numCores/numThreads);
+  scheduler.Execute(numThreads);
+  delete globalDiffusion;
+  delete domains;
+
+  bool written = scheduler.GetNumberOfFailures()==0
+    && (!band || band->Write(OutputWeightMap, valueType));
+  delete band;
 
-  return EXIT_SUCCESS;
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
 }
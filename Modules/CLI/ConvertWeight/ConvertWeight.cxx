@@ -0,0 +1,299 @@
+/*=========================================================================
+
+  Program: Bender
+
+  Copyright (c) Kitware Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0.txt
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+=========================================================================*/
+
+#include "ConvertWeightCLP.h"
+
+//------- Bender-----------
+#include "benderDomainMask.h"
+#include "benderWeightMap.h"
+#include "benderWeightMapIO.h"
+
+//--------ITK --------------
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkPluginUtilities.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkContinuousIndex.h>
+#include <itkIndex.h>
+
+//--------VTK --------------
+#include <vtkSTLReader.h>
+#include <vtkPolyData.h>
+#include <vtkSmartPointer.h>
+#include <vtkPolyDataReader.h>
+#include <vtkXMLPolyDataReader.h>
+
+//--------standard-------------
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+typedef itk::Image<float, 3>  WeightImage;
+typedef itk::Image<bool, 3>  BoolImage;
+
+typedef itk::Index<3> Voxel;
+typedef itk::Offset<3> VoxelOffset;
+typedef itk::ImageRegion<3> Region;
+
+//-------------------------------------------------------------------------------
+class CubeNeighborhood
+{
+public:
+  CubeNeighborhood()
+  {
+    int index=0;
+    for(unsigned int i=0; i<=1; ++i)
+      {
+      for(unsigned int j=0; j<=1; ++j)
+        {
+        for(unsigned int k=0; k<=1; ++k,++index)
+          {
+          this->Offsets[index][0] = i;
+          this->Offsets[index][1] = j;
+          this->Offsets[index][2] = k;
+          }
+        }
+      }
+  }
+  VoxelOffset Offsets[8];
+};
+
+//-------------------------------------------------------------------------------
+vtkPolyData* ReadPolyData(const std::string& fileName, bool invertY=false)
+{
+  vtkPolyData* polyData = 0;
+  vtkSmartPointer<vtkPolyDataReader> pdReader;
+  vtkSmartPointer<vtkXMLPolyDataReader> pdxReader;
+  vtkSmartPointer<vtkSTLReader> stlReader;
+
+  // do we have vtk or vtp models?
+  std::string::size_type loc = fileName.find_last_of(".");
+  if( loc == std::string::npos )
+    {
+    std::cerr << "Failed to find an extension for " << fileName << std::endl;
+    return polyData;
+    }
+
+  std::string extension = fileName.substr(loc);
+
+  if( extension == std::string(".vtk") )
+    {
+    pdReader = vtkSmartPointer<vtkPolyDataReader>::New();
+    pdReader->SetFileName(fileName.c_str() );
+    pdReader->Update();
+    polyData = pdReader->GetOutput();
+    }
+  else if( extension == std::string(".vtp") )
+    {
+    pdxReader = vtkSmartPointer<vtkXMLPolyDataReader>::New();
+    pdxReader->SetFileName(fileName.c_str() );
+    pdxReader->Update();
+    polyData = pdxReader->GetOutput();
+    }
+  else if( extension == std::string(".stl") )
+    {
+    stlReader = vtkSmartPointer<vtkSTLReader>::New();
+    stlReader->SetFileName(fileName.c_str() );
+    stlReader->Update();
+    polyData = stlReader->GetOutput();
+    }
+  if( polyData == NULL )
+    {
+    std::cerr << "Failed to read surface " << fileName << std::endl;
+    return polyData;
+    }
+  // Build Cells
+  polyData->BuildLinks();
+
+  if(invertY)
+    {
+    vtkPoints* points = polyData->GetPoints();
+    for(int i=0; i<points->GetNumberOfPoints();++i)
+      {
+      double x[3];
+      points->GetPoint(i,x);
+      x[1]*=-1;
+      points->SetPoint(i, x);
+      }
+    }
+  polyData->Register(0);
+  return polyData;
+}
+
+
+//-------------------------------------------------------------------------------
+void ComputeDomainVoxels(const bender::DomainMask* image //input
+                         ,vtkPoints* points //input
+                         ,std::vector<Voxel>& domainVoxels //output
+                         )
+{
+  CubeNeighborhood cubeNeighborhood;
+  VoxelOffset* offsets = cubeNeighborhood.Offsets;
+
+  BoolImage::Pointer domain = BoolImage::New();
+  domain->SetRegions(image->GetLargestPossibleRegion());
+  domain->Allocate();
+  domain->FillBuffer(false);
+
+  for(int pi=0; pi<points->GetNumberOfPoints();++pi)
+    {
+    double xraw[3];
+    points->GetPoint(pi,xraw);
+
+    itk::Point<double,3> x(xraw);
+    itk::ContinuousIndex<double,3> coord;
+    image->TransformPhysicalPointToContinuousIndex(x, coord);
+
+    Voxel p;
+    p.CopyWithCast(coord);
+
+    for(int iOff=0; iOff<8; ++iOff)
+      {
+      Voxel q = p + offsets[iOff];
+      if(!domain->GetPixel(q))
+        {
+        domain->SetPixel(q,true);
+        domainVoxels.push_back(q);
+        }
+      }
+    }
+}
+
+//-------------------------------------------------------------------------------
+// Read the weights into a map of the type chosen at run time and write it
+struct ConvertWeights
+{
+  std::vector<std::string> FileNames; //input
+  std::vector<Voxel> Voxels; //input
+  bender::DomainMask::Pointer Domain; //input
+  std::string OutputWeightMap; //input
+
+  template<class WeightMapType>
+  bool operator()(WeightMapType& weightMap)
+  {
+    cout<<"Weights: "<<sizeof(typename WeightMapType::SiteIndex)<<" byte site indices, "
+        <<bender::WeightValueTraits<typename WeightMapType::ValueType>::GetName()<<" values"<<endl;
+    int numSites = this->FileNames.size();
+    return bender::ReadWeights(this->FileNames,this->Voxels,weightMap)==numSites
+      && bender::WriteWeightMap(this->OutputWeightMap,weightMap,this->Domain,numSites);
+  }
+};
+
+//-------------------------------------------------------------------------------
+int main( int argc, char * argv[] )
+{
+  PARSE_ARGS;
+
+  cout<<"Convert weights in "<<WeightDirectory<<" to "<<OutputWeightMap<<endl;
+
+  //----------------------------
+  // Read the first weight image
+  // and all file names
+  //----------------------------
+  vector<string> fnames;
+  bender::GetWeightFileNames(WeightDirectory, fnames);
+  int numSites = fnames.size();
+  if(numSites<1)
+    {
+    cerr<<"No weight file is found."<<endl;
+    return EXIT_FAILURE;
+    }
+  size_t siteIndexSize = bender::GetSiteIndexSize(numSites);
+  if(siteIndexSize==0)
+    {
+    cerr<<"Too many weight files: "<<numSites<<endl;
+    return EXIT_FAILURE;
+    }
+  bender::WeightValueType valueType;
+  if(!bender::GetWeightValueType(WeightPrecision,valueType))
+    {
+    cerr<<"Unknown weight precision "<<WeightPrecision<<endl;
+    return EXIT_FAILURE;
+    }
+
+  //the weight images can be cropped, their geometry covers all of them
+  bender::DomainMask::GeometryImage::Pointer geometry = bender::ReadWeightGeometry(fnames);
+  if(!geometry)
+    {
+    cerr<<"The weights in "<<WeightDirectory<<" do not have the same geometry"<<endl;
+    return EXIT_FAILURE;
+    }
+  Region weightRegion = geometry->GetLargestPossibleRegion();
+  cout<<"Weight volume description: "<<endl;
+  cout<<weightRegion<<endl;
+
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  if(!bender::ReadWeightDomain(fnames,geometry,domain))
+    {
+    return EXIT_FAILURE;
+    }
+  cout<<domain->GetNumberOfVoxelsInDomain()<<" foreground voxels"<<endl;
+
+  //----------------------------
+  // Voxels to store
+  //----------------------------
+  ConvertWeights convert;
+  convert.FileNames = fnames;
+  convert.Domain = domain;
+  convert.OutputWeightMap = OutputWeightMap;
+  std::vector<Voxel>& domainVoxels = convert.Voxels;
+  if(!InputSurface.empty())
+    {
+    vtkSmartPointer<vtkPolyData> surface;
+    surface.TakeReference(ReadPolyData(InputSurface.c_str(),InvertY));
+    if(!surface)
+      {
+      return EXIT_FAILURE;
+      }
+    ComputeDomainVoxels(domain,surface->GetPoints(),domainVoxels);
+    cout<<surface->GetNumberOfPoints()<<" points, "<<domainVoxels.size()<<" voxels"<<endl;
+    }
+  else
+    {
+    const Voxel& start = weightRegion.GetIndex();
+    const Region::SizeType& size = weightRegion.GetSize();
+    Voxel v;
+    for(v[2]=start[2]; v[2]<start[2]+static_cast<itk::IndexValueType>(size[2]); ++v[2])
+      {
+      for(v[1]=start[1]; v[1]<start[1]+static_cast<itk::IndexValueType>(size[1]); ++v[1])
+        {
+        for(v[0]=start[0]; v[0]<start[0]+static_cast<itk::IndexValueType>(size[0]); ++v[0])
+          {
+          if(domain->GetPixel(v))
+            {
+            domainVoxels.push_back(v);
+            }
+          }
+        }
+      }
+    cout<<domainVoxels.size()<<" body voxels"<<endl;
+    }
+
+  //----------------------------
+  // Read and write weights
+  //----------------------------
+  if(!bender::DispatchWeightMap(siteIndexSize,valueType,convert))
+    {
+    return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
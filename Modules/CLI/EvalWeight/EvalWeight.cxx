@@ -21,6 +21,7 @@
 #include "EvalWeightCLP.h"
 
 //------- Bender-----------
+#include "benderDomainMask.h"
 #include "benderWeightMap.h"
 #include "benderWeightMapMath.h"
 #include "benderWeightMapIO.h"
@@ -170,7 +171,7 @@ vtkPolyData* ReadPolyData(const std::string& fileName, bool invertY=false)
 
 
 //-------------------------------------------------------------------------------
-void ComputeDomainVoxels(WeightImage::Pointer image //input
+void ComputeDomainVoxels(const bender::DomainMask* image //input
                          ,vtkPoints* points //input
                          ,std::vector<Voxel>& domainVoxels //output
                          )
@@ -219,11 +220,49 @@ void WritePolyData(vtkPolyData* polyData, const std::string& fileName)
 }
 
 
+//-------------------------------------------------------------------------------
+// Fill a weight map of the type chosen at run time and interpolate the
+// weights of the points with it
+struct InterpolateWeights
+{
+  std::vector<std::string> FileNames; //input
+  std::string WeightMapFile; //input
+  vtkPoints* Points; //input
+  const double* Coordinates; //input, the coordinates of Points
+  bender::DomainMask::Pointer Domain; //input, set by the map file if any
+  bender::WeightBatch Weights; //output
+
+  template<class WeightMapType>
+  bool operator()(WeightMapType& weightMap)
+  {
+    if(!this->WeightMapFile.empty())
+      {
+      if(!bender::ReadWeightMap(this->WeightMapFile,weightMap,this->Domain.GetPointer()))
+        {
+        return false;
+        }
+      }
+    else
+      {
+      std::vector<Voxel> domainVoxels;
+      ComputeDomainVoxels(this->Domain,this->Points,domainVoxels);
+      cout<<this->Points->GetNumberOfPoints()<<" points, "<<domainVoxels.size()<<" voxels"<<endl;
+
+      if(!bender::ReadWeights(this->FileNames,domainVoxels,weightMap))
+        {
+        return false;
+        }
+      }
+    bender::LerpBatch<bender::DomainMask>(weightMap,this->Domain, true, this->Coordinates,
+                                          this->Points->GetNumberOfPoints(), this->Weights);
+    return true;
+  }
+};
+
 //-------------------------------------------------------------------------------
 int main( int argc, char * argv[] )
 {
   PARSE_ARGS;
-  typedef bender::WeightMap WeightMap;
 
   cout<<"Evaluate weight in  "<<WeightDirectory<<endl;
   cout<<"Evaluating surface: "<<InputSurface<<endl;
@@ -240,28 +279,60 @@ int main( int argc, char * argv[] )
   vector<string> fnames;
   bender::GetWeightFileNames(WeightDirectory, fnames);
   int numSites = fnames.size();
-  if(numSites<1)
+  //the weight map of ArmatureWeight --surface comes without weight images
+  bool mapOnly = numSites==0 && !WeightMapFile.empty();
+  if(numSites<1 && !mapOnly)
     {
     cerr<<"No weight file is found."<<endl;
     return 1;
     }
 
-  typedef itk::ImageFileReader<WeightImage>  ReaderType;
-  ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(fnames[0].c_str());
-  reader->Update();
-
-  WeightImage::Pointer weight0 =  reader->GetOutput();
-  Region weightRegion = weight0->GetLargestPossibleRegion();
-  cout<<"Weight volume description: "<<endl;
-  cout<<weightRegion<<endl;
-
-  int numForeGround(0);
-  for(itk::ImageRegionIterator<WeightImage> it(weight0,weightRegion);!it.IsAtEnd(); ++it)
+  //the domain of the weights replaces the weight images, which are not
+  //kept in memory. The weight images can be cropped.
+  bender::DomainMask::GeometryImage::Pointer geometry;
+  if(!mapOnly)
     {
-    numForeGround+= it.Get()>=0;
+    geometry = bender::ReadWeightGeometry(fnames);
+    if(!geometry)
+      {
+      cerr<<"The weights in "<<WeightDirectory<<" do not have the same geometry"<<endl;
+      return 1;
+      }
+    }
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  size_t siteIndexSize(0);
+  bender::WeightValueType valueType(bender::FloatWeight);
+  if(!WeightMapFile.empty())
+    {
+    bender::WeightMapInformation information;
+    if(!bender::ReadWeightMapInformation(WeightMapFile,information)
+       || (!mapOnly && information.NumberOfSites!=numSites))
+      {
+      cerr<<WeightMapFile<<" does not match the weights in "<<WeightDirectory<<endl;
+      return 1;
+      }
+    numSites = information.NumberOfSites;
+    siteIndexSize = information.SiteIndexSize;
+    valueType = information.ValueType;
+    }
+  else
+    {
+    if(!bender::ReadWeightDomain(fnames,geometry,domain))
+      {
+      return 1;
+      }
+    siteIndexSize = bender::GetSiteIndexSize(numSites);
+    if(siteIndexSize==0)
+      {
+      cerr<<"Too many weight files: "<<numSites<<endl;
+      return 1;
+      }
+    if(!bender::GetWeightValueType(WeightPrecision,valueType))
+      {
+      cerr<<"Unknown weight precision "<<WeightPrecision<<endl;
+      return 1;
+      }
     }
-  cout<<numForeGround<<" foreground voxels"<<endl;
 
   //----------------------------
   // Read in the stl file
@@ -271,15 +342,35 @@ int main( int argc, char * argv[] )
 
   vtkPoints* points = surface->GetPoints();
   int numPoints = points->GetNumberOfPoints();
-  std::vector<Voxel> domainVoxels;
-  ComputeDomainVoxels(weight0,points,domainVoxels);
-  cout<<points->GetNumberOfPoints()<<" points, "<<domainVoxels.size()<<" voxels"<<endl;
 
   //----------------------------
-  // Read Weights
+  // Read Weights and interpolate
+  // the weights of all the
+  // points at once
   //----------------------------
-  WeightMap weightMap;
-  bender::ReadWeights(fnames,domainVoxels,weightMap);
+  std::vector<double> xyz(3*numPoints);
+  for(int pi=0; pi<numPoints;++pi)
+    {
+    points->GetPoint(pi,&xyz[3*pi]);
+    }
+  InterpolateWeights interpolate;
+  interpolate.FileNames = fnames;
+  interpolate.WeightMapFile = WeightMapFile;
+  interpolate.Points = points;
+  interpolate.Coordinates = xyz.empty() ? 0 : &xyz[0];
+  interpolate.Domain = domain;
+  if(!bender::DispatchWeightMap(siteIndexSize,valueType,interpolate)
+     || (geometry && domain->GetLargestPossibleRegion()!=geometry->GetLargestPossibleRegion()))
+    {
+    cerr<<"Cannot read the weights"<<endl;
+    return 1;
+    }
+  const bender::WeightBatch& weights = interpolate.Weights;
+
+  Region weightRegion = domain->GetLargestPossibleRegion();
+  cout<<"Weight volume description: "<<endl;
+  cout<<weightRegion<<endl;
+  cout<<domain->GetNumberOfVoxelsInDomain()<<" foreground voxels"<<endl;
 
   //----------------------------
   //Perform interpolation
@@ -297,8 +388,16 @@ int main( int argc, char * argv[] )
       arr->SetValue(j,0.0);
       }
 
-    string name = vtksys::SystemTools::GetFilenameWithoutExtension(fnames[i]);
-    arr->SetName(name.c_str());
+    std::stringstream name;
+    if(mapOnly)
+      {
+      name<<"weight_"<<i;
+      }
+    else
+      {
+      name<<vtksys::SystemTools::GetFilenameWithoutExtension(fnames[i]);
+      }
+    arr->SetName(name.str().c_str());
     pointData->AddArray(arr);
     surfaceVertexWeights.push_back(arr);
     arr->Delete();
@@ -306,27 +405,18 @@ int main( int argc, char * argv[] )
     }
 
   int numZeros(0);
-  WeightMap::WeightVector w_pi(numSites);
-  WeightMap::WeightVector w_corner(numSites);
-  for(int pi=0; pi<points->GetNumberOfPoints();++pi)
+  for(int pi=0; pi<numPoints;++pi)
     {
-    double xraw[3];
-    points->GetPoint(pi,xraw);
-
-    itk::Point<double,3> x(xraw);
-    itk::ContinuousIndex<double,3> coord;
-    weight0->TransformPhysicalPointToContinuousIndex(x, coord);
-    bool res = bender::Lerp<WeightImage>(weightMap,coord,weight0, 0, w_pi);
-    if(!res)
+    if(!weights.Valid[pi])
       {
-      cerr<<"Lerp failed for "<<coord<<endl;
+      cerr<<"Lerp failed for point "<<pi<<endl;
       }
     else
       {
-      numZeros+=w_pi.GetNorm()==0;
-      for(int i=0; i<numSites;++i)
+      numZeros+=weights.Offsets[pi]==weights.Offsets[pi+1];
+      for(size_t k=weights.Offsets[pi]; k<weights.Offsets[pi+1]; ++k)
         {
-        surfaceVertexWeights[i]->SetValue(pi, w_pi[i]);
+        surfaceVertexWeights[weights.Indices[k]]->SetValue(pi, weights.Values[k]);
         }
       }
     }
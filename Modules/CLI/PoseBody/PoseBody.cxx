@@ -21,6 +21,8 @@
 #include "PoseBodyCLP.h"
 
 #include "dqconv.h"
+#include "benderDomainMask.h"
+#include "benderSkinning.h"
 #include "benderWeightMap.h"
 #include "benderWeightMapIO.h"
 #include "benderWeightMapMath.h"
@@ -37,6 +39,7 @@
 #include <itkIndex.h>
 #include <itkLinearInterpolateImageFunction.h>
 #include <itkMatrix.h>
+#include <itkMultiThreader.h>
 
 #include <vtkTimerLog.h>
 #include <vtkSTLReader.h>
@@ -644,7 +647,7 @@ void TestInterpolation()
 }
 
 //-------------------------------------------------------------------------------
-void ComputeDomainVoxels(WeightImage::Pointer image //input
+void ComputeDomainVoxels(const bender::DomainMask* image //input
                          ,vtkPoints* points //input
                          ,std::vector<Voxel>& domainVoxels //output
                          )
@@ -682,57 +685,356 @@ void ComputeDomainVoxels(WeightImage::Pointer image //input
 }
 
 //-------------------------------------------------------------------------------
-int main( int argc, char * argv[] )
+// Fill a weight map of the type chosen at run time and interpolate the
+// weights of the vertices with it
+struct InterpolateWeights
 {
-  typedef bender::WeightMap WeightMap;
-  //run some tests
-  TestTransformBlending();
-  TestVersor();
-  TestInterpolation();
+  std::vector<std::string> FileNames; //input
+  std::string WeightMapFile; //input
+  vtkPoints* Points; //input
+  const double* Vertices; //input, the coordinates of Points
+  int MaximumInfluences; //input
+  int NumberOfThreads; //input, 0 for the ITK default
+  bender::DomainMask::Pointer Domain; //input, set by the map file if any
+  bender::WeightBatch* Weights; //output
+
+  template<class WeightMapType>
+  bool operator()(WeightMapType& weightMap)
+  {
+    typedef typename WeightMapType::SiteIndex SiteIndex;
+    typedef typename WeightMapType::ValueType ValueType;
 
-  PARSE_ARGS;
+    if(!this->WeightMapFile.empty())
+      {
+      if(!bender::ReadWeightMap(this->WeightMapFile,weightMap,this->Domain.GetPointer()))
+        {
+        return false;
+        }
+      }
+    else
+      {
+      std::vector<Voxel> domainVoxels;
+      ComputeDomainVoxels(this->Domain,this->Points,domainVoxels);
+      cout<<this->Points->GetNumberOfPoints()<<" vertices, "<<domainVoxels.size()<<" voxels"<<endl;
 
+      if(!bender::ReadWeights(this->FileNames,domainVoxels,weightMap))
+        {
+        return false;
+        }
+      }
+    cout<<"Weights: "<<sizeof(SiteIndex)<<" byte site indices, "
+        <<bender::WeightValueTraits<ValueType>::GetName()<<" values"<<endl;
 
-  cout<<"Armature Y coordinate will be inverted\n";
+    int numPoints = this->Points->GetNumberOfPoints();
+    if(this->MaximumInfluences==4)
+      {
+      bender::FixedWeightMap<4,SiteIndex,ValueType> weightMap4;
+      weightMap4.Init(weightMap);
+      weightMap = WeightMapType();
+      bender::LerpBatch<bender::DomainMask>(weightMap4,this->Domain, true, this->Vertices, numPoints, *this->Weights,
+                                            this->NumberOfThreads);
+      }
+    else if(this->MaximumInfluences==8)
+      {
+      bender::FixedWeightMap<8,SiteIndex,ValueType> weightMap8;
+      weightMap8.Init(weightMap);
+      weightMap = WeightMapType();
+      bender::LerpBatch<bender::DomainMask>(weightMap8,this->Domain, true, this->Vertices, numPoints, *this->Weights,
+                                            this->NumberOfThreads);
+      }
+    else
+      {
+      bender::LerpBatch<bender::DomainMask>(weightMap,this->Domain, true, this->Vertices, numPoints, *this->Weights,
+                                            this->NumberOfThreads);
+      }
+    if(this->MaximumInfluences>0)
+      {
+      //the interpolation merges the sites of the 8 corners of a cell
+      bender::LimitInfluences(*this->Weights, this->MaximumInfluences);
+      }
+    return true;
+  }
+};
 
-  if(LinearBlend)
-    {
-    cout<<"Use Linear Blend"<<endl;
-    }
-  else
-    {
-    cout<<"Use Dual Quaternion blend"<<endl;
-    }
+//-------------------------------------------------------------------------------
+// Pose the vertices with their interpolated weights. The vertices are split
+// in one chunk per thread, each thread writes the posed vertices of its
+// chunk straight to the buffer of the output points, and their weights to
+// the arrays of the sites. The bones are precomputed in skinning, as 3x4
+// matrices, and in dqSkinning, as dual quaternions.
+class PoseVertices
+{
+public:
+  PoseVertices(const bender::LinearBlendSkinning& skinning,
+               const bender::DualQuaternionSkinning& dqSkinning,
+               const bender::WeightBatch& weights, bool linearBlend)
+    :Matrices(skinning), DualQuaternions(dqSkinning), Weights(weights), LinearBlend(linearBlend),
+     Vertices(0), NumberOfVertices(0), FloatPoints(0), DoublePoints(0)
+  {
+  }
+
+  void Execute(const double* vertices, size_t numVertices, vtkPoints* outPoints,
+               const std::vector<vtkFloatArray*>& vertexWeights, int numThreads)
+  {
+    this->Vertices = vertices;
+    this->NumberOfVertices = numVertices;
+    if(outPoints->GetDataType()!=VTK_FLOAT && outPoints->GetDataType()!=VTK_DOUBLE)
+      {
+      outPoints->SetDataTypeToDouble();
+      outPoints->SetNumberOfPoints(numVertices);
+      }
+    this->FloatPoints = outPoints->GetDataType()==VTK_FLOAT ?
+      static_cast<float*>(outPoints->GetVoidPointer(0)) : 0;
+    this->DoublePoints = outPoints->GetDataType()==VTK_DOUBLE ?
+      static_cast<double*>(outPoints->GetVoidPointer(0)) : 0;
+    this->VertexWeights.clear();
+    for(size_t i=0; i<vertexWeights.size(); ++i)
+      {
+      this->VertexWeights.push_back(vertexWeights[i]->GetPointer(0));
+      }
+
+    if(numThreads<=0)
+      {
+      numThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+      }
+    numThreads = std::min(numThreads,
+      static_cast<int>(itk::MultiThreader::GetGlobalMaximumNumberOfThreads()));
+    numThreads = std::max(1, std::min(numThreads, static_cast<int>(numVertices/1024)+1));
+    if(numThreads==1)
+      {
+      this->RunChunk(0, 1);
+      return;
+      }
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numThreads);
+    threader->SetSingleMethod(PoseVertices::ThreadedRun, this);
+    threader->SingleMethodExecute();
+  }
+
+private:
+  static ITK_THREAD_RETURN_TYPE ThreadedRun(void* arg)
+  {
+    itk::MultiThreader::ThreadInfoStruct* info =
+      static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    static_cast<PoseVertices*>(info->UserData)->RunChunk(info->ThreadID, info->NumberOfThreads);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  void RunChunk(int threadId, int numThreads)
+  {
+    const size_t first = this->NumberOfVertices*threadId/numThreads;
+    const size_t last = this->NumberOfVertices*(threadId+1)/numThreads;
+    const bender::WeightBatch& weights = this->Weights;
+    for(size_t pi=first; pi<last; ++pi)
+      {
+      if(weights.Valid[pi])
+        {
+        for(size_t k=weights.Offsets[pi]; k<weights.Offsets[pi+1]; ++k)
+          {
+          this->VertexWeights[weights.Indices[k]][pi] = weights.Values[k];
+          }
+        }
+      }
+
+    if(this->FloatPoints)
+      {
+      this->Pose(first, last, this->FloatPoints);
+      }
+    else
+      {
+      this->Pose(first, last, this->DoublePoints);
+      }
+  }
+
+  template<class T>
+  void Pose(size_t first, size_t last, T* posed)
+  {
+    if(this->LinearBlend)
+      {
+      this->Matrices.Apply(this->Vertices, this->Weights, first, last, posed);
+      }
+    else
+      {
+      this->DualQuaternions.Apply(this->Vertices, this->Weights, first, last, posed);
+      }
+  }
+
+  const bender::LinearBlendSkinning& Matrices;
+  const bender::DualQuaternionSkinning& DualQuaternions;
+  const bender::WeightBatch& Weights;
+  bool LinearBlend;
+
+  const double* Vertices; //x,y,z of each vertex
+  size_t NumberOfVertices;
+  float* FloatPoints; //output, one of them is set
+  double* DoublePoints;
+  std::vector<float*> VertexWeights; //output, one array per site
+};
+
+//-------------------------------------------------------------------------------
+// Read the weights, from the weight directory or from the weight map file,
+// and interpolate the weights of all the vertices at once
+bool BindVertices(const std::string& weightDirectory, const std::string& weightMapFile,
+                  const std::string& weightPrecision, int maximumInfluences, int numThreads,
+                  vtkPoints* inputPoints, const double* vertices,
+                  bender::WeightBatch& weights, int& numSites)
+{
+  int numPoints = inputPoints->GetNumberOfPoints();
 
   //----------------------------
   // Read the first weight image
   // and all file names
   //----------------------------
   vector<string> fnames;
-  bender::GetWeightFileNames(WeightDirectory, fnames);
-  int numSites = fnames.size();
-  if(numSites<1)
+  bender::GetWeightFileNames(weightDirectory, fnames);
+  numSites = fnames.size();
+  //the weight map of ArmatureWeight --surface comes without weight images
+  bool mapOnly = numSites==0 && !weightMapFile.empty();
+  if(numSites<1 && !mapOnly)
     {
     cerr<<"No weight file is found."<<endl;
-    return 1;
+    return false;
+    }
+
+  //the domain of the weights replaces the weight images, which are not
+  //kept in memory. The weight images can be cropped.
+  bender::DomainMask::GeometryImage::Pointer geometry;
+  if(!mapOnly)
+    {
+    geometry = bender::ReadWeightGeometry(fnames);
+    if(!geometry)
+      {
+      cerr<<"The weights in "<<weightDirectory<<" do not have the same geometry"<<endl;
+      return false;
+      }
+    }
+  bender::DomainMask::Pointer domain = bender::DomainMask::New();
+  size_t siteIndexSize(0);
+  bender::WeightValueType valueType(bender::FloatWeight);
+  if(!weightMapFile.empty())
+    {
+    bender::WeightMapInformation information;
+    if(!bender::ReadWeightMapInformation(weightMapFile,information)
+       || (!mapOnly && information.NumberOfSites!=numSites))
+      {
+      cerr<<weightMapFile<<" does not match the weights in "<<weightDirectory<<endl;
+      return false;
+      }
+    numSites = information.NumberOfSites;
+    siteIndexSize = information.SiteIndexSize;
+    valueType = information.ValueType;
+    }
+  else
+    {
+    if(!bender::ReadWeightDomain(fnames,geometry,domain))
+      {
+      return false;
+      }
+    siteIndexSize = bender::GetSiteIndexSize(numSites);
+    if(siteIndexSize==0)
+      {
+      cerr<<"Too many weight files: "<<numSites<<endl;
+      return false;
+      }
+    if(!bender::GetWeightValueType(weightPrecision,valueType))
+      {
+      cerr<<"Unknown weight precision "<<weightPrecision<<endl;
+      return false;
+      }
     }
 
-  typedef itk::ImageFileReader<WeightImage>  ReaderType;
-  ReaderType::Pointer reader = ReaderType::New();
-  reader->SetFileName(fnames[0].c_str());
-  reader->Update();
+  //----------------------------
+  // Read Weights and interpolate
+  // the weights of all the
+  // vertices at once
+  //----------------------------
+  InterpolateWeights interpolate;
+  interpolate.FileNames = fnames;
+  interpolate.WeightMapFile = weightMapFile;
+  interpolate.Points = inputPoints;
+  interpolate.Vertices = vertices;
+  interpolate.MaximumInfluences = maximumInfluences;
+  interpolate.NumberOfThreads = numThreads;
+  interpolate.Domain = domain;
+  interpolate.Weights = &weights;
+  if(!bender::DispatchWeightMap(siteIndexSize,valueType,interpolate)
+     || (geometry && domain->GetLargestPossibleRegion()!=geometry->GetLargestPossibleRegion()))
+    {
+    cerr<<"Cannot read the weights"<<endl;
+    return false;
+    }
 
-  WeightImage::Pointer weight0 =  reader->GetOutput();
-  Region weightRegion = weight0->GetLargestPossibleRegion();
+  Region weightRegion = domain->GetLargestPossibleRegion();
   cout<<"Weight volume description: "<<endl;
   cout<<weightRegion<<endl;
+  cout<<domain->GetNumberOfVoxelsInDomain()<<" foreground voxels"<<endl;
+
+  //----------------------------
+  // Check surface points
+  //----------------------------
+  int numBad(0);
+  int numInterior(0);
+  CubeNeighborhood cubeNeighborhood;
+  VoxelOffset* offsets = cubeNeighborhood.Offsets ;
+  for(int pi=0; pi<numPoints;++pi)
+    {
+    double xraw[3];
+    inputPoints->GetPoint(pi,xraw);
+
+    itk::Point<double,3> x(xraw);
+
+    itk::ContinuousIndex<double,3> coord;
+    domain->TransformPhysicalPointToContinuousIndex(x, coord);
+
+    Voxel p;
+    p.CopyWithCast(coord);
 
-  int numForeGround(0);
-  for(itk::ImageRegionIterator<WeightImage> it(weight0,weightRegion);!it.IsAtEnd(); ++it)
+    bool hasInside(false);
+    bool hasOutside(false);
+    for(int iOff=0; iOff<8; ++iOff)
+      {
+      Voxel q = p + offsets[iOff];
+      if(domain->GetPixel(q))
+        {
+        hasInside=true;
+        }
+      else
+        {
+        hasOutside=true;
+        }
+      }
+    numBad+= hasInside? 0 : 1;
+    numInterior+= hasOutside? 0: 1;
+    }
+  if(numBad>0)
+    {
+    cout<<"WARNING: "<<numBad<<" bad surface vertices."<<endl;
+    }
+
+  return true;
+}
+
+//-------------------------------------------------------------------------------
+int main( int argc, char * argv[] )
+{
+  //run some tests
+  TestTransformBlending();
+  TestVersor();
+  TestInterpolation();
+
+  PARSE_ARGS;
+
+
+  cout<<"Armature Y coordinate will be inverted\n";
+
+  if(LinearBlend)
+    {
+    cout<<"Use Linear Blend"<<endl;
+    }
+  else
     {
-    numForeGround+= it.Get()>=0;
+    cout<<"Use Dual Quaternion blend"<<endl;
     }
-  cout<<numForeGround<<" foreground voxels"<<endl;
 
   //----------------------------
   // Read in the surface file
@@ -742,16 +1044,48 @@ int main( int argc, char * argv[] )
 
   vtkPoints* inputPoints = inSurface->GetPoints();
   int numPoints = inputPoints->GetNumberOfPoints();
-  std::vector<Voxel> domainVoxels;
-  ComputeDomainVoxels(weight0,inputPoints,domainVoxels);
-  cout<<numPoints<<" vertices, "<<domainVoxels.size()<<" voxels"<<endl;
 
+  std::vector<double> vertices(3*numPoints);
+  for(int pi=0; pi<numPoints;++pi)
+    {
+    inputPoints->GetPoint(pi,&vertices[3*pi]);
+    }
 
   //----------------------------
-  // Read Weights
+  // Read the weights of the
+  // vertices, or bind them
   //----------------------------
-  WeightMap weightMap;
-  bender::ReadWeights(fnames,domainVoxels,weightMap);
+  bender::WeightBatch weights;
+  int numSites(0);
+  if(!SkinBinding.empty())
+    {
+    if(!WeightDirectory.empty() || !WeightMapFile.empty())
+      {
+      cerr<<"A skin binding is used without weight directory and weight map"<<endl;
+      return 1;
+      }
+    numSites = bender::ReadSkinBinding(SkinBinding,weights);
+    if(numSites==0 || weights.Valid.size()!=static_cast<size_t>(numPoints))
+      {
+      cerr<<SkinBinding<<" does not match the vertices of "<<SurfaceInput<<endl;
+      return 1;
+      }
+    }
+  else
+    {
+    if(!BindVertices(WeightDirectory,WeightMapFile,WeightPrecision,MaximumInfluences,NumberOfThreads,
+                     inputPoints,vertices.empty() ? 0 : &vertices[0],weights,numSites))
+      {
+      return 1;
+      }
+    //the weights of a skin binding are normalized, so are the weights of
+    //the output surface
+    bender::NormalizeWeights(weights);
+    if(!OutputBinding.empty() && !bender::WriteSkinBinding(OutputBinding,weights,numSites))
+      {
+      return 1;
+      }
+    }
 
   //----------------------------
   // Read armature
@@ -786,61 +1120,35 @@ int main( int argc, char * argv[] )
     ++edgeId;
     }
 
+  if(static_cast<size_t>(numSites)>transforms.size())
+    {
+    cerr<<"The armature has "<<transforms.size()<<" edges for "<<numSites<<" weights"<<endl;
+    return 1;
+    }
   numSites = transforms.size();
-  std::vector<Mat24> dqs;
+  bender::LinearBlendSkinning skinning;
+  skinning.SetNumberOfBones(transforms.size());
+  bender::DualQuaternionSkinning dqSkinning;
+  dqSkinning.SetNumberOfBones(transforms.size());
   for(size_t i=0; i<transforms.size(); ++i)
     {
-    Mat24 dq;
     RigidTransform& trans = transforms[i];
     Vec3 T = trans.GetTranslationComponent();
-    QuatTrans2UDQ(&trans.R[0], &T[0], (double (*)[4]) &dq(0,0));
-    dqs.push_back(dq);
-    }
-
-  cout<<"Read "<<numSites<<" transforms"<<endl;
+    dqSkinning.SetBone(i, &trans.R[0], &T[0]);
 
-  //----------------------------
-  // Check surface points
-  //----------------------------
-  int numBad(0);
-  int numInterior(0);
-  CubeNeighborhood cubeNeighborhood;
-  VoxelOffset* offsets = cubeNeighborhood.Offsets ;
-  for(int pi=0; pi<numPoints;++pi)
-    {
-    double xraw[3];
-    inputPoints->GetPoint(pi,xraw);
-
-    itk::Point<double,3> x(xraw);
-
-    itk::ContinuousIndex<double,3> coord;
-    weight0->TransformPhysicalPointToContinuousIndex(x, coord);
-
-    Voxel p;
-    p.CopyWithCast(coord);
-
-    bool hasInside(false);
-    bool hasOutside(false);
-    for(int iOff=0; iOff<8; ++iOff)
+    Mat33 R = ToRotationMatrix(trans.R);
+    double rotation[3][3];
+    for(int r=0; r<3; ++r)
       {
-      Voxel q = p + offsets[iOff];
-      if(weight0->GetPixel(q)>=0)
-        {
-        hasInside=true;
-        }
-      else
+      for(int c=0; c<3; ++c)
         {
-        hasOutside=true;
+        rotation[r][c] = R(r,c);
         }
       }
-    numBad+= hasInside? 0 : 1;
-    numInterior+= hasOutside? 0: 1;
-    }
-  if(numBad>0)
-    {
-    cout<<"WARNING: "<<numBad<<" bad surface vertices."<<endl;
+    skinning.SetBone(i, rotation, &T[0]);
     }
 
+  cout<<"Read "<<numSites<<" transforms"<<endl;
 
   //----------------------------
   // Perform interpolation
@@ -869,72 +1177,19 @@ int main( int argc, char * argv[] )
     assert(outData->GetArray(i)->GetNumberOfTuples()==numPoints);
     }
 
-  WeightMap::WeightVector w_pi(numSites);
-  WeightMap::WeightVector w_corner(numSites);
-  for(int pi=0; pi<inputPoints->GetNumberOfPoints();++pi)
+  for(int pi=0; pi<numPoints;++pi)
     {
-    double xraw[3];
-    inputPoints->GetPoint(pi,xraw);
-
-    itk::Point<double,3> x(xraw);
-
-    itk::ContinuousIndex<double,3> coord;
-    weight0->TransformPhysicalPointToContinuousIndex(x, coord);
-
-    bool res = bender::Lerp<WeightImage>(weightMap,coord,weight0, 0, w_pi);
-    if(!res)
-      {
-      cerr<<"Lerp failed for "<<coord<<endl;
-      }
-    else
-      {
-//    NormalizeWeight(w_pi);
-      for(int i=0; i<numSites;++i)
-        {
-        surfaceVertexWeights[i]->SetValue(pi, w_pi[i]);
-        }
-      }
-
-    double wSum(0.0);
-    for(int i=0; i<numSites;++i)
-      {
-      wSum+=w_pi[i];
-      }
-
-    Vec3 y(0.0);
-    if(LinearBlend)
-      {
-      assert(wSum>=0);
-      for(int i=0; i<numSites;++i)
-        {
-        double w = w_pi[i]/wSum;
-        const RigidTransform& Fi(transforms[i]);
-        double yi[3];
-        Fi.Apply(xraw,yi);
-        y+= w*Vec3(yi);
-        }
-      }
-    else
+    if(!weights.Valid[pi])
       {
-      Mat24 dq;
-      dq.Fill(0.0);
-      for(int i=0; i<numSites;++i)
-        {
-        double w = w_pi[i]/wSum;
-        Mat24& dq_i(dqs[i]);
-        dq+= dq_i*w;
-        }
-      Vec4 q;
-      Vec3 t;
-      DQ2QuatTrans((const double (*)[4])&dq(0,0), &q[0], &t[0]);
-      y = Vec3(xraw);
-      ApplyQT(q,t,&y[0]);
+      cerr<<"Lerp failed for vertex "<<pi<<endl;
       }
-
-    outPoints->SetPoint(pi,y[0],y[1],y[2]);
-
     }
 
+  PoseVertices pose(skinning, dqSkinning, weights, LinearBlend);
+  pose.Execute(vertices.empty() ? 0 : &vertices[0], numPoints, outPoints, surfaceVertexWeights,
+               NumberOfThreads);
+  outPoints->Modified();
+
   //----------------------------
   // Write output
   //----------------------------